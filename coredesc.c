@@ -1,11 +1,13 @@
 #include "def.h"
 
 #include <unistd.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 #include <string.h>
 #include <inttypes.h>
@@ -22,21 +24,36 @@
 #include "evt.h"
 #include "lr.h"
 #include "lw.h"
+#include "node.h"
+#include "writer.h"
+#include "spill.h"
 
 struct descriptor;
 
+/* drain states are entered from DSTATE_ACTIVE, still on the active list */
+#define DSTATE_LISTED (DSTATE_ACTIVE | DSTATE_DRAIN | DSTATE_DRAIN_ROTATE)
+
+/* FreeBSD only balances the connections with the _LB variant */
+#if defined(SO_REUSEPORT_LB)
+#	define DLOG_SO_REUSEPORT SO_REUSEPORT_LB
+#else
+#	define DLOG_SO_REUSEPORT SO_REUSEPORT
+#endif
+
 static void open_file_r(descriptor* d, int flags, bool reuse);
 static void open_file_w(descriptor* d, int flag);
 static void open_fifo_r(descriptor* d, int flags);
 static void open_fifo_w(descriptor* d, int flag);
-static void open_skt_w(descriptor* d);
+static void open_skt_w(descriptor* d, int flags);
 static void open_socket_read(descriptor* d);
 #if defined(DLOG_HAVE_LINUX)
 static void open_inotify(descriptor* d);
 #endif
 
 static int _socket_listen_pre_read(descriptor* listenfd, int size_hint);
+static int _sktw_pre_write(struct descriptor*);
 static int _sktw_post_line_write(struct descriptor*, ssize_t nbytes, int write_err_code);
+static void _sktw_reconnect(descriptor* d);
 static void _open_socket_listen(descriptor* d);
 
 struct dorigin inotify_origin =
@@ -54,6 +71,33 @@ struct dorigin socket_read_origin =
 };
 
 
+dest_handle*
+dest_handle_get(const char* symbol)
+{
+	dest_handle* h = ht_find(dlogenv->dest_table, (intptr_t)symbol);
+
+	if (!h) {
+		h = calloc(1, sizeof(*h));
+		h->symbol = strdup(symbol);
+		ht_upsert(dlogenv->dest_table, (intptr_t)symbol, h);
+	}
+	return h;
+}
+
+void
+dest_handle_free(void* p)
+{
+	dest_handle* h = p;
+
+	if (!h)
+		return;
+	if (h->unresolved)
+		LOG_WARNING("Destination %s: %lu writes dropped, not open",
+					h->symbol, h->unresolved);
+	free(h->symbol);
+	free(h);
+}
+
 descriptor*
 open_descriptor(dorigin* or, descriptor* d /* or NULL*/,
 				struct vdescfn* fn /* or NULL */, int flags)
@@ -69,19 +113,22 @@ open_descriptor(dorigin* or, descriptor* d /* or NULL*/,
 		d->vfn.on_activate = fn ? fn->on_activate : NULL;
 		d->vfn.on_deactivate = fn ? fn->on_deactivate : NULL;
 		d->vfn.pre_read = fn ? fn->pre_read : NULL;
+		d->vfn.pre_write = fn ? fn->pre_write : NULL;
 		d->vfn.post_line_write = fn ? fn->post_line_write : NULL;
 		d->vfn.state = fn ? fn->state : NULL;
 		d->symbol = dynstr_new(d->origin->symbol);
 
 		if (D_IS_READ_SIDE(d->type)) {
-			d->reader = reader_new();
+			d->reader = reader_new(or->line_term);
+			d->source_id = node_source_id(or->symbol);
 			if(or->inherited.buffer) {
 				reader_reset_with_buffer(d->reader,
 										or->inherited.buffer,
+										or->inherited.buf_len,
 										or->inherited.buf_idx);
 			}
 		} else if (D_IS_WRITE_SIDE(d->type)) {
-			d->wqueue = wq_new();
+			d->wqueue = wq_new(or->write_buffer);
 		}
 
 		reuse = false;
@@ -118,7 +165,7 @@ open_descriptor(dorigin* or, descriptor* d /* or NULL*/,
 		break;
 
 		case D_SOCKETW: {
-			open_skt_w(d);
+			open_skt_w(d, flags);
 		}
 		break;
 
@@ -148,7 +195,7 @@ open_descriptor(dorigin* or, descriptor* d /* or NULL*/,
 			if (D_IS_READ_SIDE(d->type)) {
 				reader_reset(d->reader);
 			} else if (D_IS_WRITE_SIDE(d->type)) {
-				wq_destroy(d->wqueue);
+				wq_reset(d->wqueue);
 			}
 			/* nothing for generic bypass */
 
@@ -157,10 +204,20 @@ open_descriptor(dorigin* or, descriptor* d /* or NULL*/,
 		if (d->state == DSTATE_ACTIVE && d->vfn.on_activate)
 			d->vfn.on_activate(d);
 
-		if (!reuse) {
-			if(!(D_IS_SOCKET_READ(d->type))) {
-				ht_upsert(dlogenv->symbol_table, (uintptr_t)d->symbol, d);
+		if (!reuse && D_IS_WRITE_SIDE(d->type)) {
+			if (or->write_thread && d->state == DSTATE_ACTIVE)
+				d->writer = writer_start(d);
+			dest_handle_get(d->origin->symbol)->d = d;
+
+			/* each worker has a spill of its own */
+			if (or->spill_dir) {
+				char name[DLOG_PATH_MAX];
+
+				snprintf(name, sizeof(name), "%s.%d", or->symbol, dlogenv->worker);
+				d->spill = spill_open(or->spill_dir, name, or->spill_max);
 			}
+			if (D_IS_SOCKET_WRITE(d->type))
+				TAILQ_INSERT_TAIL(&dlogenv->skt_dests, d, _slnk);
 		}
 
 		if (d->state == DSTATE_ACTIVE) {
@@ -177,25 +234,60 @@ close_descriptor(descriptor* d)
 	if (!d || d->state == DSTATE_DEAD)
 		return;
 
-	evt_reg_remove(d);
+	/* a paused client was taken out already, a tcp destination waiting
+	   to reconnect has no socket */
+	if (d->paused) {
+		TAILQ_REMOVE(&dlogenv->read_paused, d, _rlnk);
+		d->paused = false;
+		if (d->type != D_SOCKETR)
+			evt_reg_remove(d);
+	} else if (d->fd != -1) {
+		evt_reg_remove(d);
+	}
+	desc_runq_remove(d);
 
 	if (d->vfn.on_deactivate)
 		d->vfn.on_deactivate(d);
 
+	/* gives the fd back */
+	writer_stop(d->writer);
+	d->writer = NULL;
+
 	close(d->fd);
 	d->fd = -1;
 
 	if (D_IS_READ_SIDE(d->type)) {
 		reader_destroy(d->reader);
 	} else {
+		/* what is queued is left on disk for the next run */
+		if (d->spill) {
+			/* the line cut short goes whole to the next run, ahead
+			   of the spill if it was kept out of it */
+			wq_rewind(d->wqueue);
+			desc_spill(d);
+			if (d->spill_held && wq_first(d->wqueue))
+				spill_close(d->spill, dynstr_ptr(wq_first(d->wqueue)),
+							dynstr_len(wq_first(d->wqueue)));
+			else
+				spill_close(d->spill, NULL, 0);
+		}
+		if (D_IS_SOCKET_WRITE(d->type))
+			TAILQ_REMOVE(&dlogenv->skt_dests, d, _slnk);
+		if (d->wqueue && d->wqueue->dropped)
+			LOG_WARNING("Destination %s: %lu lines dropped, write queue full",
+						d->origin->symbol, d->wqueue->dropped);
 		wq_destroy(d->wqueue);
 	}
 
-	if (d->state == DSTATE_ACTIVE) {
+	if (d->state & DSTATE_LISTED) {
 		TAILQ_REMOVE(&dlogenv->desc_active_list, d, _lnk);
 	}
 
-	ht_remove(dlogenv->symbol_table, (uintptr_t)d->symbol);
+	if (D_IS_WRITE_SIDE(d->type)) {
+		dest_handle* h = ht_find(dlogenv->dest_table, (intptr_t)d->origin->symbol);
+		if (h && h->d == d)
+			h->d = NULL;
+	}
 	dynstr_free(d->symbol);
 
 	if (d->vfn.state)
@@ -212,12 +304,89 @@ reset_descriptor(descriptor* d)
 {
 	close(d->fd);
 	//d->fd = -1;
-	if (d->state == DSTATE_ACTIVE) {
+	if (d->state & DSTATE_LISTED) {
 		TAILQ_REMOVE(&dlogenv->desc_active_list, d, _lnk);
 	}
 	d->state = DSTATE_INIT;
 }
 
+void
+desc_runq_add(descriptor* d)
+{
+	/* queued again when resumed */
+	if (d->paused)
+		return;
+
+	desc_runq_remove(d);
+	TAILQ_INSERT_TAIL(&dlogenv->read_runq[d->origin->priority], d, _rlnk);
+	d->queued = true;
+}
+
+void
+desc_runq_remove(descriptor* d)
+{
+	if (!d->queued)
+		return;
+	TAILQ_REMOVE(&dlogenv->read_runq[d->origin->priority], d, _rlnk);
+	d->queued = false;
+}
+
+int
+desc_quantum(const descriptor* d)
+{
+	return (d->origin->weight ? d->origin->weight : 1) *
+		DYNSTR_USABLE_SIZE(DLOG_READ_MAX_CHUNK);
+}
+
+void
+desc_pause(descriptor* d)
+{
+	if (d->paused)
+		return;
+
+	desc_runq_remove(d);
+	if (d->type == D_SOCKETR && d->state == DSTATE_ACTIVE)
+		evt_reg_remove(d);
+	TAILQ_INSERT_TAIL(&dlogenv->read_paused, d, _rlnk);
+	d->paused = true;
+}
+
+void
+desc_resume(descriptor* d)
+{
+	if (!d->paused)
+		return;
+
+	TAILQ_REMOVE(&dlogenv->read_paused, d, _rlnk);
+	d->paused = false;
+	if (d->type == D_SOCKETR && d->state == DSTATE_ACTIVE)
+		evt_reg_read(d);
+	/* for what came meanwhile */
+	desc_runq_add(d);
+}
+
+bool
+desc_spill(descriptor* d)
+{
+	struct iovec* iov;
+	ssize_t r;
+	int n;
+
+	/* spilled, its tail would start a line on the next connection */
+	if (d->wqueue->write_off)
+		d->spill_held = true;
+
+	while ((n = d->spill_held ? wq_iov_rest(d->wqueue, &iov) : wq_iov(d->wqueue, &iov))) {
+		if (-1 == (r = spill_writev(d->spill, iov, n)))
+			return false;
+		if (d->spill_held)
+			wq_commit_rest(d->wqueue, r);
+		else
+			wq_commit(d->wqueue, r);
+	}
+	return true;
+}
+
 
 static void
 open_socket_read(descriptor* d)
@@ -251,7 +420,7 @@ open_socket_read(descriptor* d)
 static void
 open_file_r(descriptor* d, int flags, bool reuse)
 {
-	bool insert_into_pending = false;
+	bool insert_into_runq = false;
 
 	if (!d->origin->inherited.fd) {
 		if (d->state == DSTATE_INIT) {
@@ -284,18 +453,18 @@ open_file_r(descriptor* d, int flags, bool reuse)
 #ifdef DLOG_HAVE_LINUX
 	/* Kqueue generates read events on a newly open file. Linux doesn't do that.
 	   If the file is open with SEEKSTART we need to trigger that first read by
-	   manually adding the file to pending reads list
+	   manually adding the file to the read run queue
 	*/
 	if (flags | DOPEN_SEEKSTART)
-		insert_into_pending = true;
+		insert_into_runq = true;
 #endif
 
 	if (evt_reg_read(d) == 0) {
 		evt_reg_vnode_del(d);
 		d->state = DSTATE_ACTIVE;
 
-		if (insert_into_pending) {
-			ht_upsert(dlogenv->pending_reads_table, d->fd, d);
+		if (insert_into_runq) {
+			desc_runq_add(d);
 		}
 	} else {
 		d->state = DSTATE_DEAD;
@@ -305,9 +474,7 @@ open_file_r(descriptor* d, int flags, bool reuse)
 static void
 open_file_w(descriptor* d, int flag)
 {
-	d->fd = open(d->origin->file.path,
-				O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | flag,
-				S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	d->fd = open(d->origin->file.path, D_FILEW_FLAGS | flag, D_FILEW_MODE);
 
 	if (d->fd == -1) {
 		LOG_SYS_ERROR("Failed to open file for writing, symbol %s", dynstr_ptr(d->symbol));
@@ -408,27 +575,60 @@ _socket_listen_pre_read(descriptor* listenfd, int size_hint)
 }
 
 
+static uint64_t
+_msec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* the other side closed the connection, what would be written now is
+   lost. return -1 to stop writing */
+static int
+_sktw_pre_write(struct descriptor* d)
+{
+	char c;
+
+	if (0 == recv(d->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT)) {
+		_sktw_post_line_write(d, -1, EPIPE);
+		return -1;
+	}
+	return 0;
+}
+
 static int
 _sktw_post_line_write(struct descriptor* d, ssize_t nbytes, int err)
 {
 	/* the other side has gone */
-	if (err != 0) {
-		int olderr = errno;
-		errno = err;
-		LOG_SYS_ERROR("sktw_post_line_write error");
-		errno = olderr;
+	if (err == EPIPE || err == ECONNRESET) {
+		LOG_WARNING("Destination %s disconnected, reconnecting", d->origin->symbol);
+
+		/* the line cut short goes whole to the next connection */
+		wq_rewind(d->wqueue);
+		if (d->spill)
+			spill_rewind(d->spill);
+		_sktw_reconnect(d);
+	} else if (d->state == DSTATE_PENDING && _msec_now() >= d->retry_at) {
+		_sktw_reconnect(d);
 	}
 
-	if (d->state == DSTATE_PENDING || err == EPIPE) {
-		/* drop socket, and reinitialise it for connection
-		 * while keeping the buffers for later writing
-		 */
+	return 0;
+}
 
-		reset_descriptor(d);
-		open_descriptor(d->origin, d, NULL, DOPEN_KEEP_BUFFERS);
-	}
+/* drop socket, and reinitialise it for connection while keeping the
+   buffers for later writing */
+static void
+_sktw_reconnect(descriptor* d)
+{
+	/* connect() in progress */
+	if (d->state == DSTATE_PENDING && d->fd != -1)
+		evt_reg_remove(d);
 
-	return 0;
+	reset_descriptor(d);
+	d->fd = -1;
+	open_descriptor(d->origin, d, NULL, DOPEN_KEEP_BUFFERS);
 }
 
 
@@ -464,6 +664,15 @@ _open_socket_listen(descriptor* d)
 			d->state = DSTATE_DEAD;
 			return;
 		}
+
+		/* every worker binds the port, the kernel spreads the connections */
+		if (dlogenv->config.workers > 1 &&
+			setsockopt(d->fd, SOL_SOCKET, DLOG_SO_REUSEPORT, &(int){1}, sizeof(int)) == -1) {
+			LOG_SYS_ERROR("Failed to share the listen socket between workers");
+			close(d->fd);
+			d->state = DSTATE_DEAD;
+			return;
+		}
 		fcntl(d->fd, F_SETFD, FD_CLOEXEC | fcntl (d->fd, F_GETFD, 0));
 		if (-1 == fcntl(d->fd, F_SETFL, O_NONBLOCK | fcntl (d->fd, F_GETFL, 0))) {
 			LOG_ERROR("Failed to make listen socket non-blocking, bailing out");
@@ -487,7 +696,7 @@ _open_socket_listen(descriptor* d)
 		return;
 	}
 
-	if (listen(d->fd, 10) == -1) {
+	if (listen(d->fd, DLOG_LISTEN_BACKLOG) == -1) {
 		LOG_ERROR("Socket failed to listen()");
 		close(d->fd);
 		d->state = DSTATE_DEAD;
@@ -504,25 +713,30 @@ _open_socket_listen(descriptor* d)
 }
 
 /*
- * Client socket
+ * Client socket. Once it was up (DOPEN_KEEP_BUFFERS), it is retried
+ * every DLOG_SKT_RETRY whatever the error
  */
 static void
-open_skt_w(descriptor* d)
+open_skt_w(descriptor* d, int flags)
 {
 	struct addrinfo *servinfo, *p;
-	int rv;
+	int rv, cerr = 0;
 	struct addrinfo hints = {
 		.ai_family = AF_INET,
 		.ai_socktype = SOCK_STREAM
 	};
+	bool retry = flags & DOPEN_KEEP_BUFFERS;
 
+	d->vfn.pre_write = _sktw_pre_write;
 	d->vfn.post_line_write = _sktw_post_line_write;
+	d->retry_at = _msec_now() + DLOG_SKT_RETRY;
+	d->fd = -1;
 
 	if ((rv = getaddrinfo(d->origin->socket.host, d->origin->socket.port,
 							&hints, &servinfo)) != 0)
 	{
 		LOG_ERROR("getaddrinfo: %s\n", gai_strerror(rv));
-		d->state = DSTATE_DEAD;
+		d->state = retry ? DSTATE_PENDING : DSTATE_DEAD;
 		return;
 	}
 
@@ -536,6 +750,8 @@ open_skt_w(descriptor* d)
 		}
 
 		if (-1 == fcntl(d->fd, F_SETFL, O_NONBLOCK | fcntl (d->fd, F_GETFL, 0))) {
+			close(d->fd);
+			d->fd = -1;
 			continue;
 		}
 
@@ -546,7 +762,9 @@ open_skt_w(descriptor* d)
 				evt_reg_write(d);
 				break;
 			} else {
-			    close(d->fd);
+				cerr = errno;
+				close(d->fd);
+				d->fd = -1;
 				continue;
 			}
 		} else {
@@ -560,23 +778,20 @@ open_skt_w(descriptor* d)
 	freeaddrinfo(servinfo);
 
 	if (!p) {
-
-		int serr;
-		socklen_t errlen = sizeof(serr);
-
 		/* check why we're here */
-		if (0 == getsockopt(d->fd, SOL_SOCKET, SO_ERROR, &serr, &errlen)) {
-			if (serr == ECONNREFUSED) {
-				LOG_WARNING("Socket %s - server not available, will retry");
-				d->state = DSTATE_PENDING;
-			} else {
-				int olderr = errno;
-				errno = serr;
-				LOG_SYS_ERROR("Socket %s can't connect, will be shut down.", d->origin->symbol);
-				errno = olderr;
+		if (retry) {
+			LOG_DEBUG("Socket %s - server not available, will retry", d->origin->symbol);
+			d->state = DSTATE_PENDING;
+		} else if (cerr == ECONNREFUSED) {
+			LOG_WARNING("Socket %s - server not available, will retry", d->origin->symbol);
+			d->state = DSTATE_PENDING;
+		} else {
+			int olderr = errno;
+			errno = cerr;
+			LOG_SYS_ERROR("Socket %s can't connect, will be shut down.", d->origin->symbol);
+			errno = olderr;
 
-				d->state = DSTATE_DEAD;
-			}
+			d->state = DSTATE_DEAD;
 		}
 	}
 }
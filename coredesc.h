@@ -11,6 +11,8 @@ struct origin_socket;
 /* struct origin; */
 struct linereader;
 struct writequeue;
+struct writer;
+struct spill;
 
 enum DSTATE
 {
@@ -68,15 +70,34 @@ typedef struct dorigin {
 
 	struct {
 		char* buffer;
+		int buf_len;
 		int buf_idx;
 		int fd;
 	} inherited;
 
 	char* symbol;
+	int line_term;		/* LTERM_*, read side only */
+	int weight;			/* read share, 0 is 1. read side only */
+	int priority;		/* DPRIO_*, read side only */
+	bool write_thread;	/* written by a writer thread, write side only */
+	bool backpressure;	/* pauses its sources when backed up, write side only */
+	size_t write_buffer;	/* bytes queued at most, write side only */
+	char* spill_dir;	/* overflow to disk, or NULL. tcp destination only */
+	size_t spill_max;	/* bytes on disk at most */
 	struct dorigin* next;
 
 } dorigin;
 
+/* run queues, all get a round per loop iteration and what is left of
+   the budget goes to the highest priority with data */
+enum DPRIO
+{
+	DPRIO_NORMAL = 0,
+	DPRIO_HIGH,
+	DPRIO_LOW,
+	DPRIO_COUNT
+};
+
 #define D_CORE_TYPE(t) ((t) & 255)
 #define D_CORE_READ_TYPES (D_FILER|D_FIFOR|D_SOCKETR)
 #define D_IS_WRITE_SIDE(t) ((t) & (D_FILEW | D_FIFOW | D_SOCKETW))
@@ -85,11 +106,16 @@ typedef struct dorigin {
 #define D_IS_SOCKET_WRITE(t) ((t) & (D_SOCKETW))
 #define D_IS_FILE(t) ((t) & (D_FILEW|D_FILER|D_FIFOR|D_FIFOW))
 
+/* opening a file destination */
+#define D_FILEW_FLAGS (O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC)
+#define D_FILEW_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)
+
 struct vdescfn
 {
 	int (*on_activate)(struct descriptor* );
 	int (*on_deactivate)(struct descriptor* );
 	int (*pre_read)(struct descriptor*, int);
+	int (*pre_write)(struct descriptor*);
 	int (*post_line_write)(struct descriptor*, ssize_t nbytes, int write_err_code);
 	void * state;
 };
@@ -102,19 +128,67 @@ typedef struct descriptor
 	dorigin* origin;
 	struct vdescfn vfn;
 	dynstr* symbol;
+	int source_id;		/* rules for lines read, see node_source_id */
 
 	union {
 		struct linereader* reader;
 		struct writequeue* wqueue;
 	};
+	struct writer* writer;	/* owns fd while set, see writer.h */
 
 	TAILQ_ENTRY(descriptor) _lnk;
 
+	/* read side, data left to read, see desc_runq_add(). or paused,
+	   the link is for either list */
+	bool queued;
+	bool paused;
+	int deficit;		/* overdrawn read share, 0 or less */
+	TAILQ_ENTRY(descriptor) _rlnk;
+
+	bool throttled;		/* write side, over the high watermark */
+
+	/* tcp destination, what it can't take on disk (see spill.h), older
+	   than what is queued so written first */
+	struct spill* spill;
+	bool spill_held;	/* the first line queued goes before the spill */
+	TAILQ_ENTRY(descriptor) _slnk;
+	uint64_t retry_at;	/* msec, next connection attempt */
+
 } descriptor;
 
+/* destination symbol bound to its open descriptor, stable for the
+ * whole run so rules can keep a pointer to it */
+typedef struct dest_handle
+{
+	descriptor* d;				/* NULL while not open */
+	char* symbol;
+	unsigned long unresolved;	/* writes dropped while not open */
+} dest_handle;
+
+dest_handle* dest_handle_get(const char* symbol);
+void dest_handle_free(void* h);
+
 descriptor* open_descriptor(dorigin* or, descriptor* d, struct vdescfn*, int flags);
 void close_descriptor(descriptor* d);
 void reset_descriptor(descriptor* d);
+
+/* read run queues, serviced on every loop iteration. adding a queued
+   descriptor moves it to the back */
+void desc_runq_add(descriptor* d);
+void desc_runq_remove(descriptor* d);
+
+/* bytes read from the descriptor in a round, deficit round robin */
+int desc_quantum(const descriptor* d);
+
+/* backpressure, not read until resumed. a client socket is taken out of
+   the event system so its window closes, resuming puts it on the run
+   queue */
+void desc_pause(descriptor* d);
+void desc_resume(descriptor* d);
+
+/* moves what is queued to the spill, false if it didn't all fit. a
+   line the socket took part of stays, to be finished first */
+bool desc_spill(descriptor* d);
 //descriptor* open_socket_read(int fd);
 //descriptor* open_socket_read_with_buffer(int fd, const char*);
 void free_dorigin(struct dorigin *);
@@ -109,7 +109,28 @@ inline uint32_t pow2(uint32_t x)
 #define DLOG_EVENTLOOP_TIMEOUT			200
 #define	DLOG_READ_BUF_SZ				4096
 #define DLOG_READ_MAX_CHUNK				(4*1024)
-#define DLOG_WRITE_HIGH_WM				32
+#define DLOG_RUNQ_BUDGET				(256*1024)
+#define DLOG_RUNQ_BUDGET_USEC			2000
+#define DLOG_MAX_WEIGHT					64
+#define DLOG_WRITE_BUFFER				(4*1024*1024)
+#define DLOG_WRITE_RING_MIN				64
+#define DLOG_WRITE_FLOW_RETRY			20
+#define DLOG_SPILL_MAX					(1024L*1024*1024)
+#define DLOG_SPILL_SEGMENT				(16*1024*1024)
+#define DLOG_SPILL_REPLAY				(1024*1024)
+#define DLOG_SKT_RETRY					1000
+#define DLOG_URING_ENTRIES				256
+#define DLOG_URING_CQ_ENTRIES			(4*DLOG_MAX_FILES)
+#define DLOG_PATTERN_CACHE_SIZE			16
+#define DLOG_PREFILTER_MIN_LITERAL		2
+#define DLOG_RX_DFA_STATES				1024
+#define DLOG_EVAL_BATCH					256
+#define DLOG_POOL_QUEUE					64
+#define DLOG_MAX_THREADS				64
+#define DLOG_WRITER_QUEUE				4096
+#define DLOG_MAX_WORKERS				64
+#define DLOG_LISTEN_BACKLOG				128
+#define DLOG_XFER_TIMEOUT				5000
 #define DLOG_OPT_PIDFILE				"/var/tmp/dlog.pid"
 #define DLOG_OPT_LOGFILE				"dlog.logfile"
 #define DLOG_DEFAULT_DATETIME_FORMAT	"%FT%T"
@@ -18,31 +18,46 @@
 #include "lr.h"
 #include "lw.h"
 #include "node.h"
+#include "pool.h"
 #include "rotlog.h"
+#include "writer.h"
+#include "spill.h"
 
 static int get_opts(int argc, char** argv);
 static void env_init(void);
 static void env_post_init(void);
 static void usage(void);
 static int main_loop(void);
-static int idle_loop(void);
-static void descriptor_read(descriptor* d, size_t size_hint);
-static void descriptor_write(dynstr* sym, dynstr* line);
+static size_t descriptor_read(descriptor** ds, int* size_hints, int nds);
+static size_t descriptor_read_batch(descriptor** ds, int* size_hints, int nds);
+static void descriptor_eval(descriptor* d, const strview* lines, int nlines);
+static void descriptor_write(dest_handle* dest, dynstr* line);
 static void descriptor_write_direct(descriptor*, dynstr* line);
-static void desc_pending_add(descriptor* d);
-static void desc_pending_remove(descriptor* d);
-static void desc_pending_drain_all(int desc_bitmask);
+static void descriptor_flush(descriptor** ds, int nds);
+static void desc_writes_flush(void);
+static bool desc_caught_up(descriptor* d);
+static void desc_throttle(descriptor* d);
+static bool desc_blocked(const descriptor* d);
+static void desc_throttled_check(void);
+static bool desc_spill_replay(descriptor* d);
+static bool desc_skt_holding(descriptor* d);
+static void desc_skt_check(void);
+static void desc_skt_close_all(void);
+static bool desc_runq_empty(void);
+static void desc_runq_service(void);
+static size_t desc_runq_round(int prio);
 static void desc_active_writes_drain(bool);
+static void desc_inherit(pid_t from);
 static void origin_destroy();
-static int _read_pending(intptr_t fd, void* desc, void* udata);
 static void process_signals(void);
 static void dlog_sig_shutdown(void);
 static void dlog_sig_restart(void);
 static void dlog_sig_rotlog(void);
+static void dlog_sig_status(void);
 extern int parse_config(void);
 
-/* globals */
-arena* _dynstr_arena;
+/* globals, worker threads have no arena and use the heap */
+__thread arena* _dynstr_arena;
 dlog_env* dlogenv;
 
 #ifdef DLOG_HAVE_LINUX
@@ -63,6 +78,31 @@ static struct dorigin listen_skt_or =
 static descriptor* listen_skt = NULL;
 static int _has_pidfile = 0;
 
+/* destinations with lines queued during this loop iteration */
+static descriptor* _write_sched[DLOG_MAX_FILES];
+static int _nb_write_sched = 0;
+
+/* destinations with backpressure over their high watermark, the sources
+   feeding them are paused when about to be read */
+static struct {
+	descriptor* d;
+	dest_handle* h;
+} _throttled[DLOG_MAX_FILES];
+static int _nb_throttled = 0;
+
+/* tcp destinations holding lines, the loop doesn't sleep while one of
+   them has more to replay right away, and retries the ones stuck */
+static bool _spill_more = false;
+static int _skt_timeout = DLOG_EVENTLOOP_TIMEOUT;
+
+struct read_state
+{
+	descriptor* d;
+	int r;
+	int size_hint;
+	int max_chunk;
+};
+
 /******* dynstr arena *****************/
 static int _dynstr_buckets[7][2] =
 {
@@ -77,16 +117,29 @@ static int _dynstr_buckets[7][2] =
 
 dynstr* alloc_dynstr_alloc(int sz, int* real_cap)
 {
+	if (!_dynstr_arena) {
+		*real_cap = sz;
+		return calloc(sz, 1);
+	}
 	return arena_alloc(_dynstr_arena, sz, real_cap);
 }
 
+/* the arena hands anything it doesn't own to free() */
 void alloc_dynstr_free(dynstr* s)
 {
+	if (!_dynstr_arena) {
+		free(s);
+		return;
+	}
 	arena_free(_dynstr_arena, s);
 }
 
 dynstr* alloc_dynstr_realloc(dynstr* s, int newsize, int* new_cap)
 {
+	if (!_dynstr_arena) {
+		*new_cap = newsize;
+		return realloc(s, newsize);
+	}
 	return arena_realloc(_dynstr_arena, s, newsize, new_cap);
 }
 
@@ -94,6 +147,9 @@ dynstr* alloc_dynstr_realloc(dynstr* s, int newsize, int* new_cap)
 
 int main(int argc, char** argv, char** envp)
 {
+	/* sends the descriptors over when upgrading, before daemonizing */
+	pid_t parent = getppid();
+
 	log_create_stderr();
 
 	env_init();
@@ -118,6 +174,11 @@ int main(int argc, char** argv, char** envp)
 		return 0;
 	}
 
+	if (dlogenv->config.cmdopt.compile)
+		return node_compile_rules(dlogenv->config.configfile) ? 1 : 0;
+
+	node_load_rules(dlogenv->config.configfile);
+
 	LOG_INFO("Starting Dlog...");
 
 	sig_blockall(dlogenv->config.cmdopt.nodaemon);
@@ -135,54 +196,21 @@ int main(int argc, char** argv, char** envp)
 		LOG_INFO("Dlog starting in foreground mode");
 	}
 
-	if (dlogenv->config.cmdopt.newbinary) {
-		LOG_INFO("Dlog starting from parent process with parent pid %d", getppid());
-		xfer_msg** msgs = NULL;
-		int nmsg;
-
-		if(0 != fdxfer_open_recv(&msgs, &nmsg)) {
-			LOG_ERROR("FD transfer failed, will continue without it...");
-		} else {
-			for (int i=0; i<nmsg; ++i) {
-				xfer_msg* msg = msgs[i];
-				char* sym = msg->buf;
-				char* xbuf = sym + strlen(sym) + 1;
-				/* if socket came through it needs to be recreated. Sockets
-				   don't come from config, so can't match them
-				*/
-				struct dorigin* dor = dlogenv->origins;
-				if (!strcmp(sym, DLOG_CLIENT_SOCKET_SYM)) {
-					struct dorigin* or = calloc(1, sizeof(*or));
-					or->type = D_SOCKETR;
-					or->symbol = strdup(sym);
-					or->inherited.buffer = strdup(xbuf);
-					or->inherited.buf_idx = msg->buf_idx;
-					or->inherited.fd = msg->in_fd;
-					dlogenv->origins = or;
-					or->next = dor;
-					continue;
-				}
-				/* go through dorigin entries, find 'sym' match (check type) */
-				int foundfd = 0;
-				while (dor) {
-					if (!strcmp(sym, dor->symbol) && dor->type == msg->desc_type) {
-						dor->inherited.buffer = strdup(xbuf);
-						dor->inherited.buf_idx = msg->buf_idx;
-						dor->inherited.fd = msg->in_fd;
-						foundfd = 1;
-						break;
-					}
-
-					dor = dor->next;
-				}
-				if (!foundfd) {
-					LOG_ERROR("Xfer of fd symbol %s, not found", sym);
-				}
-			}
+	dlogenv->primary = getpid();
+	if (dlogenv->config.workers > 1) {
+		if (!dlogenv->config.listenskt_port) {
+			LOG_WARNING("Workers need a listen port, starting a single process");
+			dlogenv->config.workers = 1;
+		} else if ((dlogenv->worker = proc_workers_spawn(dlogenv->config.workers))) {
+			/* the primary owns the pidfile */
+			_has_pidfile = 0;
+			LOG_INFO("Worker %d started, pid %d", dlogenv->worker, getpid());
 		}
-		fdxfer_close();
 	}
 
+	if (dlogenv->config.cmdopt.newbinary)
+		desc_inherit(parent);
+
 	evt_sys_create();
 
 #if defined(DLOG_HAVE_LINUX)
@@ -207,6 +235,12 @@ int main(int argc, char** argv, char** envp)
 	while(origin) {
 		descriptor* d = NULL;
 
+		/* files are read by the primary only, workers take connections */
+		if (dlogenv->worker && (origin->type & (D_FILER | D_FIFOR))) {
+			origin = origin->next;
+			continue;
+		}
+
 		/* complex types */
 		switch (origin->type) {
 		case D_ROTLOG:
@@ -218,16 +252,17 @@ int main(int argc, char** argv, char** envp)
 			break;
 		}
 
-		if (!d) {
+		if (!d)
 			LOG_ERROR("Failed to create descriptor for '%s'", origin->symbol);
-			continue;
-		}
 
 		origin = origin->next;
 	}
 
 	LOG_INFO("Finished setting up descriptors");
 
+	if (dlogenv->config.threads && pool_start(dlogenv->config.threads, descriptor_write))
+		LOG_ERROR("Failed to start worker threads, rules run in the event loop");
+
 	/* enable signals */
 	sig_init(dlogenv->config.cmdopt.nodaemon);
 
@@ -259,12 +294,15 @@ get_opts(int argc, char** argv)
 			case 't':
 				dlogenv->config.cmdopt.testconfig = true;
 				continue;
+			case 'C':
+				dlogenv->config.cmdopt.compile = true;
+				/* FALLTHROUGH */
 			case 'c':
 				if (argv[++i]) {
 					dlogenv->config.cmdopt.configfile = argv[i];
 					config_missing = 0;
 				} else {
-					LOG_ERROR("-c paramater missing");
+					LOG_ERROR("-%c paramater missing", *opt);
 					return 1;
 				}
 				continue;
@@ -306,6 +344,7 @@ usage()
 	"dlog [options]\nOptions:\n"
 	"-c <config file>, specify config file to use. Required.\n"
 	"-t test configuration file and exit.\n"
+	"-C <config file>, compile the rules to <config file>.so and exit.\n"
 	"-l Socket server listen port.\n"
 	"-n Start in foreground mode.\n"
 	"-v, -? show this text\n"
@@ -321,15 +360,18 @@ env_init(void)
 	dlogenv->config.datetime_format = strdup(DLOG_DEFAULT_DATETIME_FORMAT);
 	dlogenv->config.pidfile = strdup(DLOG_OPT_PIDFILE);
 	dlogenv->config.fractsec_divider = DLOG_DEFAULT_FRACTSEC_DIV;
+	dlogenv->config.timestamp_clock = CLOCK_REALTIME;
 	dlogenv->config.logfile = strdup(DLOG_OPT_LOGFILE);
 
-	dlogenv->symbol_table = ht_create(HT_DYNSTR, 53, ht_value_deleter_null);
-	dlogenv->pending_reads_table = ht_create(HT_INT, 17, ht_value_deleter_null);
-	dlogenv->vars_table = ht_create(HT_DYNSTR, 53, NULL);
+	dlogenv->dest_table = ht_create(HT_CSTR, 53, dest_handle_free);
 
 	_dynstr_arena = arena_create(_dynstr_buckets, 7, NULL, true);
 
 	TAILQ_INIT(&dlogenv->desc_active_list);
+	for (int i=0; i<DPRIO_COUNT; i++)
+		TAILQ_INIT(&dlogenv->read_runq[i]);
+	TAILQ_INIT(&dlogenv->read_paused);
+	TAILQ_INIT(&dlogenv->skt_dests);
 }
 
 static void
@@ -342,6 +384,15 @@ env_post_init(void)
 	}
 }
 
+/* a tcp destination still connecting, its connect() failed */
+static bool
+_connect_failed(EVT_CONTEXT* evt)
+{
+	descriptor* d = EVT_GET_DESCRIPTOR(evt);
+
+	return EVT_IS_WRITE(evt) && d->type == D_SOCKETW && d->state == DSTATE_PENDING;
+}
+
 static int
 main_loop(void)
 {
@@ -350,11 +401,21 @@ main_loop(void)
 	descriptor* read_files[DLOG_MAX_FILES];
 	int nb_files = 0;
 
+	/* everything readable in one iteration is read in one batch */
+	descriptor* read_ready[2*DLOG_MAX_FILES];
+	int read_hints[2*DLOG_MAX_FILES];
+	int nb_ready = 0;
+
 	while(1) {
 
 		process_signals();
 
-		int nev = EVT_LOOP(evts, DLOG_MAX_FILES, DLOG_EVENTLOOP_TIMEOUT);
+		/* don't sleep while there's data left to read, and retry the
+		   destinations that are backed up */
+		int nev = EVT_LOOP(evts, DLOG_MAX_FILES,
+						   !desc_runq_empty() ? 0 :
+						   _nb_throttled ? dlog_min(_skt_timeout, DLOG_WRITE_FLOW_RETRY) :
+						   _skt_timeout);
 
 		if (nev == -1) {
 			if (errno == EINTR) {
@@ -364,17 +425,18 @@ main_loop(void)
 				LOG_SYS_ERROR("event loop interrupted, aborting");
 				return -1;
 			}
-		} else if (nev == 0) {
-			idle_loop();
-		} else {
+		} else if (nev > 0) {
 
 			nb_files = 0;
+			nb_ready = 0;
 
 			for (int i=0; i<nev; i++) {
 
 				EVT_CONTEXT* evt = &evts[i];
 
-				if (EVT_IS_ERROR(evt)) {
+				/* a failed connect() of a tcp destination comes as an error
+				   with the write event, it is checked below */
+				if (EVT_IS_ERROR(evt) && !_connect_failed(evt)) {
 					LOG_ERROR("Error in event structure");
 					continue;
 				}
@@ -386,6 +448,11 @@ main_loop(void)
 
 				descriptor* d = EVT_GET_DESCRIPTOR(evt);
 
+				if (pool_is_wakeup(d)) {
+					pool_deliver();
+					continue;
+				}
+
 				if (EVT_IS_READ(evt)) {
 
 					/* XXX Linux only comes here for sockets */
@@ -400,19 +467,23 @@ main_loop(void)
 							case D_SOCKETR: {
 								LOG_DEBUG("Socket-read EOF, drain state");
 								d->state = DSTATE_DRAIN;
-								desc_pending_add(d);
+								desc_runq_add(d);
 								evt_reg_remove(d);
 								break;
 							}
 						}
 					}
+					/* backlogged, it is read with its share from the run queue */
+					if (d->queued)
+						continue;
+
 					if (d->type & (D_FILER | D_FIFOR)) {
 						/* only collect files ready for reading (already done for Linux,
 							which will never enter this code path) */
 						read_files[nb_files++] = d;
 					} else {
-						int size_hint = EVT_GET_READ_SIZE_HINT(evt);
-						descriptor_read(d, size_hint);
+						read_hints[nb_ready] = EVT_GET_READ_SIZE_HINT(evt);
+						read_ready[nb_ready++] = d;
 					}
 
 				} else if (EVT_IS_WRITE(evt)) {
@@ -433,16 +504,19 @@ main_loop(void)
 								if (0 == getsockopt(d->fd, SOL_SOCKET,
 													SO_ERROR, &serr, &errlen)) {
 									LOG_DEBUG("EVT_WRITE: socket error for %s - %s", d->origin->symbol, strerror(serr));
-									if (serr == ECONNREFUSED) {
-										LOG_DEBUG("Socket connection refused, restarting...");
+									if (serr) {
+										LOG_DEBUG("Socket connection failed, restarting...");
 										reset_descriptor(d);
+										d->fd = -1;
 										d->state = DSTATE_PENDING;
 									}
 								}
 							} else {
-								/* socket connected! */
+								/* socket connected! what is queued goes now */
 								LOG_DEBUG("Socket %s connected.", d->origin->symbol);
 								d->state = DSTATE_ACTIVE;
+								TAILQ_INSERT_TAIL(&dlogenv->desc_active_list, d, _lnk);
+								descriptor_write_direct(d, NULL);
 							}
 						}
 					}
@@ -455,164 +529,578 @@ main_loop(void)
 				   will only come here ONCE so we can add them to drain list here
 				*/
 				if (filed->state == DSTATE_DRAIN_ROTATE)
-					desc_pending_add(filed);
+					desc_runq_add(filed);
+				if (filed->queued)
+					continue;
 
-				descriptor_read(filed, 0);
+				read_hints[nb_ready] = 0;
+				read_ready[nb_ready++] = filed;
 			}
+
+			descriptor_read(read_ready, read_hints, nb_ready);
 		}
+
+		desc_runq_service();
+		desc_writes_flush();
 	}
 
 	return 0;
 }
 
-static int
-idle_loop(void)
+/* bytes read */
+static size_t
+descriptor_read(descriptor** ds, int* size_hints /* or NULL */, int nds)
 {
-	desc_pending_drain_all(D_CORE_READ_TYPES);
+	size_t total = 0;
 
-	return 0;
+	for (int off=0; off<nds; off+=DLOG_MAX_FILES) {
+		total += descriptor_read_batch(ds + off, size_hints ? size_hints + off : NULL,
+									   dlog_min(nds - off, DLOG_MAX_FILES));
+	}
+	return total;
 }
 
-static void
-descriptor_read(descriptor* d, size_t size_hint)
+static size_t
+descriptor_read_batch(descriptor** ds, int* size_hints, int nds)
 {
-	if (d->vfn.pre_read && 0 != d->vfn.pre_read(d, size_hint))
-		return;
+	static struct read_state rs[DLOG_MAX_FILES];
+	static struct evt_io io[DLOG_MAX_FILES];
+	static int io_rs[DLOG_MAX_FILES];
+	int nrs = 0, nio;
+	size_t total = 0;
+
+	for (int i=0; i<nds; i++) {
+		descriptor* d = ds[i];
+		int size_hint = size_hints ? size_hints[i] : 0;
+		int j;
+
+		/* same file can be reported more than once */
+		for (j=0; j<nrs && rs[j].d != d; j++);
+		if (j < nrs)
+			continue;
+
+		if (d->vfn.pre_read && 0 != d->vfn.pre_read(d, size_hint))
+			continue;
+
+		/* resumed by desc_throttled_check() */
+		if (_nb_throttled && (d->type & D_CORE_READ_TYPES) && desc_blocked(d)) {
+			desc_pause(d);
+			continue;
+		}
+
+		rs[nrs].d = d;
+		rs[nrs].r = 1;
+		rs[nrs].size_hint = size_hint == 0 ? DLOG_READ_BUF_SZ : size_hint;
+		/* make sure we don't read the whole file in one go, the last
+		   read of the share may go over, which is paid back next round */
+		rs[nrs].max_chunk = d->deficit + desc_quantum(d);
+		nrs++;
+	}
+
+	/* every round reads once from each descriptor that still has data */
+	while (1) {
+		nio = 0;
+
+		for (int i=0; i<nrs; i++) {
+			struct read_state* st = &rs[i];
+			int sz = st->size_hint;
 
-	int r = 1, total_read=0;
-	int rs = size_hint == 0 ? DLOG_READ_BUF_SZ : size_hint;
+			if (st->r <= 0 || st->max_chunk <= 0 || st->d->fd <= 0)
+				continue;
 
-	/* make sure we don't read the whole file in one go */
-	int max_chunk = DYNSTR_USABLE_SIZE(DLOG_READ_MAX_CHUNK);
+			io[nio].d = st->d;
+			io[nio].buf = reader_get_buffer(st->d->reader, &sz);
+			io[nio].len = sz;
+			io_rs[nio++] = i;
+		}
 
-	if (d->fd > 0) {
-		while (r > 0) {
+		if (!nio)
+			break;
 
-			char* buffer = reader_get_buffer(d->reader, &rs);
+		evt_read_batch(io, nio);
 
-			r = read(d->fd, buffer, rs);
-			total_read+=r;
+		for (int i=0; i<nio; i++) {
+			struct read_state* st = &rs[io_rs[i]];
 
-			max_chunk -= r;
+			st->r = io[i].res;
+			st->max_chunk -= st->r;
 
-			if (r>0) {
-				reader_buffer_fill(d->reader, r);
+			if (st->r > 0) {
+				reader_buffer_fill(st->d->reader, st->r);
+				total += st->r;
 
-				if (max_chunk <= 0) {
+				if (st->max_chunk <= 0) {
 					/* max read size exceeded, more data available */
-					desc_pending_add(d);
-					break;
+					st->d->deficit = st->max_chunk;
+					desc_runq_add(st->d);
 				}
-			} else if (r == -1) {
-				if (errno != EAGAIN && errno != EWOULDBLOCK) {
-					LOG_ERROR("Error reading descriptor %s", d->origin->symbol);
-					break;
+			} else if (st->r == -1) {
+				if (io[i].err != EAGAIN && io[i].err != EWOULDBLOCK) {
+					LOG_ERROR("Error reading descriptor %s", st->d->origin->symbol);
 				}
 			}
 		}
 	}
 
-	dynstr* line;
-	while ((line = reader_get_next_line(d->reader))) {
-
-		node_eval_root(dlogenv->root_node, line, d->symbol, descriptor_write);
+	for (int i=0; i<nrs; i++) {
+		descriptor* d = rs[i].d;
+		strview lines[DLOG_EVAL_BATCH];
+		int nlines = 0;
 
-		dynstr_free(line);
-	}
+		/* views stay valid until the reader is compacted */
+		while (reader_next_line(d->reader, &lines[nlines])) {
+			if (++nlines == DLOG_EVAL_BATCH) {
+				descriptor_eval(d, lines, nlines);
+				nlines = 0;
+			}
+		}
+		if (nlines)
+			descriptor_eval(d, lines, nlines);
+		reader_compact(d->reader);
 
+		/* nothing left, no share is kept */
+		if (rs[i].r <= 0)
+			d->deficit = 0;
 
-	if (r == 0) {
-		// EOF reached - remove from pending
-		desc_pending_remove(d);
+		if (rs[i].r == 0) {
+			// EOF reached - remove from the run queue
+			desc_runq_remove(d);
 
-		if (d->state == DSTATE_DRAIN) {
-			close_descriptor(d);
-		} else {
-			if (d->type ==  D_FILER && d->state == DSTATE_DRAIN_ROTATE) {
-				/* reopen the file */
-				reset_descriptor(d);
-				open_descriptor(d->origin, d,
-							NULL, DOPEN_SEEKSTART|DOPEN_KEEP_BUFFERS);
+			if (d->state == DSTATE_DRAIN) {
+				close_descriptor(d);
+			} else {
+				if (d->type ==  D_FILER && d->state == DSTATE_DRAIN_ROTATE) {
+					/* reopen the file */
+					reset_descriptor(d);
+					open_descriptor(d->origin, d,
+								NULL, DOPEN_SEEKSTART|DOPEN_KEEP_BUFFERS);
+				}
 			}
 		}
 	}
+	return total;
 }
 
 static void
-descriptor_write(dynstr* symbol, dynstr* line)
+descriptor_eval(descriptor* d, const strview* lines, int nlines)
 {
-	descriptor* d = (descriptor *)ht_find(dlogenv->symbol_table, (uintptr_t)symbol);
+	if (pool_active()) {
+		pool_submit(d, lines, nlines);
+		return;
+	}
+	node_eval_batch(NULL, dlogenv->root_node, lines, nlines, d->symbol,
+					d->source_id, descriptor_write);
+}
 
-	if (!d) {
-		LOG_ERROR("Symbol %s not found, write operation abandoned", dynstr_ptr(symbol));
+static void
+descriptor_write(dest_handle* dest, dynstr* line)
+{
+	if (!dest->d) {
+		/* counted, reported at shutdown */
+		if (!dest->unresolved++)
+			LOG_ERROR("Destination %s not open, dropping writes", dest->symbol);
+		dynstr_free(line);
 		return;
 	}
 
-	descriptor_write_direct(d, line);
+	descriptor_write_direct(dest->d, line);
 }
 
 static void
 descriptor_write_direct(descriptor* d, dynstr* line)
 {
-	ssize_t bytes_written = 0;
 	struct writequeue* wq = (struct writequeue* )d->wqueue;
 
 	/* Allow empty lines, for draining any write buffers */
-	if (line) {
-		/* check for new line */
-		if (!dynstr_isnewline(line))
-			line = dynstr_ccat(line, "\n");
+	if (!line) {
+		if (d->writer)
+			writer_flush(d->writer);
+		else
+			descriptor_flush(&d, 1);
+		return;
+	}
+
+	/* check for new line */
+	if (!dynstr_isnewline(line))
+		line = dynstr_ccat(line, "\n");
 
-		wq_add_line(wq, line);
+	if (d->writer) {
+		if (d->origin->backpressure && writer_high(d->writer))
+			desc_throttle(d);
+
+		/* its thread is woken up once per loop iteration too */
+		if (-1 == writer_push(d->writer, line)) {
+			dynstr_free(line);
+			return;
+		}
+	} else {
+		/* make room instead of dropping the line */
+		if (!wq_room(wq, dynstr_len(line)) && !d->throttled)
+			descriptor_flush(&d, 1);
+		if (!wq_room(wq, dynstr_len(line)) && d->spill)
+			desc_spill(d);
+
+		/* lines past the watermark are still taken, up to what the
+		   sources read before being paused. with a spill, once it
+		   is full */
+		if (d->origin->backpressure && wq_high(wq) &&
+			(!d->spill || spill_full(d->spill)))
+			desc_throttle(d);
+
+		if (-1 == wq_add_line(wq, line)) {
+			dynstr_free(line);
+			return;
+		}
 	}
 
-	if (d->state & ~(DSTATE_PENDING|DSTATE_ACTIVE)) {
-		LOG_WARNING("Trying to write to inactive descriptor. Ignored");
-		return;
+	/* actual write is done once per loop iteration, see desc_writes_flush() */
+	if (!wq->scheduled && _nb_write_sched < DLOG_MAX_FILES) {
+		wq->scheduled = true;
+		_write_sched[_nb_write_sched++] = d;
+	}
+}
+
+static size_t
+_iov_len(const struct iovec* iov, int n)
+{
+	size_t len = 0;
+
+	for (int i=0; i<n; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+static void
+descriptor_flush(descriptor** ds, int nds)
+{
+	static struct evt_io io[DLOG_MAX_FILES];
+	static size_t want[DLOG_MAX_FILES];
+	int nio = 0, more, err;
+
+	for (int i=0; i<nds; i++) {
+		descriptor* d = ds[i];
+
+		if (d->state & ~(DSTATE_PENDING|DSTATE_ACTIVE)) {
+			LOG_WARNING("Trying to write to inactive descriptor. Ignored");
+			continue;
+		}
+
+		if (d->writer) {
+			writer_kick(d->writer);
+			continue;
+		}
+
+		/* not connected, or closed by the other side, or older lines on
+		   disk, or nothing queued. still let the descriptor check its state */
+		if (d->state != DSTATE_ACTIVE ||
+			(d->vfn.pre_write && 0 != d->vfn.pre_write(d)) ||
+			(d->spill && !desc_spill_replay(d)) ||
+			!(io[nio].len = wq_iov(d->wqueue, &io[nio].iov))) {
+			if (d->vfn.post_line_write)
+				d->vfn.post_line_write(d, 0, 0);
+			continue;
+		}
+
+		want[nio] = _iov_len(io[nio].iov, io[nio].len);
+		io[nio++].d = d;
 	}
 
+	/* IOV_MAX lines per writev(), the ones which took all of them go
+	   again with the next lines */
+	while (nio) {
+		evt_writev_batch(io, nio);
+
+		more = 0;
+		for (int i=0; i<nio; i++) {
+			descriptor* d = io[i].d;
+			err = 0;
+
+			if (io[i].res == -1) {
+				if (io[i].err != EAGAIN && io[i].err != EWOULDBLOCK) {
+					errno = io[i].err;
+					LOG_SYS_ERROR("writev() failed");
+					err = io[i].err;
+				}
+			} else {
+				wq_commit(d->wqueue, io[i].res);
+			}
+
+			if (d->vfn.post_line_write && (err != 0 || io[i].res >= 0)) {
+				d->vfn.post_line_write(d, io[i].res, err);
+			}
+
+			if (io[i].res > 0 && (size_t)io[i].res == want[i] &&
+				d->state == DSTATE_ACTIVE &&
+				(io[more].len = wq_iov(d->wqueue, &io[more].iov))) {
+				want[more] = _iov_len(io[more].iov, io[more].len);
+				io[more++].d = d;
+			}
+		}
+		nio = more;
+	}
+}
+
+static void
+desc_writes_flush(void)
+{
+	for (int i=0; i<_nb_write_sched; i++)
+		((struct writequeue *)_write_sched[i]->wqueue)->scheduled = false;
+
+	_spill_more = false;
+	if (_nb_write_sched)
+		descriptor_flush(_write_sched, _nb_write_sched);
+	_nb_write_sched = 0;
+
+	desc_skt_check();
+
+	if (_nb_throttled)
+		desc_throttled_check();
+}
+
+/* down to the low watermark, and the spill has room again */
+static bool
+desc_caught_up(descriptor* d)
+{
+	if (d->writer)
+		return writer_low(d->writer);
+	return wq_low(d->wqueue) && !(d->spill && spill_full(d->spill));
+}
+
+/* -1 if the socket took nothing, a failure is handed to the descriptor */
+static ssize_t
+_replay_write(descriptor* d, const void* p, size_t n)
+{
+	ssize_t r;
 	int err;
-	bytes_written = wq_write(wq, d->fd, &err);
 
-	if (d->vfn.post_line_write && (err != 0 || bytes_written >= 0)) {
-		d->vfn.post_line_write(d, bytes_written, err);
+	if (-1 == (r = write(d->fd, p, n))) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			err = errno;
+			LOG_SYS_ERROR("write() failed");
+			d->vfn.post_line_write(d, -1, err);
+		}
+	}
+	return r;
+}
+
+/* what is on disk goes first, true once all of it was written */
+static bool
+desc_spill_replay(descriptor* d)
+{
+	size_t budget = DLOG_SPILL_REPLAY, n;
+	struct iovec* iov;
+	const char* p;
+	ssize_t r;
+
+	/* except the line the socket took part of before the rest was
+	   spilled, it is older */
+	while (d->spill_held) {
+		if (!wq_iov(d->wqueue, &iov)) {
+			d->spill_held = false;
+			break;
+		}
+		if (-1 == (r = _replay_write(d, iov->iov_base, iov->iov_len)))
+			return false;
+		wq_commit(d->wqueue, r);
+		d->spill_held = d->wqueue->write_off != 0;
+	}
+
+	while ((n = spill_peek(d->spill, &p))) {
+		if (!budget) {
+			_spill_more = true;
+			return false;
+		}
+
+		if (-1 == (r = _replay_write(d, p, dlog_min(n, budget))))
+			return false;
+
+		spill_consume(d->spill, r);
+		budget -= r;
 	}
+	return true;
+}
 
-	/* TODO want to be able to return how many bytes have been written, and if there is any remaining
-	        (would be useful for drain states
-	*/
+/* lines held, queued or spilled */
+static bool
+desc_skt_holding(descriptor* d)
+{
+	return wq_lines(d->wqueue) || (d->spill && spill_bytes(d->spill));
 }
 
+/* the tcp destinations holding lines are written or reconnected on every
+   loop iteration, even when nothing new came for them */
 static void
-desc_pending_add(descriptor* d)
+desc_skt_check(void)
 {
-	ht_upsert(dlogenv->pending_reads_table, d->fd, d);
+	descriptor *d, *next;
+	bool waiting = false;
+
+	for (d = TAILQ_FIRST(&dlogenv->skt_dests); d; d = next) {
+		next = TAILQ_NEXT(d, _slnk);
+		if (!desc_skt_holding(d))
+			continue;
+
+		descriptor_flush(&d, 1);
+		if (d->state == DSTATE_ACTIVE && desc_skt_holding(d))
+			waiting = true;
+	}
+
+	_skt_timeout = _spill_more ? 0 :
+		waiting ? DLOG_WRITE_FLOW_RETRY : DLOG_EVENTLOOP_TIMEOUT;
 }
 
+/* the ones not connected aren't on the active list, what the spills
+   hold is left on disk for the next run */
 static void
-desc_pending_remove(descriptor* d)
+desc_skt_close_all(void)
 {
-	ht_remove(dlogenv->pending_reads_table, d->fd);
+	descriptor* d;
+
+	while ((d = TAILQ_FIRST(&dlogenv->skt_dests)))
+		close_descriptor(d);
 }
 
 static void
-desc_pending_drain_all(int desc_bitmask)
+desc_throttle(descriptor* d)
 {
-	ht_visit(dlogenv->pending_reads_table, _read_pending, &desc_bitmask);
+	if (d->throttled || _nb_throttled == DLOG_MAX_FILES)
+		return;
+
+	LOG_WARNING("Destination %s backed up, pausing its sources", d->origin->symbol);
+	d->throttled = true;
+	_throttled[_nb_throttled].d = d;
+	_throttled[_nb_throttled++].h = ht_find(dlogenv->dest_table,
+											(intptr_t)d->origin->symbol);
 }
 
+/* feeds a destination that is backed up */
+static bool
+desc_blocked(const descriptor* d)
+{
+	for (int i=0; i<_nb_throttled; i++) {
+		if (node_source_writes(d->source_id, _throttled[i].h))
+			return true;
+	}
+	return false;
+}
 
-static int
-_read_pending(intptr_t fd, void* desc, void* udata)
+/* retry the destinations backed up, the sources are resumed once the
+   ones they feed are down to the low watermark */
+static void
+desc_throttled_check(void)
 {
-	/* udata is int* bitmask */
-	int bitmask = *(int*)udata;
-	descriptor* d = desc;
-	if ((d->type & bitmask ) && (d->state & (DSTATE_ACTIVE | DSTATE_DRAIN | DSTATE_DRAIN_ROTATE))) {
-		descriptor_read(d, 0);
+	descriptor *d, *next;
+	bool resume = false;
+
+	for (int i=0; i<_nb_throttled; i++) {
+		d = _throttled[i].d;
+
+		if (d->state & (DSTATE_PENDING|DSTATE_ACTIVE))
+			descriptor_flush(&d, 1);
+		if (!desc_caught_up(d))
+			continue;
+
+		LOG_INFO("Destination %s caught up, resuming its sources", d->origin->symbol);
+		d->throttled = false;
+		_throttled[i--] = _throttled[--_nb_throttled];
+		resume = true;
 	}
 
-	return 0;
+	if (!resume)
+		return;
+
+	for (d = TAILQ_FIRST(&dlogenv->read_paused); d; d = next) {
+		next = TAILQ_NEXT(d, _rlnk);
+		if (!desc_blocked(d))
+			desc_resume(d);
+	}
+}
+
+static bool
+desc_runq_empty(void)
+{
+	for (int i=0; i<DPRIO_COUNT; i++) {
+		if (!TAILQ_EMPTY(&dlogenv->read_runq[i]))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * deficit round robin over the run queues. every queue gets a round,
+ * then the rounds go to the highest priority with data left until the
+ * queues are empty or the budget of the iteration is spent. what is
+ * left waits for the next iteration, which doesn't sleep
+ */
+static void
+desc_runq_service(void)
+{
+	static const int order[DPRIO_COUNT] = { DPRIO_HIGH, DPRIO_NORMAL, DPRIO_LOW };
+	struct timespec start, now;
+	size_t total = 0;
+	int i;
+
+	if (desc_runq_empty())
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i=0; i<DPRIO_COUNT; i++)
+		total += desc_runq_round(order[i]);
+
+	while (total < DLOG_RUNQ_BUDGET) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start.tv_sec) * 1000000 +
+			(now.tv_nsec - start.tv_nsec) / 1000 >= DLOG_RUNQ_BUDGET_USEC)
+			break;
+
+		for (i=0; i<DPRIO_COUNT && TAILQ_EMPTY(&dlogenv->read_runq[order[i]]); i++);
+		if (i == DPRIO_COUNT)
+			break;
+		total += desc_runq_round(order[i]);
+	}
+}
+
+/* a share for each descriptor queued, those with more data go to the back */
+static size_t
+desc_runq_round(int prio)
+{
+	static descriptor* ds[DLOG_MAX_FILES];
+	struct desc_runq* q = &dlogenv->read_runq[prio];
+	struct desc_runq overdrawn = TAILQ_HEAD_INITIALIZER(overdrawn);
+	descriptor *d, *last = TAILQ_LAST(q, desc_runq);
+	size_t total = 0;
+	int nds;
+
+	while (last) {
+		nds = 0;
+		while (nds < DLOG_MAX_FILES && last) {
+			d = TAILQ_FIRST(q);
+			if (d == last)
+				last = NULL;
+			desc_runq_remove(d);
+
+			if (!(d->type & D_CORE_READ_TYPES) ||
+				!(d->state & (DSTATE_ACTIVE | DSTATE_DRAIN | DSTATE_DRAIN_ROTATE)))
+				continue;
+
+			/* the last read went over by more than a share, skip the
+			   round and pay it back */
+			if (d->deficit + desc_quantum(d) <= 0) {
+				d->deficit += desc_quantum(d);
+				TAILQ_INSERT_TAIL(&overdrawn, d, _rlnk);
+				continue;
+			}
+			ds[nds++] = d;
+		}
+		total += descriptor_read(ds, NULL, nds);
+	}
+
+	while ((d = TAILQ_FIRST(&overdrawn))) {
+		TAILQ_REMOVE(&overdrawn, d, _rlnk);
+		desc_runq_add(d);
+	}
+	return total;
 }
 
 static void
@@ -638,6 +1126,11 @@ process_signals(void)
 					dlog_sig_rotlog();
 				}
 				break;
+
+				case dlog_signal(DLOG_SIG_STATUS): {
+					dlog_sig_status();
+				}
+				break;
 				}
 
 				sig->flag = false;
@@ -655,34 +1148,79 @@ dlog_sig_rotlog(void)
 {
 	/* force-rotate all rotlogs */
 	descriptor* d;
+	proc_workers_signal(dlog_signal(DLOG_SIG_ROTLOG_ROT));
 	TAILQ_FOREACH(d, &dlogenv->desc_active_list, _lnk) {
 		if (d->type == D_ROTLOG)
 			rotlog_rotate(d);
 	}
 }
 
+static void
+dlog_sig_status(void)
+{
+	/* lines waiting in each destination's queue */
+	descriptor* d;
+	proc_workers_signal(dlog_signal(DLOG_SIG_STATUS));
+	if (dlogenv->config.workers > 1)
+		LOG_INFO("Worker %d, pid %d:", dlogenv->worker, getpid());
+	TAILQ_FOREACH(d, &dlogenv->desc_active_list, _lnk) {
+		if (!D_IS_WRITE_SIDE(d->type))
+			continue;
+		if (d->writer) {
+			LOG_INFO("Destination %s: %d lines queued, %lu dropped (writer thread)%s",
+					 d->origin->symbol, writer_depth(d->writer),
+					 writer_dropped(d->writer), d->throttled ? ", sources paused" : "");
+		} else {
+			LOG_INFO("Destination %s: %d lines (%zu bytes) queued, %lu dropped%s",
+					 d->origin->symbol, wq_lines(d->wqueue), d->wqueue->bytes,
+					 d->wqueue->dropped, d->throttled ? ", sources paused" : "");
+		}
+	}
+	/* connected or not */
+	TAILQ_FOREACH(d, &dlogenv->skt_dests, _slnk) {
+		if (d->state != DSTATE_ACTIVE)
+			LOG_INFO("Destination %s: not connected, %d lines queued", d->origin->symbol,
+					 wq_lines(d->wqueue));
+		if (d->spill)
+			LOG_INFO("Destination %s: %zu bytes spilled%s", d->origin->symbol,
+					 spill_bytes(d->spill), spill_full(d->spill) ? " (full)" : "");
+	}
+}
+
 static void
 dlog_sig_restart(void)
 {
+	descriptor* d;
+
+	/* the new primary forks new workers, each takes over from the
+	   worker of the same index */
+	proc_workers_signal(dlog_signal(DLOG_SIG_RESTART));
+
 	close_descriptor(listen_skt);
-	desc_active_writes_drain(true);
+	listen_skt = NULL;
+	pool_stop();
+	desc_active_writes_drain(false);
+	/* before the new process opens the spills */
+	desc_skt_close_all();
 	evt_sys_destroy();
-	proc_restart_with_newbinary();
+	if (!dlogenv->worker)
+		proc_restart_with_newbinary();
 
-	descriptor* d;
+	/* the pidfile is the new primary's now */
+	_has_pidfile = 0;
 
-	if (TAILQ_FIRST(&dlogenv->desc_active_list)) {
-		if (fdxfer_open_send() == 0) {
-			TAILQ_FOREACH(d, &dlogenv->desc_active_list, _lnk) {
-				if (d->type & D_CORE_READ_TYPES) {
-					fdxfer_send(d);
-				}
+	/* even with nothing to send, the other side is waiting for us */
+	if (fdxfer_open_send(dlogenv->primary, dlogenv->worker) == 0) {
+		TAILQ_FOREACH(d, &dlogenv->desc_active_list, _lnk) {
+			if (d->type & D_CORE_READ_TYPES) {
+				fdxfer_send(d);
 			}
-		} else {
-			LOG_ERROR("Failed to open transfer channel");
 		}
+	} else {
+		LOG_ERROR("Failed to open transfer channel");
 	}
 
+	proc_workers_wait();
 	dlog_sig_shutdown();
 }
 
@@ -691,18 +1229,27 @@ dlog_sig_shutdown(void)
 {
 	sig_blockall(false);
 
+	proc_workers_signal(dlog_signal(DLOG_SIG_SHUTDOWN));
+
 	close_descriptor(listen_skt);
+	listen_skt = NULL;
 
 #ifdef DLOG_HAVE_LINUX
 	close_descriptor(inotify_d);
 #endif
 
+	pool_stop();
 	desc_active_writes_drain(true);
+	desc_skt_close_all();
 
 	evt_sys_destroy();
-	ht_destroy(dlogenv->symbol_table);
-	ht_destroy(dlogenv->pending_reads_table);
-	ht_destroy(dlogenv->vars_table);
+	ht_destroy(dlogenv->dest_table);
+	for (int i=0; i<dlogenv->vars.nb; i++) {
+		free(dlogenv->vars.names[i]);
+		dynstr_free(dlogenv->vars.init[i]);
+	}
+	free(dlogenv->vars.names);
+	free(dlogenv->vars.init);
 
 	origin_destroy();
 
@@ -713,6 +1260,7 @@ dlog_sig_shutdown(void)
 	}
 
 	fdxfer_close();
+	proc_workers_wait();
 
 	arena_destroy(_dynstr_arena, NULL);
 
@@ -723,9 +1271,11 @@ dlog_sig_shutdown(void)
 static void
 desc_active_writes_drain(bool also_close_fds)
 {
-	descriptor* d, *prev = NULL;
+	descriptor* d, *next, *prev = NULL;
 
-	TAILQ_FOREACH(d, &dlogenv->desc_active_list, _lnk) {
+	/* closing removes 'd' from the list */
+	for (d = TAILQ_FIRST(&dlogenv->desc_active_list); d; d = next) {
+		next = TAILQ_NEXT(d, _lnk);
 		if (D_IS_WRITE_SIDE(d->type)) {
 			descriptor_write_direct(d, NULL);
 		}
@@ -735,6 +1285,74 @@ desc_active_writes_drain(bool also_close_fds)
 	}
 }
 
+/* copy a transferred reader buffer by length, it may hold nuls */
+static char*
+_inherit_buffer(const char* xbuf, int xlen)
+{
+	char* b = malloc(xlen + 1);
+	memcpy(b, xbuf, xlen);
+	b[xlen] = 0;
+	return b;
+}
+
+/* take over the descriptors of the process this one replaces */
+static void
+desc_inherit(pid_t from)
+{
+	xfer_msg** msgs = NULL;
+	int nmsg;
+
+	LOG_INFO("Dlog starting from parent process with parent pid %d", from);
+
+	if(0 != fdxfer_open_recv(from, dlogenv->worker, &msgs, &nmsg)) {
+		LOG_ERROR("FD transfer failed, will continue without it...");
+	} else {
+		for (int i=0; i<nmsg; ++i) {
+			xfer_msg* msg = msgs[i];
+			char* sym = msg->buf;
+			char* xbuf = sym + strlen(sym) + 1;
+			/* the reader buffer runs to the last nul, it may hold more */
+			int xlen = msg->buf_len - (xbuf - sym) - 1;
+			/* if socket came through it needs to be recreated. Sockets
+			   don't come from config, so can't match them
+			*/
+			struct dorigin* dor = dlogenv->origins;
+			if (!strcmp(sym, DLOG_CLIENT_SOCKET_SYM)) {
+				struct dorigin* or = calloc(1, sizeof(*or));
+				or->type = D_SOCKETR;
+				or->symbol = strdup(sym);
+				or->inherited.buffer = _inherit_buffer(xbuf, xlen);
+				or->inherited.buf_len = xlen;
+				or->inherited.buf_idx = msg->buf_idx;
+				or->inherited.fd = msg->in_fd;
+				dlogenv->origins = or;
+				or->next = dor;
+				continue;
+			}
+			/* go through dorigin entries, find 'sym' match (check type) */
+			int foundfd = 0;
+			while (dor) {
+				if (!strcmp(sym, dor->symbol) && dor->type == msg->desc_type) {
+					dor->inherited.buffer = _inherit_buffer(xbuf, xlen);
+					dor->inherited.buf_len = xlen;
+					dor->inherited.buf_idx = msg->buf_idx;
+					dor->inherited.fd = msg->in_fd;
+					foundfd = 1;
+					break;
+				}
+
+				dor = dor->next;
+			}
+			if (!foundfd) {
+				LOG_ERROR("Xfer of fd symbol %s, not found", sym);
+			}
+		}
+		for (int i=0; i<nmsg; ++i)
+			free(msgs[i]);
+	}
+	fdxfer_close();
+}
+
 static void
 origin_destroy(void)
 {
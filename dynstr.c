@@ -166,9 +166,16 @@ dynstr_insert(dynstr* into, const dynstr* needle, int index)
 dynstr*
 dynstr_ccat_range(dynstr* dst, const char* start, const char* end)
 {
-	dynstr* news = dynstr_cnew(start, end);
-	dst = dynstr_cat(dst, news);
-	dynstr_free(news);
+	return dynstr_ccat_len(dst, start, end - start + 1);
+}
+
+dynstr*
+dynstr_ccat_len(dynstr* dst, const char* src, int len)
+{
+	dst = dynstr_resize(dst, dst->len + len);
+	memcpy(dst->str + dst->len, src, len);
+	dst->len += len;
+	dst->str[dst->len] = 0;
 	return dst;
 }
 
@@ -14,6 +14,13 @@ typedef struct
 	char str[];
 } dynstr;
 
+/* non-owning view into someone else's buffer */
+typedef struct
+{
+	const char	*ptr;
+	int			 len;
+} strview;
+
 dynstr*		dynstr_reserve(int size);
 dynstr*		dynstr_new(const char* src_or_null);
 dynstr*		dynstr_cnew(const char* start, const char* end);
@@ -33,6 +40,7 @@ dynstr*		dynstr_assign(dynstr* s, const char* src);
 dynstr*		dynstr_insert(dynstr* base, const dynstr* needle, int index);
 dynstr*		dynstr_ccat_range(dynstr* dst, const char* start, const char* end);
 dynstr*		dynstr_ccat(dynstr* dst, const char* string);
+dynstr*		dynstr_ccat_len(dynstr* dst, const char* src, int len);
 dynstr*		dynstr_ncat(dynstr* dst, int num);
 dynstr*		dynstr_cat(dynstr* dst, const dynstr* src);
 dynstr*		dynstr_mcat(dynstr* dst, dynstr* src);
@@ -6,6 +6,8 @@
 
 #include "def.h"
 #include "arena.h"
+#include "dynstr.h"
+#include "coredesc.h"
 
 struct descriptor;
 struct dorigin;
@@ -16,6 +18,9 @@ struct dlog_config
 {
 	char*	datetime_format;
 	int		fractsec_divider;
+	int		timestamp_clock;
+	int		threads;		/* rule evaluation threads, 0 for the event loop */
+	int		workers;		/* processes accepting on the listen port */
 	char*	pidfile;
 	char*	logfile;
 	char*	configfile;
@@ -24,6 +29,7 @@ struct dlog_config
 	struct {
 		bool showhelp;
 		bool testconfig;
+		bool compile;
 		bool newbinary;
 		bool nodaemon;
 		char*  listen_port;
@@ -37,15 +43,27 @@ typedef struct dlog_env
 
 	pid_t		pid;
 
+	/* worker process, 0 reads the file sources. the fd transfer
+	   sockets are named after the pid of worker 0 */
+	int			worker;
+	pid_t		primary;
+
 	sig_atomic_t sig_delivered;
 
 	TAILQ_HEAD(, descriptor) desc_active_list;
 
-	/* symbol -> descriptor */
-	struct hashtable*	symbol_table;
+	/* destination symbol -> dest_handle */
+	struct hashtable*	dest_table;
+
+	/* read side descriptors with data left, by priority, in the order
+	   they are read */
+	TAILQ_HEAD(desc_runq, descriptor) read_runq[DPRIO_COUNT];
+
+	/* read side descriptors feeding a destination that is backed up */
+	TAILQ_HEAD(, descriptor) read_paused;
 
-	/* fd -> descriptor */
-	struct hashtable* pending_reads_table;
+	/* tcp destinations, connected or not */
+	TAILQ_HEAD(, descriptor) skt_dests;
 
 	/* inherited server sockets */
 	int* inherited_skt_fds;
@@ -54,11 +72,18 @@ typedef struct dlog_env
 	/* descriptors' origin */
 	struct dorigin* origins;
 
-	/* hashtable of VARs ( dynstr(symbol) -> str_partial(value) )*/
-	struct hashtable* vars_table;
+	/* VARs, indexed by the slot given when declared */
+	struct {
+		char	**names;
+		dynstr	**init;		/* declared value */
+		int		  nb;
+	} vars;
 
 	struct node* root_node;
 
+	/* of the config files read, checked by compiled rules */
+	uint64_t config_hash;
+
 	struct {
 		int argc;
 		int envc;
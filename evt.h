@@ -1,10 +1,28 @@
 #ifndef DLOG_EVT_H__
 #define DLOG_EVT_H__
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "def.h"
 
 struct descriptor;
 typedef int EVT_SYS;
 
+/*
+ * batched IO request. 'res' is what read()/writev() would have
+ * returned, with 'err' holding errno when res == -1
+ */
+struct evt_io
+{
+	struct descriptor* d;
+	union {
+		char* buf;
+		struct iovec* iov;
+	};
+	int len; /* buffer size (read) or iovec count (writev) */
+	ssize_t res;
+	int err;
+};
+
 #if defined(DLOG_HAVE_LINUX)
 /****************************/
 #	define DLOG_HAVE_EPOLL 1
@@ -15,8 +33,15 @@ typedef int EVT_SYS;
 	typedef struct epoll_event EVT_CONTEXT;
 
 #	define EPOLL_DEFAULT_READ_SIZE 1500
+#	if defined(DLOG_HAVE_URING)
+	/* io_uring when the kernel has it, epoll otherwise (decided at runtime) */
+#	define EVT_LOOP(evts, num_evts, timeout_msec) \
+		evt_loop(evts, num_evts, timeout_msec)
+	int evt_loop(EVT_CONTEXT* evts, int num_evts, int timeout_msec);
+#	else
 #	define EVT_LOOP(evts, num_evts, timeout_msec) \
 		epoll_wait(evt_sys(), evts, num_evts, timeout_msec)
+#	endif
 
 #	define EVT_IS_READ(evt_ctx) evt_ctx->events & EPOLLIN
 #	define EVT_IS_EOF(evt_ctx) evt_ctx->events & (EPOLLHUP|EPOLLRDHUP)
@@ -57,6 +82,8 @@ void	evt_process_vnode(EVT_CONTEXT* evt, struct descriptor** files, int* nb_file
 int		evt_watch_vnode(struct descriptor* d);
 void	evt_unwatch_vnode(int dirfd, struct descriptor* d);
 void	evt_reg_vnode_del(struct descriptor* );
+int		evt_read_batch(struct evt_io* io, int nio);
+int		evt_writev_batch(struct evt_io* io, int nio);
 
 #endif
 
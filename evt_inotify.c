@@ -10,6 +10,9 @@
 #include "evt.h"
 #include "log.h"
 #include "coredesc.h"
+#if defined(DLOG_HAVE_URING)
+#	include "evt_uring.h"
+#endif
 
 /*
  * Inotify works with inodes and file names, unlike kqueue.
@@ -36,6 +39,11 @@
 int inotify_fd;
 static EVT_SYS _evtsys_;
 
+#if defined(DLOG_HAVE_URING)
+/* io_uring is picked at runtime, epoll is the fallback */
+static bool _uring = false;
+#endif
+
 typedef struct filew
 {
 	int wd;
@@ -71,6 +79,15 @@ static int file_link_count(int fd);
 void
 evt_sys_create(void)
 {
+#if defined(DLOG_HAVE_URING)
+	if (0 == uring_create()) {
+		_uring = true;
+		_evtsys_ = uring_fd();
+		LOG_INFO("Event system is io_uring");
+		return;
+	}
+	LOG_WARNING("io_uring not available, falling back to epoll");
+#endif
 	_evtsys_ = epoll_create1(EPOLL_CLOEXEC);
 }
 
@@ -83,9 +100,27 @@ evt_sys(void)
 void
 evt_sys_destroy(void)
 {
+#if defined(DLOG_HAVE_URING)
+	if (_uring) {
+		uring_destroy();
+		_uring = false;
+		return;
+	}
+#endif
 	close(_evtsys_);
 }
 
+#if defined(DLOG_HAVE_URING)
+int
+evt_loop(EVT_CONTEXT* evts, int num_evts, int timeout_msec)
+{
+	if (_uring)
+		return uring_wait(evts, num_evts, timeout_msec);
+
+	return epoll_wait(_evtsys_, evts, num_evts, timeout_msec);
+}
+#endif
+
 /* -1 - failed to watch directory, 0 - watcher added, 1 - already watching */
 int
 evt_watch_vnode(struct descriptor* d)
@@ -233,6 +268,10 @@ evt_reg_read(struct descriptor* d)
 	filew* file;
 
 	if (!(D_IS_FILE(d->type))) {
+#if defined(DLOG_HAVE_URING)
+		if (_uring)
+			return uring_poll_add(d, EPOLLIN, true);
+#endif
 		evt.events = EPOLLIN | EPOLLET;
 		evt.data.ptr = d;
 		if (-1 == epoll_ctl(evt_sys(), EPOLL_CTL_ADD, d->fd, &evt)) {
@@ -272,6 +311,10 @@ evt_reg_write(struct descriptor* d)
 	struct epoll_event evt;
 
 	if (D_IS_SOCKET_WRITE(d->type)) {
+#if defined(DLOG_HAVE_URING)
+		if (_uring)
+			return uring_poll_add(d, EPOLLOUT, false);
+#endif
 		evt.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
 		evt.data.ptr = d;
 		if (-1 == epoll_ctl(evt_sys(), EPOLL_CTL_ADD, d->fd, &evt)) {
@@ -285,6 +328,10 @@ evt_reg_write(struct descriptor* d)
 int
 evt_reg_remove(struct descriptor* d)
 {
+#if defined(DLOG_HAVE_URING)
+	if (_uring)
+		return uring_poll_remove(d);
+#endif
 	int ret = epoll_ctl(evt_sys(), EPOLL_CTL_DEL, d->fd, NULL);
 	if (ret == -1)
 		LOG_SYS_ERROR("Failed to unregister epool for %s", d->origin->symbol);
@@ -292,6 +339,36 @@ evt_reg_remove(struct descriptor* d)
 	return ret;
 }
 
+int
+evt_read_batch(struct evt_io* io, int nio)
+{
+#if defined(DLOG_HAVE_URING)
+	if (_uring)
+		return uring_read_batch(io, nio);
+#endif
+	for (int i=0; i<nio; i++) {
+		io[i].res = read(io[i].d->fd, io[i].buf, io[i].len);
+		io[i].err = io[i].res == -1 ? errno : 0;
+	}
+
+	return nio;
+}
+
+int
+evt_writev_batch(struct evt_io* io, int nio)
+{
+#if defined(DLOG_HAVE_URING)
+	if (_uring)
+		return uring_writev_batch(io, nio);
+#endif
+	for (int i=0; i<nio; i++) {
+		io[i].res = writev(io[i].d->fd, io[i].iov, io[i].len);
+		io[i].err = io[i].res == -1 ? errno : 0;
+	}
+
+	return nio;
+}
+
 int
 evt_clear_state(EVT_CONTEXT* e, int fd)
 {
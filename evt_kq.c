@@ -330,6 +330,28 @@ evt_process_vnode(struct kevent* evt, descriptor** ds, int* numfd)
 	}
 }
 
+int
+evt_read_batch(struct evt_io* io, int nio)
+{
+	for (int i=0; i<nio; i++) {
+		io[i].res = read(io[i].d->fd, io[i].buf, io[i].len);
+		io[i].err = io[i].res == -1 ? errno : 0;
+	}
+
+	return nio;
+}
+
+int
+evt_writev_batch(struct evt_io* io, int nio)
+{
+	for (int i=0; i<nio; i++) {
+		io[i].res = writev(io[i].d->fd, io[i].iov, io[i].len);
+		io[i].err = io[i].res == -1 ? errno : 0;
+	}
+
+	return nio;
+}
+
 int
 evt_clear_state(struct kevent* e, int fd)
 {
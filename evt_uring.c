@@ -0,0 +1,539 @@
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "def.h"
+#include "log.h"
+#include "coredesc.h"
+#include "evt_uring.h"
+
+/*
+ * io_uring backend, used by evt_inotify.c in place of epoll when
+ * dlog is built with USE_URING=yes and the kernel supports it.
+ *
+ * Readiness still comes from (multishot) poll requests, so the main
+ * loop keeps seeing epoll-style events. The difference is that poll
+ * registrations, the event wait, and all reads (and writev's) of a
+ * loop iteration are each pushed through the ring in one go, instead
+ * of a syscall per descriptor.
+ *
+ * While a read/write batch is in flight, poll completions can show up
+ * in the completion queue. These are parked in a backlog (one entry per
+ * descriptor, events OR-ed) and handed out by the next uring_wait().
+ *
+ * No liburing, we talk to the kernel directly.
+ */
+
+enum uring_tag
+{
+	UTAG_POLL_READ = 1,
+	UTAG_POLL_WRITE,
+	UTAG_IO,
+	UTAG_CTL,
+	UTAG_PROBE
+};
+
+static struct
+{
+	int fd;
+	unsigned to_submit;
+
+	/* submission queue */
+	void* sq_ptr;
+	size_t sq_sz;
+	unsigned sq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe* sqes;
+	size_t sqes_sz;
+
+	/* completion queue */
+	void* cq_ptr;
+	size_t cq_sz;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe* cqes;
+
+	/* poll removal in progress */
+	descriptor* removing;
+	int ctl_pending;
+
+	/* multishot poll probe, its first result and whether it is still on */
+	int probe_res;
+	bool probe_seen;
+	bool probe_armed;
+
+	/* poll events not yet handed to the main loop */
+	EVT_CONTEXT backlog[DLOG_MAX_FILES];
+	int nb_backlog;
+} _ring = { .fd = -1 };
+
+static struct io_uring_sqe* _get_sqe(void);
+static int _submit_and_wait(unsigned min_complete, int timeout_msec);
+static int _reap(struct evt_io* io, int nio);
+static void _park_event(descriptor* d, uint32_t events);
+static int _io_batch(struct evt_io* io, int nio, int opcode);
+static bool _poll_multi_supported(void);
+
+int
+uring_create(void)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = DLOG_URING_CQ_ENTRIES;
+
+	if ((_ring.fd = syscall(__NR_io_uring_setup, DLOG_URING_ENTRIES, &p)) == -1) {
+		LOG_SYS_ERROR("io_uring_setup failed");
+		return -1;
+	}
+
+	if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+		LOG_WARNING("io_uring is missing required features (EXT_ARG, NODROP)");
+		close(_ring.fd);
+		_ring.fd = -1;
+		return -1;
+	}
+
+	_ring.sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	_ring.cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	_ring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		_ring.sq_sz = _ring.cq_sz = dlog_max(_ring.sq_sz, _ring.cq_sz);
+	}
+
+	_ring.sq_ptr = mmap(NULL, _ring.sq_sz, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, _ring.fd, IORING_OFF_SQ_RING);
+	if (_ring.sq_ptr == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		_ring.cq_ptr = _ring.sq_ptr;
+	} else {
+		_ring.cq_ptr = mmap(NULL, _ring.cq_sz, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_POPULATE, _ring.fd, IORING_OFF_CQ_RING);
+		if (_ring.cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+
+	_ring.sqes = mmap(NULL, _ring.sqes_sz, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, _ring.fd, IORING_OFF_SQES);
+	if (_ring.sqes == MAP_FAILED)
+		goto fail;
+
+	_ring.sq_entries = p.sq_entries;
+	_ring.sq_head  = (unsigned *)((char *)_ring.sq_ptr + p.sq_off.head);
+	_ring.sq_tail  = (unsigned *)((char *)_ring.sq_ptr + p.sq_off.tail);
+	_ring.sq_mask  = (unsigned *)((char *)_ring.sq_ptr + p.sq_off.ring_mask);
+	_ring.sq_array = (unsigned *)((char *)_ring.sq_ptr + p.sq_off.array);
+
+	_ring.cq_head = (unsigned *)((char *)_ring.cq_ptr + p.cq_off.head);
+	_ring.cq_tail = (unsigned *)((char *)_ring.cq_ptr + p.cq_off.tail);
+	_ring.cq_mask = (unsigned *)((char *)_ring.cq_ptr + p.cq_off.ring_mask);
+	_ring.cqes    = (struct io_uring_cqe *)((char *)_ring.cq_ptr + p.cq_off.cqes);
+
+	/* sqe slots map 1:1 to the index array */
+	for (unsigned i=0; i<_ring.sq_entries; i++)
+		_ring.sq_array[i] = i;
+
+	_ring.to_submit = 0;
+	_ring.nb_backlog = 0;
+
+	/* 5.11 has EXT_ARG and NODROP but no multishot poll (5.13) */
+	if (!_poll_multi_supported()) {
+		LOG_WARNING("io_uring is missing required features (multishot poll)");
+		uring_destroy();
+		return -1;
+	}
+
+	return 0;
+
+fail:
+	LOG_SYS_ERROR("io_uring mmap failed");
+	uring_destroy();
+	return -1;
+}
+
+void
+uring_destroy(void)
+{
+	if (_ring.sqes && _ring.sqes != MAP_FAILED)
+		munmap(_ring.sqes, _ring.sqes_sz);
+	if (_ring.cq_ptr && _ring.cq_ptr != MAP_FAILED && _ring.cq_ptr != _ring.sq_ptr)
+		munmap(_ring.cq_ptr, _ring.cq_sz);
+	if (_ring.sq_ptr && _ring.sq_ptr != MAP_FAILED)
+		munmap(_ring.sq_ptr, _ring.sq_sz);
+	if (_ring.fd != -1)
+		close(_ring.fd);
+
+	memset(&_ring, 0, sizeof(_ring));
+	_ring.fd = -1;
+}
+
+int
+uring_fd(void)
+{
+	return _ring.fd;
+}
+
+int
+uring_wait(EVT_CONTEXT* evts, int num_evts, int timeout_msec)
+{
+	int n;
+
+	if (!_ring.nb_backlog) {
+		if (-1 == _submit_and_wait(1, timeout_msec)) {
+			if (errno == ETIME)
+				return 0;
+			/* EINTR goes back to the main loop as-is */
+			return -1;
+		}
+	} else if (_ring.to_submit) {
+		/* events already waiting, only push out new registrations */
+		_submit_and_wait(0, -1);
+	}
+
+	_reap(NULL, 0);
+
+	n = dlog_min(num_evts, _ring.nb_backlog);
+	memcpy(evts, _ring.backlog, n * sizeof(EVT_CONTEXT));
+	memmove(_ring.backlog, _ring.backlog + n,
+			(_ring.nb_backlog - n) * sizeof(EVT_CONTEXT));
+	_ring.nb_backlog -= n;
+
+	return n;
+}
+
+int
+uring_poll_add(descriptor* d, uint32_t events, bool multishot)
+{
+	struct io_uring_sqe* sqe;
+
+	if (!(sqe = _get_sqe())) {
+		LOG_ERROR("io_uring submission queue full, can't register %s", d->origin->symbol);
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = d->fd;
+	sqe->poll32_events = events;
+	sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = TAGPTR(d, multishot ? UTAG_POLL_READ : UTAG_POLL_WRITE);
+
+	return 0;
+}
+
+int
+uring_poll_remove(descriptor* d)
+{
+	struct io_uring_sqe* sqe;
+	int tags[] = { UTAG_POLL_READ, UTAG_POLL_WRITE };
+
+	for (size_t i=0; i<sizeof(tags)/sizeof(int); i++) {
+		if (!(sqe = _get_sqe())) {
+			LOG_ERROR("io_uring submission queue full, can't unregister %s", d->origin->symbol);
+			return -1;
+		}
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = TAGPTR(d, tags[i]);
+		sqe->user_data = TAGPTR(NULL, UTAG_CTL);
+		_ring.ctl_pending++;
+	}
+
+	/* wait for the removal, so nothing in the ring can point to 'd' anymore */
+	_ring.removing = d;
+	while (_ring.ctl_pending > 0) {
+		if (-1 == _submit_and_wait(1, -1) && errno != EINTR) {
+			LOG_SYS_ERROR("io_uring failed to unregister %s", d->origin->symbol);
+			break;
+		}
+		_reap(NULL, 0);
+	}
+	_ring.removing = NULL;
+
+	for (int i=0; i<_ring.nb_backlog; i++) {
+		if (_ring.backlog[i].data.ptr == d) {
+			memmove(&_ring.backlog[i], &_ring.backlog[i+1],
+					(_ring.nb_backlog - i - 1) * sizeof(EVT_CONTEXT));
+			_ring.nb_backlog--;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+int
+uring_read_batch(struct evt_io* io, int nio)
+{
+	int r = _io_batch(io, nio, IORING_OP_READ);
+
+	/* O_NONBLOCK regular files can bounce with EAGAIN when the data
+	   isn't in the page cache. Don't leave them until the next event */
+	for (int i=0; i<nio; i++) {
+		if (io[i].res == -1 && io[i].err == EAGAIN && (io[i].d->type & D_FILER)) {
+			io[i].res = read(io[i].d->fd, io[i].buf, io[i].len);
+			io[i].err = io[i].res == -1 ? errno : 0;
+		}
+	}
+
+	return r;
+}
+
+int
+uring_writev_batch(struct evt_io* io, int nio)
+{
+	return _io_batch(io, nio, IORING_OP_WRITEV);
+}
+
+static int
+_io_batch(struct evt_io* io, int nio, int opcode)
+{
+	struct io_uring_sqe* sqe;
+	int done = 0;
+
+	for (int i=0; i<nio; i++) {
+		io[i].res = 0;
+		io[i].err = 0;
+
+		if (!(sqe = _get_sqe())) {
+			/* should never happen, _get_sqe() flushes a full ring */
+			if (opcode == IORING_OP_READ)
+				io[i].res = read(io[i].d->fd, io[i].buf, io[i].len);
+			else
+				io[i].res = writev(io[i].d->fd, io[i].iov, io[i].len);
+			io[i].err = io[i].res == -1 ? errno : 0;
+			done++;
+			continue;
+		}
+
+		sqe->opcode = opcode;
+		sqe->fd = io[i].d->fd;
+		sqe->addr = opcode == IORING_OP_READ ? (uintptr_t)io[i].buf : (uintptr_t)io[i].iov;
+		sqe->len = io[i].len;
+		sqe->off = (uint64_t)-1; /* current file position */
+		/* the ring doesn't look at O_NONBLOCK, a read on an empty socket
+		   would wait for data instead of coming back with EAGAIN, and a
+		   write to a full one for the collector to read */
+		if (opcode == IORING_OP_READ || D_IS_SOCKET_WRITE(io[i].d->type))
+			sqe->rw_flags = RWF_NOWAIT;
+		sqe->user_data = TAGPTR(i, UTAG_IO);
+	}
+
+	while (done < nio) {
+		if (-1 == _submit_and_wait(nio - done, -1)) {
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				LOG_SYS_ERROR("io_uring_enter failed");
+				break;
+			}
+		}
+		done += _reap(io, nio);
+	}
+
+	return done;
+}
+
+/* the sqe is queued straight away, it will go out with the next enter */
+static struct io_uring_sqe*
+_get_sqe(void)
+{
+	unsigned tail = *_ring.sq_tail;
+	unsigned head = __atomic_load_n(_ring.sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe* sqe;
+
+	if (tail - head >= _ring.sq_entries) {
+		if (-1 == _submit_and_wait(0, -1))
+			return NULL;
+
+		head = __atomic_load_n(_ring.sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= _ring.sq_entries)
+			return NULL;
+	}
+
+	sqe = &_ring.sqes[tail & *_ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+
+	__atomic_store_n(_ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	_ring.to_submit++;
+
+	return sqe;
+}
+
+static int
+_submit_and_wait(unsigned min_complete, int timeout_msec)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	unsigned flags = 0;
+	void* argp = NULL;
+	size_t argsz = 0;
+	int r;
+
+	if (min_complete) {
+		flags |= IORING_ENTER_GETEVENTS;
+
+		if (timeout_msec >= 0) {
+			ts.tv_sec = timeout_msec / 1000;
+			ts.tv_nsec = (timeout_msec % 1000) * 1000000LL;
+			memset(&arg, 0, sizeof(arg));
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+			flags |= IORING_ENTER_EXT_ARG;
+			argp = &arg;
+			argsz = sizeof(arg);
+		}
+	}
+
+	r = syscall(__NR_io_uring_enter, _ring.fd, _ring.to_submit,
+				min_complete, flags, argp, argsz);
+
+	if (r > 0)
+		_ring.to_submit -= dlog_min((unsigned)r, _ring.to_submit);
+
+	return r;
+}
+
+/* drain the completion queue. Returns number of 'io' entries completed */
+static int
+_reap(struct evt_io* io, int nio)
+{
+	int done = 0;
+	unsigned head = *_ring.cq_head;
+	unsigned tail = __atomic_load_n(_ring.cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe* cqe = &_ring.cqes[head & *_ring.cq_mask];
+		uintptr_t tag, ptr;
+
+		UNTAGPTR(cqe->user_data, tag, ptr);
+
+		switch (tag) {
+			case UTAG_POLL_READ:
+			case UTAG_POLL_WRITE: {
+				descriptor* d = (descriptor *)ptr;
+
+				if (cqe->res < 0 || d == _ring.removing) {
+					if (cqe->res != -ECANCELED && d != _ring.removing) {
+						errno = -cqe->res;
+						LOG_SYS_ERROR("io_uring poll failed for %s", d->origin->symbol);
+					}
+					break;
+				}
+
+				_park_event(d, cqe->res);
+
+				/* the kernel can terminate a multishot poll, re-arm it */
+				if (tag == UTAG_POLL_READ && !(cqe->flags & IORING_CQE_F_MORE))
+					uring_poll_add(d, EPOLLIN, true);
+			}
+			break;
+
+			case UTAG_IO:
+				if (io && (int)ptr < nio) {
+					io[ptr].res = cqe->res < 0 ? -1 : cqe->res;
+					io[ptr].err = cqe->res < 0 ? -cqe->res : 0;
+					done++;
+				}
+				break;
+
+			case UTAG_CTL:
+				_ring.ctl_pending--;
+				break;
+
+			case UTAG_PROBE:
+				if (!_ring.probe_seen)
+					_ring.probe_res = cqe->res;
+				_ring.probe_seen = true;
+				_ring.probe_armed = cqe->res >= 0 && (cqe->flags & IORING_CQE_F_MORE);
+				break;
+		}
+	}
+
+	__atomic_store_n(_ring.cq_head, head, __ATOMIC_RELEASE);
+
+	return done;
+}
+
+static void
+_park_event(descriptor* d, uint32_t events)
+{
+	for (int i=0; i<_ring.nb_backlog; i++) {
+		if (_ring.backlog[i].data.ptr == d) {
+			_ring.backlog[i].events |= events;
+			return;
+		}
+	}
+
+	if (_ring.nb_backlog == DLOG_MAX_FILES) {
+		LOG_ERROR("io_uring event backlog full, dropping event for %s", d->origin->symbol);
+		return;
+	}
+
+	_ring.backlog[_ring.nb_backlog].events = events;
+	_ring.backlog[_ring.nb_backlog].data.ptr = d;
+	_ring.nb_backlog++;
+}
+
+/* waits for what is in flight on the ring, a second at most */
+static void
+_probe_wait(bool (*done)(void))
+{
+	while (!done()) {
+		if (-1 == _submit_and_wait(1, 1000) && errno != EINTR)
+			break;
+		_reap(NULL, 0);
+	}
+}
+
+static bool
+_probe_polled(void)
+{
+	return _ring.probe_seen;
+}
+
+static bool
+_probe_removed(void)
+{
+	return _ring.ctl_pending == 0 && !_ring.probe_armed;
+}
+
+/* older kernels fail a multishot poll with EINVAL, a kernel keeping it
+   armed flags its completions with F_MORE. armed on a pipe with data, so
+   it completes right away */
+static bool
+_poll_multi_supported(void)
+{
+	struct io_uring_sqe* sqe;
+	bool multi;
+	int fds[2];
+
+	if (-1 == pipe(fds) || -1 == write(fds[1], "", 1) || !(sqe = _get_sqe()))
+		return false;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fds[0];
+	sqe->poll32_events = EPOLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = TAGPTR(NULL, UTAG_PROBE);
+	_probe_wait(_probe_polled);
+
+	multi = _ring.probe_res > 0 && _ring.probe_armed;
+
+	/* still armed, take it out before closing the pipe */
+	if (_ring.probe_armed && (sqe = _get_sqe())) {
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = TAGPTR(NULL, UTAG_PROBE);
+		sqe->user_data = TAGPTR(NULL, UTAG_CTL);
+		_ring.ctl_pending++;
+		_probe_wait(_probe_removed);
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+	return multi;
+}
@@ -0,0 +1,16 @@
+#ifndef DLOG_EVT_URING_H__
+#define DLOG_EVT_URING_H__
+#include "evt.h"
+
+struct descriptor;
+
+int		uring_create(void);
+void	uring_destroy(void);
+int		uring_fd(void);
+int		uring_wait(EVT_CONTEXT* evts, int num_evts, int timeout_msec);
+int		uring_poll_add(struct descriptor* d, uint32_t events, bool multishot);
+int		uring_poll_remove(struct descriptor* d);
+int		uring_read_batch(struct evt_io* io, int nio);
+int		uring_writev_batch(struct evt_io* io, int nio);
+
+#endif
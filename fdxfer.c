@@ -15,6 +15,8 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/uio.h>
+#include <poll.h>
+#include <stdio.h>
 #if defined(DLOG_HAVE_BSD) || defined(DLOG_HAVE_OSX)
 #	include <sys/param.h>
 #	include <sys/ucred.h>
@@ -24,20 +26,19 @@
 #define XFER_BUF_LEN (64*1024)
 
 static xfer_msg** _recv_msg_bufs = NULL;
-static int _skt, _nmsg = 0, _capmsg = 16;
+static int _skt = -1, _nmsg = 0, _capmsg = 16;
 
-static dynstr*
-_parent_skt_name()
-{
-	dynstr* s = dynstr_new(DLOG_UNIX_SKT_NAME);
-	return dynstr_ncat(s, getppid());
-}
-
-static dynstr*
-_skt_name()
+static void
+_skt_name(struct sockaddr_un* addr, pid_t primary, int worker)
 {
-	dynstr* s = dynstr_new(DLOG_UNIX_SKT_NAME);
-	return dynstr_ncat(s, getpid());
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (worker)
+		snprintf(addr->sun_path, sizeof(addr->sun_path), "%s%d.%d",
+				 DLOG_UNIX_SKT_NAME, primary, worker);
+	else
+		snprintf(addr->sun_path, sizeof(addr->sun_path), "%s%d",
+				 DLOG_UNIX_SKT_NAME, primary);
 }
 
 static void
@@ -56,7 +57,7 @@ _add_new_msg(xfer_msg* msg)
 }
 
 int
-fdxfer_open_send(void)
+fdxfer_open_send(pid_t primary, int worker)
 {
     int r=0,  loop=3;
     struct sockaddr_un remote;
@@ -66,10 +67,7 @@ fdxfer_open_send(void)
         return -1;
     }
 
-	memset(&remote, 0, sizeof(struct sockaddr_un));
-    remote.sun_family = AF_UNIX;
-	dynstr* addr = _skt_name();
-    strncpy(remote.sun_path, dynstr_ptr(addr), sizeof(remote.sun_path)-1);
+	_skt_name(&remote, primary, worker);
 
     while ((r=connect(_skt, (struct sockaddr *)&remote, sizeof(struct sockaddr_un))) < 0 && loop--) {
         LOG_DEBUG("Failed to connect to Unix socket, continuing to wait");
@@ -80,38 +78,48 @@ fdxfer_open_send(void)
 }
 
 int
-fdxfer_open_recv(xfer_msg*** msgs, int* nummsg)
+fdxfer_open_recv(pid_t primary, int worker, xfer_msg*** msgs, int* nummsg)
 {
 	char recv_buf[XFER_BUF_LEN]
 			__attribute__((aligned(__alignof__(xfer_msg))));
-    int r;
+    int r, lskt;
     struct sockaddr_un addr;
+	struct pollfd pfd;
 
-    if ((_skt = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    if ((lskt = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
         LOG_SYS_ERROR("Failed to create Unix socket");
         return -1;
     }
 
-	memset(&addr, 0, sizeof(struct sockaddr_un));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, dynstr_ptr(_parent_skt_name()), sizeof(addr.sun_path)-1);
+	_skt_name(&addr, primary, worker);
     unlink(addr.sun_path);
-    if (bind(_skt, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1) {
+    if (bind(lskt, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1) {
         LOG_SYS_ERROR("Failed to bind Unix socket");
+        close(lskt);
         return (-1);
     }
 
-    if (listen(_skt, 1) == -1) {
+    if (listen(lskt, 1) == -1) {
         LOG_SYS_ERROR("Failed to listen on Unix socket");
-        return (-1);
+        goto fail_listen;
     }
 
-
+	/* the old process may have had fewer workers */
 	LOG_DEBUG("Accepting xfer connection...");
-    if ((_skt = accept(_skt, NULL, NULL)) == -1) {
+	pfd.fd = lskt;
+	pfd.events = POLLIN;
+	while (-1 == (r = poll(&pfd, 1, DLOG_XFER_TIMEOUT)) && errno == EINTR);
+	if (r != 1) {
+		LOG_ERROR("No descriptors to take over from %s", addr.sun_path);
+		goto fail_listen;
+	}
+
+    if ((_skt = accept(lskt, NULL, NULL)) == -1) {
         LOG_SYS_ERROR("Failed to accept on Unix socket");
-        return (-1);
+        goto fail_listen;
     }
+	close(lskt);
+	unlink(addr.sun_path);
 
 	size_t ucredsz = sizeof(STRUCT_UCRED);
 	size_t ctrl_msg_sz = CMSG_SPACE(sizeof(int)) + CMSG_SPACE(ucredsz);
@@ -140,6 +148,7 @@ fdxfer_open_recv(xfer_msg*** msgs, int* nummsg)
 		r = recvmsg(_skt, &msgh, 0);
 		if(r == 0 || (r<0 && errno == ECONNRESET)) {
 			LOG_INFO("Finished FD transfer.");
+			free(ctrl_msg);
 			*msgs = _recv_msg_bufs;
 			*nummsg = _nmsg;
 			return 0;
@@ -180,6 +189,12 @@ fdxfer_open_recv(xfer_msg*** msgs, int* nummsg)
 	return 0;
 
 fail:
+	free(ctrl_msg);
+	return -1;
+
+fail_listen:
+	close(lskt);
+	unlink(addr.sun_path);
 	return -1;
 }
 
@@ -191,26 +206,23 @@ fdxfer_send(descriptor* d)
 	struct iovec buf_data;
 	struct cmsghdr *cmsg;
 	int ret = 0, bufidx = 0;
+	dynstr* raw = reader_raw_buffer(d->reader, &bufidx);
 
     union {
         char   buf[CMSG_SPACE(sizeof(int))];
         struct cmsghdr align;
     } ctrlMsg;
 
-	// buffer data
-	size_t strlen = dynstr_len(d->symbol) +
-					dynstr_len(reader_raw_buffer(d->reader, &bufidx)) + 2;
+	// buffer data, the reader part may hold nul terminators
+	size_t strlen = dynstr_len(d->symbol) + dynstr_len(raw) + 2;
 
 	size_t buflen = sizeof(xfer_msg) + strlen;
 
 	xfer_msg* sendbuf = (xfer_msg *)calloc(1, buflen);
 	char* b = stpcpy(sendbuf->buf, dynstr_ptr(d->symbol));
 	b++;
-	// TODO maybe don't need this check?
-	if (dynstr_ptr(reader_raw_buffer(d->reader, &sendbuf->buf_idx)))
-		stpcpy(b, dynstr_ptr(reader_raw_buffer(d->reader, &sendbuf->buf_idx)));
-	else
-		*b = 0;
+	memcpy(b, dynstr_ptr(raw), dynstr_len(raw));
+	sendbuf->buf_idx = bufidx;
 	sendbuf->desc_type = d->type;
 	sendbuf->buf_len = strlen;
 
@@ -245,8 +257,11 @@ fdxfer_close(void)
 {
 	LOG_DEBUG("xfer socket closed");
 	free(_recv_msg_bufs);
-	close(_skt);
-	// FIXME unlink socket
+	_recv_msg_bufs = NULL;
+	_nmsg = 0;
+	if (_skt != -1)
+		close(_skt);
+	_skt = -1;
 }
 
 
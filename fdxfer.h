@@ -1,5 +1,6 @@
 #ifndef _FD_XFER_H__
 #define _FD_XFER_H__
+#include <sys/types.h>
 
 struct descriptor;
 
@@ -12,8 +13,10 @@ typedef struct
 	char buf[];
 } xfer_msg;
 
-int fdxfer_open_recv(xfer_msg***, int*);
-int fdxfer_open_send(void);
+/* each worker has its own channel, named after the pid of worker 0 of
+   the process giving the descriptors away */
+int fdxfer_open_recv(pid_t primary, int worker, xfer_msg***, int*);
+int fdxfer_open_send(pid_t primary, int worker);
 int fdxfer_send(struct descriptor* );
 void fdxfer_close(void);
 
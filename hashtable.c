@@ -192,7 +192,7 @@ ht_remove(hashtable* tbl, intptr_t key)
 	ht_element* el = tbl->head + bucket;
 	if (el) {
 		if (el->key && !_cmp(tbl->type, key, el->key)) {
-			_free_key(tbl->type, key);
+			_free_key(tbl->type, el->key);
 			_free_value(tbl, el->value);
 			el->key = (intptr_t)0;
 			el->value = NULL;
@@ -207,9 +207,10 @@ ht_remove(hashtable* tbl, intptr_t key)
 			while(en) {
 				if (!_cmp(tbl->type, key, en->key)) {
 					*pp = en->next;
-					_free_key(tbl->type, key);
-					_free_value(tbl, el->value);
+					_free_key(tbl->type, en->key);
+					_free_value(tbl, en->value);
 					free(en);
+					break;
 				}
 				pp = &en->next;
 				en = en->next;
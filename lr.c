@@ -3,11 +3,12 @@
 #include <stdlib.h>
 #include "log.h"
 #include "lr.h"
+#include "scan.h"
 #include "dynstr.h"
 
-/* TODO enable custom line terminators (support for windows line ends) */
 #define LINE_TERMINATOR '\n'
 #define DEFAULTBUF_SIZE 1024
+#define DEFAULTOFFS_SIZE 256
 
 
 static linereader*
@@ -15,29 +16,88 @@ _reader_new_size(size_t bufsz)
 {
 	linereader* st = calloc(1, sizeof(*st));
 	st->buf = dynstr_reserve(bufsz);
+	st->saved_idx = -1;
+	st->offs_cap = DEFAULTOFFS_SIZE;
+	st->offs = malloc(st->offs_cap * sizeof(int));
 	return st;
 }
 
+/* put back the byte overwritten to terminate the last view */
+static inline void
+_reader_unterminate(linereader* r)
+{
+	if (r->saved_idx >= 0) {
+		r->buf->str[r->saved_idx] = r->saved_ch;
+		r->saved_idx = -1;
+	}
+}
+
+/* index all terminators in [cur_idx, len) in one pass */
+static void
+_reader_index(linereader* r)
+{
+	int found, room;
+
+	while (r->cur_idx < r->buf->len) {
+		if (r->noffs == r->offs_cap) {
+			if (r->offs_pos) {
+				r->noffs -= r->offs_pos;
+				memmove(r->offs, r->offs + r->offs_pos, r->noffs * sizeof(int));
+				r->offs_pos = 0;
+			} else {
+				r->offs_cap *= 2;
+				r->offs = realloc(r->offs, r->offs_cap * sizeof(int));
+			}
+		}
+
+		room = r->offs_cap - r->noffs;
+		found = scan_bytes(r->buf->str + r->cur_idx, r->buf->len - r->cur_idx,
+						   r->term, r->cur_idx, r->offs + r->noffs, room);
+		r->noffs += found;
+
+		if (found < room)
+			r->cur_idx = r->buf->len;
+		else
+			r->cur_idx = r->offs[r->noffs-1] + 1;
+	}
+}
+
 linereader*
-reader_new()
+reader_new(int line_term)
 {
-	return _reader_new_size(DYNSTR_USABLE_SIZE(DEFAULTBUF_SIZE));
+	linereader* r = _reader_new_size(DYNSTR_USABLE_SIZE(DEFAULTBUF_SIZE));
+
+	switch (line_term) {
+		case LTERM_LF:		r->term = LINE_TERMINATOR; break;
+		case LTERM_CRLF:	r->term = LINE_TERMINATOR; r->crlf = true; break;
+		case LTERM_NUL:		r->term = '\0'; break;
+		default:			r->term = (char)(line_term & 0xff); break;
+	}
+	return r;
 }
 
 void
 reader_reset(linereader* r)
 {
 	dynstr_reset(r->buf);
+	r->head = 0;
 	r->cur_idx = 0;
+	r->saved_idx = -1;
+	r->noffs = r->offs_pos = 0;
 }
 
 void
-reader_reset_with_buffer(linereader* lr, const char* newbuf, int newidx)
+reader_reset_with_buffer(linereader* lr, const char* newbuf, int newlen, int newidx)
 {
 	dynstr_free(lr->buf);
-	LOG_DEBUG("Reader resetting with a buffer of size %d, index %d", strlen(newbuf), newidx);
+	LOG_DEBUG("Reader resetting with a buffer of size %d, index %d", newlen, newidx);
+	lr->head = 0;
 	lr->cur_idx = newidx;
-	lr->buf = dynstr_new(newbuf);
+	lr->saved_idx = -1;
+	lr->noffs = lr->offs_pos = 0;
+	/* the buffer may hold nul terminators, copy it by length */
+	lr->buf = dynstr_ccat_len(dynstr_reserve(newlen), newbuf, newlen);
+	_reader_index(lr);
 }
 
 void
@@ -45,6 +105,8 @@ reader_destroy(linereader* r)
 {
 	if (r && r->buf)
 		dynstr_free(r->buf);
+	if (r)
+		free(r->offs);
 	free(r);
 }
 
@@ -52,6 +114,8 @@ reader_destroy(linereader* r)
 char*
 reader_get_buffer(linereader* r, int* min_size_hint)
 {
+	reader_compact(r);
+
 	if (dynstr_slack(r->buf) < *min_size_hint) {
 		r->buf = dynstr_resize(r->buf, r->buf->len + *min_size_hint+1);
 	}
@@ -63,40 +127,76 @@ void
 reader_buffer_fill(linereader* r, int numbytes)
 {
 	dynstr_fill(r->buf, numbytes);
+	_reader_index(r);
 }
 
-dynstr*
-reader_get_next_line(linereader* r)
+bool
+reader_next_line(linereader* r, strview* v)
 {
-	char* nl = NULL;
-
-	while (1) {
-		nl = (char *)memchr(dynstr_ptr(r->buf) + r->cur_idx,
-							LINE_TERMINATOR,
-							r->buf->len - r->cur_idx);
-		if (nl == &(r->buf->str[0]) + r->cur_idx) {
-			r->cur_idx++;
+	char* base;
+	int t, end;
+
+	_reader_unterminate(r);
+	base = r->buf->str;
+
+	while (r->offs_pos < r->noffs) {
+		t = r->offs[r->offs_pos++];
+		end = t;
+
+		if (r->crlf && t > r->head && base[t-1] == '\r')
+			end = t-1;
+
+		if (end == r->head) {
+			/* skip empty lines */
+			r->head = t+1;
 			continue;
 		}
-		break;
+
+		/* records always reach the rules with a '\n' terminator */
+		base[end] = '\n';
+		v->ptr = base + r->head;
+		v->len = end - r->head + 1;
+		r->head = t+1;
+
+		/* buf is always NUL terminated, so saved_idx is at most buf->len */
+		r->saved_idx = end+1;
+		r->saved_ch = base[end+1];
+		base[end+1] = 0;
+		return true;
 	}
 
-	if (!nl) {
-		r->cur_idx = r->buf->len;
-		return NULL;
-	} else {
-		/* Keep the new line character in */
-		dynstr* line = dynstr_cnew(dynstr_ptr(r->buf), nl);
-		size_t range = (ptrdiff_t)(nl - dynstr_ptr(r->buf));
-		r->buf = dynstr_remove_range(r->buf, 0, range);
+	return false;
+}
+
+/* drop consumed lines, invalidates all views */
+void
+reader_compact(linereader* r)
+{
+	_reader_unterminate(r);
+
+	if (!r->head)
+		return;
+
+	if (r->head >= r->buf->len) {
+		dynstr_reset(r->buf);
 		r->cur_idx = 0;
-		return line;
+		r->noffs = r->offs_pos = 0;
+	} else {
+		r->buf->len -= r->head;
+		memmove(r->buf->str, r->buf->str + r->head, r->buf->len + 1);
+		r->cur_idx -= r->head;
+
+		r->noffs -= r->offs_pos;
+		for (int i=0; i<r->noffs; i++)
+			r->offs[i] = r->offs[r->offs_pos + i] - r->head;
+		r->offs_pos = 0;
 	}
+	r->head = 0;
 }
 
 dynstr* reader_raw_buffer(linereader* r, int* idx)
 {
+	reader_compact(r);
 	*idx = r->cur_idx;
 	return r->buf;
 }
-
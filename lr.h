@@ -2,23 +2,50 @@
 #define _DLOG_LINE_READER_H__
 #include "dynstr.h"
 
+/* record terminators, LTERM_LF is the default */
+#define LTERM_LF		0
+#define LTERM_CRLF		1
+#define LTERM_NUL		2
+#define LTERM_BYTE(c)	(0x100 | (unsigned char)(c))
+
+/*
+ * Lines are handed out as views into the read buffer, consumed data
+ * is only discarded when the buffer is compacted (once per read batch).
+ */
 typedef struct linereader
 {
-	int		cur_idx;
+	int		head;		/* start of unconsumed data */
+	int		cur_idx;	/* scan position, all terminators before it are indexed */
+	int		saved_idx;	/* byte replaced by NUL to terminate the last view */
+	char	saved_ch;
+	char	term;		/* terminator byte */
+	bool	crlf;		/* strip '\r' preceding the terminator */
+	int		*offs;		/* terminator offsets found by the scanner */
+	int		noffs;
+	int		offs_pos;	/* next offset to hand out */
+	int		offs_cap;
 	dynstr	*buf;
 } linereader;
 
-linereader* reader_new();
+linereader* reader_new(int line_term);
 void reader_reset(linereader*);
-void reader_reset_with_buffer(linereader*, const char* , int);
+void reader_reset_with_buffer(linereader*, const char* , int, int);
 void reader_destroy(linereader*);
 
 /* API 2 - retrieve internal buffer to be used for read() call. Suggest min. size */
 char* reader_get_buffer(linereader*, int* min_size_hint);
 void  reader_buffer_fill(linereader*, int numbytes);
 
-/* extract a line from buffer (return NULL if no full line found) */
-dynstr* reader_get_next_line(linereader*);
+/*
+ * extract a line view from buffer (return false if no full line found).
+ * The view ends with '\n' whatever the source terminator. Views point
+ * into the buffer and stay valid across calls until reader_compact
+ * (also run by reader_get_buffer and reader_raw_buffer). Only the most
+ * recent view is NUL terminated, the next call restores the byte after
+ * it, so earlier views must be used by ptr/len.
+ */
+bool reader_next_line(linereader*, strview*);
+void reader_compact(linereader*);
 dynstr* reader_raw_buffer(linereader*, int* idx);
 
 #endif
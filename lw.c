@@ -1,12 +1,29 @@
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "lw.h"
 #include "log.h"
 
+#define WQ_LINE(wq, i) ((wq)->ring[(i) & ((wq)->cap - 1)])
 
-struct writequeue* wq_new(void)
+struct writequeue* wq_new(size_t max_bytes)
 {
-	return calloc(1, sizeof(struct writequeue));
+	struct writequeue* wq = calloc(1, sizeof(struct writequeue));
+
+	wq->cap = DLOG_WRITE_RING_MIN;
+	wq->max_bytes = max_bytes;
+	wq->ring = malloc(wq->cap * sizeof(dynstr *));
+	wq->iov = malloc(IOV_MAX * sizeof(struct iovec));
+	return wq;
+}
+
+void wq_reset(struct writequeue *wq)
+{
+	for (; wq->tail != wq->head; wq->tail++) {
+		dynstr_free(WQ_LINE(wq, wq->tail));
+	}
+	wq->write_off = 0;
+	wq->bytes = 0;
 }
 
 void wq_destroy(struct writequeue *wq)
@@ -14,63 +31,173 @@ void wq_destroy(struct writequeue *wq)
 	if (!wq)
 		return;
 
-	for (int i=0; i<wq->num_entries; i++) {
-		dynstr_free(wq->line[i]);
-	}
-	wq->num_entries = 0;
-	wq->write_off = 0;
+	wq_reset(wq);
+	free(wq->ring);
+	free(wq->iov);
+	free(wq);
+}
+
+/* the ring is unwrapped at the start of the new one */
+static void
+_wq_grow(struct writequeue* wq)
+{
+	dynstr** ring = malloc(wq->cap * 2 * sizeof(dynstr *));
+	unsigned n = wq->head - wq->tail;
+
+	for (unsigned i=0; i<n; i++)
+		ring[i] = WQ_LINE(wq, wq->tail + i);
+
+	free(wq->ring);
+	wq->ring = ring;
+	wq->cap *= 2;
+	wq->tail = 0;
+	wq->head = n;
 }
 
 int wq_add_line(struct writequeue* wq, dynstr* ln)
 {
-	if (wq->num_entries == DLOG_WRITE_HIGH_WM) {
-		LOG_ERROR("High watermark reached, ignoring new lines");
+	if (!wq_room(wq, dynstr_len(ln))) {
+		if (!wq->full)
+			LOG_ERROR("Write queue full (%zu bytes), dropping lines", wq->max_bytes);
+		wq->full = true;
+		wq->dropped++;
 		return -1;
 	}
+	wq->full = false;
 
-	wq->line[wq->num_entries++] = ln;
+	if (wq->head - wq->tail == wq->cap)
+		_wq_grow(wq);
+
+	WQ_LINE(wq, wq->head++) = ln;
+	wq->bytes += dynstr_len(ln);
 	return 0;
 }
 
+/* a line always fits an empty queue */
+bool wq_room(const struct writequeue* wq, size_t len)
+{
+	return wq->head == wq->tail || wq->bytes + len <= wq->max_bytes;
+}
+
+int wq_lines(const struct writequeue* wq)
+{
+	return wq->head - wq->tail;
+}
+
+bool wq_high(const struct writequeue* wq)
+{
+	return wq->bytes >= wq->max_bytes / 2;
+}
+
+bool wq_low(const struct writequeue* wq)
+{
+	return wq->bytes <= wq->max_bytes / 8;
+}
+
+int wq_iov(struct writequeue* wq, struct iovec** iov)
+{
+	int n = dlog_min(wq->head - wq->tail, IOV_MAX);
+
+	for (int i=0; i<n; i++) {
+		dynstr* ln = WQ_LINE(wq, wq->tail + i);
+
+		wq->iov[i].iov_base = (void *)dynstr_ptr(ln);
+		wq->iov[i].iov_len  = dynstr_len(ln);
+	}
+
+	/* first line may have been partially written already */
+	if (n) {
+		wq->iov[0].iov_base = (char *)wq->iov[0].iov_base + wq->write_off;
+		wq->iov[0].iov_len -= wq->write_off;
+	}
+
+	*iov = wq->iov;
+	return n;
+}
+
+void wq_commit(struct writequeue* wq, ssize_t nbytes)
+{
+	if (nbytes <= 0)
+		return;
+
+	wq->bytes -= nbytes;
+	nbytes += wq->write_off;
+
+	while (wq->tail != wq->head && nbytes >= dynstr_len(WQ_LINE(wq, wq->tail))) {
+		nbytes -= dynstr_len(WQ_LINE(wq, wq->tail));
+		dynstr_free(WQ_LINE(wq, wq->tail));
+		wq->tail++;
+	}
+	wq->write_off = wq->tail != wq->head ? nbytes : 0;
+}
+
+void wq_rewind(struct writequeue* wq)
+{
+	wq->bytes += wq->write_off;
+	wq->write_off = 0;
+}
+
+dynstr* wq_first(const struct writequeue* wq)
+{
+	return wq->head != wq->tail ? WQ_LINE(wq, wq->tail) : NULL;
+}
+
+int wq_iov_rest(struct writequeue* wq, struct iovec** iov)
+{
+	int n = wq->head != wq->tail ? dlog_min(wq->head - wq->tail - 1, IOV_MAX) : 0;
+
+	for (int i=0; i<n; i++) {
+		dynstr* ln = WQ_LINE(wq, wq->tail + 1 + i);
+
+		wq->iov[i].iov_base = (void *)dynstr_ptr(ln);
+		wq->iov[i].iov_len  = dynstr_len(ln);
+	}
+
+	*iov = wq->iov;
+	return n;
+}
+
+/* whole lines only, the first one moves up to the last slot freed */
+void wq_commit_rest(struct writequeue* wq, ssize_t nbytes)
+{
+	dynstr* first;
+	unsigned n = 0;
+
+	if (nbytes <= 0)
+		return;
+
+	first = WQ_LINE(wq, wq->tail);
+	wq->bytes -= nbytes;
+	while (nbytes > 0) {
+		dynstr* ln = WQ_LINE(wq, wq->tail + 1 + n++);
+
+		nbytes -= dynstr_len(ln);
+		dynstr_free(ln);
+	}
+	wq->tail += n;
+	WQ_LINE(wq, wq->tail) = first;
+}
+
 ssize_t wq_write(struct writequeue* wq, int fd, int* errcode)
 {
-	int i=0, len=0, r, bytes;
+	struct iovec* iov;
+	ssize_t r;
+	int n;
+
 	*errcode = 0;
 
-	if (!wq->num_entries)
+	if (!(n = wq_iov(wq, &iov)))
 		return (0);
 
-	for (int i=0; i<wq->num_entries; i++) {
-		wq->iov[i].iov_base = (void *)dynstr_ptr(wq->line[i]);
-		wq->iov[i].iov_len  = dynstr_len(wq->line[i]);
-	}
-
-	bytes = r = writev(fd, wq->iov, wq->num_entries);
+	r = writev(fd, iov, n);
 
 	if (-1 == r && errno != EAGAIN && errno != EWOULDBLOCK) {
 		LOG_SYS_ERROR("writev() failed");
 		*errcode = errno;
 		return -1;
-	} else if (r > 0) {
-
-		while(1) {
-			len = dynstr_len(wq->line[i]);
-
-			if (r < len) {
-				break;
-			} else if (r >= len) {
-				dynstr_free(wq->line[i]);
-				r -= len;
-				if (!r)
-					break;
-			}
-			i++;
-		}
-		if (i>0) {
-			memmove(&wq->line[0], &wq->line[i], wq->num_entries * sizeof(dynstr *));
-		}
-		wq->num_entries -= i+1;
 	}
 
-	return bytes;
+	wq_commit(wq, r);
+
+	return r;
 }
@@ -5,18 +5,53 @@
 #include "def.h"
 #include "dynstr.h"
 
+/*
+ * lines waiting to be written, a ring growing as needed up to a budget
+ * of bytes. the first line may have been written in part already
+ */
 struct writequeue
 {
-	dynstr* line[DLOG_WRITE_HIGH_WM];
-	struct iovec iov[DLOG_WRITE_HIGH_WM];
-	int num_entries;
-	size_t write_off;
+	dynstr** ring;
+	unsigned cap;		/* power of 2 */
+	unsigned head;		/* next line queued */
+	unsigned tail;		/* first line not fully written */
+	size_t write_off;	/* written of the first line */
+	size_t bytes;		/* not written yet */
+	size_t max_bytes;
+	struct iovec* iov;
+	unsigned long dropped;
+	bool full;		/* dropping since the last report */
+	bool scheduled; /* waiting for the event loop to flush it */
 };
 
-struct writequeue* wq_new(void);
+struct writequeue* wq_new(size_t max_bytes);
 void wq_destroy(struct writequeue *);
+void wq_reset(struct writequeue *);	/* drops the lines */
+
+/* -1 if the line doesn't fit the budget, it is not taken */
 int wq_add_line(struct writequeue* , dynstr* );
+bool wq_room(const struct writequeue* , size_t len);
+int wq_lines(const struct writequeue* );
+
+/* backpressure, half of the budget and an eighth */
+bool wq_high(const struct writequeue* );
+bool wq_low(const struct writequeue* );
+
 ssize_t wq_write(struct writequeue* , int fd, int* errcode);
 
+/* split write - fetch pending iovecs (IOV_MAX at most), then consume what
+   has been written */
+int wq_iov(struct writequeue* , struct iovec** );
+void wq_commit(struct writequeue* , ssize_t nbytes);
+
+/* the first line is written whole again, for a new connection */
+void wq_rewind(struct writequeue* );
+
+/* spilling around the first line, which stays queued - fetch the whole
+   lines after it, then take out the ones spilled */
+dynstr* wq_first(const struct writequeue* );
+int wq_iov_rest(struct writequeue* , struct iovec** );
+void wq_commit_rest(struct writequeue* , ssize_t nbytes);
+
 #endif
 
@@ -1,9 +1,13 @@
+#include <sys/wait.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
 #include "node.h"
-#include "hashtable.h"
+#include "prefilter.h"
+#include "rx.h"
 #include "env.h"
 #include "log.h"
 
@@ -11,44 +15,229 @@ typedef enum
 {
 	EVAL_TRUE,
 	EVAL_FALSE,
-	EVAL_BREAK,
 	EVAL_ERROR
 } eval_result;
 
-static eval_result	_eval_node_passthrough(struct node*, struct exec_ctx*, eval_result prev_res);
-static eval_result  _eval_node_assign(struct node*, struct exec_ctx*, eval_result prev_res);
-static eval_result	_eval_node_match(struct node*, struct exec_ctx*, eval_result prev_res);
-static eval_result	_eval_node_matchall(struct node*, struct exec_ctx*, eval_result prev_res);
-static eval_result	_eval_node_match_else(struct node*, struct exec_ctx*, eval_result prev_res);
-static eval_result	_eval_node_write(struct node*, struct exec_ctx*, eval_result prev_res);
-static eval_result	_eval_node_break(struct node*, struct exec_ctx*, eval_result prev_res);
-static eval_result	_eval_node(struct node*, struct exec_ctx*, eval_result prev_res);
+/*
+ * the rule tree is flattened into one program per source, blocks become
+ * jumps and rules for other sources are left out. the flag holds the
+ * result of the last statement, else tests it
+ */
+typedef enum
+{
+	OP_MATCH,			/* flag = matched, on error jump */
+	OP_ELSE,			/* flag = !flag */
+	OP_JUMP_IF_FALSE,
+	OP_WRITE,
+	OP_ASSIGN,			/* on error jump */
+	OP_BREAK,			/* jump to the end of the block */
+	OP_POP_MATCH,		/* end of a match block, captures out of scope */
+	OP_END_BLOCK,
+	OP_SWITCH,			/* jump to the matching case, else to default or past the switch */
+	OP_CASE,			/* jump table entry after a switch, never run */
+	OP_END_CASE,		/* jump past the switch */
+	OP_END
+} opcode;
+
+static const char* _opname[] =
+{
+	"MATCH", "ELSE", "JUMP_IF_FALSE", "WRITE",
+	"ASSIGN", "BREAK", "POP_MATCH", "END_BLOCK",
+	"SWITCH", "CASE", "END_CASE", "END"
+};
+
+struct insn
+{
+	opcode		 op;
+	int			 jump;
+	struct node	*n;
+};
+
+/*
+ * strpartial flattened for formatting, text is stored after the ops
+ * so only the runtime parts need measuring
+ */
+struct tmpl_op
+{
+	int			 type;		/* STR_* */
+	int			 len;		/* STR_VERBATIM */
+	union {
+		const char	*text;
+		int			 arg;	/* var slot or capture group */
+	};
+};
+
+struct tmpl
+{
+	int				nops;
+	int				fixed;	/* text length */
+	struct tmpl_op	op[];
+};
+
+/* case labels of a switch, open addressing */
+struct case_table
+{
+	unsigned	mask;
+	struct {
+		const dynstr	*label;
+		int				 index;
+	} slot[];
+};
+
+struct program
+{
+	struct insn	*code;
+	int			 len;
+	int			 cap;
+	bool		 assigns;	/* lines must run one after the other */
+};
+
+/* a write held back until its batch is done */
+struct batch_write
+{
+	struct dest_handle	*dest;
+	dynstr				*line;
+	int					 next;		/* next write of the same line, -1 if last */
+};
+
+/* source symbols named by rules, id is index + 1. program 0 is for
+ * lines from any other source */
+static char				**_sources;
+static int				  _nsources;
+static struct program	 *_progs;
+
+/* compiler state */
+static struct
+{
+	struct program	*prog;
+	int				 source_id;
+	int				 flag;		/* flag known at this point, -1 if not */
+	int				*exits;		/* jumps to the end of the block being compiled */
+	int				 nexits;
+	int				 exits_cap;
+} _cc;
+
+static eval_result  _eval_node_assign(struct node*, struct exec_ctx*);
+static eval_result	_eval_node_match(struct node*, struct exec_ctx*);
+static void			_eval_node_write(struct node*, struct exec_ctx*);
 static void			_match_outofscope(struct node*, struct exec_ctx*);
 static void			_del_assign(struct node*);
-static void			_del_block_match(struct node*);
 static void			_del_match(struct node*);
 static void			_del_matchall(struct node*);
 static void			_del_write(struct node*);
+static void			_del_switch(struct node*);
+static void			_del_case(struct node*);
 
 
 struct node_handler
 {
 	node_type type;
-	eval_result	(*eval)(struct node*, struct exec_ctx*, eval_result);
-	void (*node_cleanup)(struct node *, struct exec_ctx*);
-	void (*block_cleanup)(struct node *);
 	void (*final_cleanup)(struct node *);
 } _handler[] =
 {
-	{ NODE_PASSTHROUGH,	_eval_node_passthrough,	NULL,				NULL, NULL },
-	{ NODE_ASSIGN,		_eval_node_assign,      NULL,				NULL, _del_assign},
-	{ NODE_BREAK,		_eval_node_break,		NULL,				NULL, NULL },
-	{ NODE_MATCH,		_eval_node_match,		_match_outofscope,	_del_block_match, _del_match },
-	{ NODE_MATCHALL,	_eval_node_matchall,	_match_outofscope,	NULL, _del_matchall },
-	{ NODE_MELSE,		_eval_node_match_else,	NULL,				NULL, NULL },
-	{ NODE_WRITE,		_eval_node_write,		NULL,				NULL, _del_write }
+	{ NODE_PASSTHROUGH,	NULL },
+	{ NODE_ASSIGN,		_del_assign },
+	{ NODE_BREAK,		NULL },
+	{ NODE_MATCH,		_del_match },
+	{ NODE_MATCHALL,	_del_matchall },
+	{ NODE_MELSE,		NULL },
+	{ NODE_WRITE,		_del_write },
+	{ NODE_SWITCH,		_del_switch },
+	{ NODE_CASE,		_del_case }
+};
+
+/* literals required by match nodes, scanned once per line */
+static prefilter	*_prefilter;
+
+/* rematch expressions by rx_id, owned by their nodes */
+static struct rx	**_rx;
+static int			  _nrx;
+
+/*
+ * calls from compiled rules back into the interpreter, instructions
+ * are given by program and pc. the generated file gets the same text
+ */
+#define RULES_ABI	1
+#define RULES_API_DECL \
+struct dlog_rules_api \
+{ \
+	int (*match)(void* ctx, int prog, int pc); \
+	void (*found)(void* ctx, int prog, int pc, int so, int eo); \
+	void (*write)(void* ctx, int prog, int pc); \
+	int (*assign)(void* ctx, int prog, int pc); \
+	void (*pop_match)(void* ctx, int prog, int pc); \
+	int (*select)(void* ctx, int prog, int pc); \
+	const char* (*line)(void* ctx, int* len); \
+};
+
+RULES_API_DECL
+
+#define RULES_STR_(...)	#__VA_ARGS__
+#define RULES_STR(x)	RULES_STR_(x)
+
+typedef void (*rules_eval_fn)(const struct dlog_rules_api*, int source_id, void* ctx);
+
+/* rules loaded by node_load_rules(), NULL to interpret */
+static void				*_rules_so;
+static rules_eval_fn	 _rules_eval;
+
+/* deepest match nesting */
+static int					 _ndepth;
+
+/*
+ * everything a thread changes while evaluating lines. the event loop
+ * has its own, worker threads make theirs with node_state_new()
+ */
+struct node_state
+{
+	/* formatted datetime, only redone when the second changes */
+	struct {
+		time_t	sec;
+		int		len;
+		char	buf[1024];
+	} tscache;
+
+	/* most recently used compiled patterns, for dynamic match patterns */
+	struct {
+		char				*text;
+		struct str_pattern	*prog;
+	} pcache[DLOG_PATTERN_CACHE_SIZE];
+	int pcache_nb;
+
+	/* VAR values by slot, an assignment swaps in the spare buffer */
+	dynstr		**vars;
+	dynstr		 *var_spare;
+
+	/* resolved dynamic match pattern and switch key, only needed
+	 * for the lookup */
+	dynstr		 *pattern_text;
+	dynstr		 *key;
+
+	uint64_t			*pf_hits;
+	struct match_frame	*frames;	/* single line evaluation */
+	struct rx			**rx;		/* by rx_id, clones unless _rx */
+
+	/* per line state of a batch, grown to the largest batch */
+	struct {
+		int					 cap;
+		struct exec_ctx		*ctx;
+		int					*pc;
+		bool				*flag;
+		struct match_frame	*frames;
+		uint64_t			*pf_hits;
+		int					*head;		/* first write of each line */
+		int					*tail;
+		struct batch_write	*out;
+		int					 nout;
+		int					 out_cap;
+	} batch;
 };
 
+static struct node_state _main = { .tscache.sec = -1 };
+
+/* fraction of second as text */
+#define FRACT_MAX 16
+
 #define COPY_STRMATCH(to, from) \
 			memcpy(&(to), &(from), sizeof(struct str_match))
 
@@ -74,7 +263,7 @@ _print_tree(struct node* n, int indent)
 		} break;
 		case NODE_MATCH:
 		{
-			str1="MATCH"; if(n->context.match.source) str2=n->context.match.source->str; else str2 = "";
+			str1=n->context.match.re_rx ? "REMATCH" : "MATCH"; if(n->context.match.source) str2=n->context.match.source->str; else str2 = "";
 		} break;
 		case NODE_MATCHALL:
 		{
@@ -88,6 +277,14 @@ _print_tree(struct node* n, int indent)
 		{
 			str1="WRITE"; str2=n->context.nwrite.dest_sym->str;
 		} break;
+		case NODE_SWITCH:
+		{
+			str1="SWITCH"; str2="";
+		} break;
+		case NODE_CASE:
+		{
+			str1="CASE"; if(n->context.ncase.label) str2=n->context.ncase.label->str; else str2="default";
+		} break;
 	}
 	LOG_INFO("%s Node: %s %s", ind, str1, str2);
 	if (n->child) {
@@ -98,159 +295,442 @@ _print_tree(struct node* n, int indent)
 	}
 }
 
-static dynstr
-*strpartial_resolve(strpartial* part, struct exec_ctx* ctx)
+static const struct timespec*
+_exec_now(struct exec_ctx* ctx)
 {
-	char fract[10], *env;
-	dynstr *v;
-	dynstr *str = dynstr_new(NULL);
+	struct exec_time* t = ctx->time;
 
-	while(part) {
-		switch (part->type) {
+	if (!t->valid) {
+		if (unlikely(-1 == clock_gettime(dlogenv->config.timestamp_clock, &t->now))) {
+			LOG_SYS_ERROR("Failed to acquire time");
+			t->now.tv_sec = time(NULL);
+			t->now.tv_nsec = 0;
+		}
+		t->valid = true;
+	}
+	return &t->now;
+}
 
-			case STR_INVALID:
-				goto fail;
+static const char*
+_exec_datetime(struct exec_ctx* ctx, int* len)
+{
+	const struct timespec* ts = _exec_now(ctx);
+	struct node_state* st = ctx->st;
+	struct tm tme;
 
-			case STR_VERBATIM:
-				str = dynstr_cat(str, part->value.rawstr);
-				break;
+	if (ts->tv_sec != st->tscache.sec) {
+		localtime_r(&ts->tv_sec, &tme);
+		st->tscache.len = strftime(st->tscache.buf, sizeof(st->tscache.buf),
+								   dlogenv->config.datetime_format, &tme);
+		st->tscache.sec = ts->tv_sec;
+	}
+	*len = st->tscache.len;
+	return st->tscache.buf;
+}
+
+static long
+_exec_fractsec(struct exec_ctx* ctx)
+{
+	return _exec_now(ctx)->tv_nsec / dlogenv->config.fractsec_divider;
+}
+
+static int
+_exec_fract(struct exec_ctx* ctx, char* buf)
+{
+	return snprintf(buf, FRACT_MAX, "%ld", _exec_fractsec(ctx));
+}
+
+/* text known at compile time, env vars are read once */
+static bool
+_tmpl_text(const strpartial* part, const char** text, int* len)
+{
+	switch (part->type) {
+		case STR_VERBATIM:
+			*text = dynstr_ptr(part->value.rawstr);
+			break;
+
+		case STR_ENV:
+			*text = getenv(dynstr_ptr(part->value.rawstr));
+			if (!*text)
+				*text = "";
+			break;
+
+		default:
+			return false;
+	}
+	*len = strlen(*text);
+	return true;
+}
+
+static struct tmpl*
+_tmpl_compile(const strpartial* part)
+{
+	const strpartial* p;
+	struct tmpl_op* op = NULL;
+	struct tmpl* t;
+	const char* text;
+	char* buf;
+	int nops = 0, ntext = 0, len;
+	bool prev_text = false;
+
+	/* adjacent text is merged into one op */
+	for (p = part; p; p = p->next) {
+		if (_tmpl_text(p, &text, &len)) {
+			nops += !prev_text;
+			ntext += len;
+			prev_text = true;
+		} else {
+			nops++;
+			prev_text = false;
+		}
+	}
+
+	t = calloc(1, sizeof(*t) + nops * sizeof(struct tmpl_op) + ntext + 1);
+	buf = (char *)&t->op[nops];
+
+	for (p = part; p; p = p->next) {
+		if (_tmpl_text(p, &text, &len)) {
+			if (!op || op->type != STR_VERBATIM) {
+				op = &t->op[t->nops++];
+				op->type = STR_VERBATIM;
+				op->text = buf;
+			}
+			memcpy(buf, text, len);
+			buf += len;
+			op->len += len;
+			t->fixed += len;
+		} else {
+			op = &t->op[t->nops++];
+			op->type = p->type;
+			op->arg = p->type == STR_VAR ? p->slot : p->value.number;
+		}
+	}
+	return t;
+}
+
+static int
+_capture_len(const struct exec_ctx* ctx, int group)
+{
+	if (ctx->re_match && (int)ctx->re_match->sm_nmatch > group)
+		return STR_MATCH_LEN(ctx->re_match, group);
+	return 0;
+}
 
+/*
+ * format into 'dst' (or a new string if NULL), sized in a first pass so
+ * it's allocated at most once. 'eol' makes sure it ends with a newline
+ */
+static dynstr*
+_tmpl_format(const struct tmpl* t, struct exec_ctx* ctx, dynstr* dst, bool eol)
+{
+	const struct tmpl_op* op;
+	dynstr** vars = ctx->st->vars;
+	const char* dt;
+	char fract[FRACT_MAX], *start, *w;
+	int size = t->fixed + eol, dtlen, fractlen = 0;
+
+	for (op = t->op; op < t->op + t->nops; op++) {
+		switch (op->type) {
 			case STR_VAR:
-				v = ht_find(dlogenv->vars_table,
-							(uintptr_t)part->value.rawstr);
-				if (v)
-					str = dynstr_cat(str, v);
+				size += dynstr_len(vars[op->arg]);
+				break;
+			case STR_CAPTURE_GROUP:
+				size += _capture_len(ctx, op->arg);
+				break;
+			case STR_DATETIME:
+				_exec_datetime(ctx, &dtlen);
+				size += dtlen;
+				break;
+			case STR_SOURCE:
+				size += dynstr_len(ctx->source);
+				break;
+			case STR_LOGLINE:
+				size += ctx->line->len;
+				break;
+			case STR_FRACTSECOND:
+				fractlen = _exec_fract(ctx, fract);
+				size += fractlen;
+				break;
+			case STR_DATETIMEFRACT:
+				_exec_datetime(ctx, &dtlen);
+				fractlen = _exec_fract(ctx, fract);
+				size += dtlen + 1 + fractlen;
 				break;
+		}
+	}
 
-			case STR_ENV:
+	if (dst) {
+		dynstr_reset(dst);
+		dst = dynstr_resize(dst, size);
+	} else {
+		dst = dynstr_reserve(size);
+	}
+	start = w = dynstr_wendptr(dst);
 
-				env = getenv(dynstr_ptr(part->value.rawstr));
-				dynstr_reset(part->value.rawstr);
-				dynstr_mcat(part->value.rawstr, dynstr_new(env));
-				part->type = STR_VERBATIM;
-				str = dynstr_cat(str, part->value.rawstr);
+#define TMPL_PUT(p, l) do { memcpy(w, (p), (l)); w += (l); } while (0)
+	for (op = t->op; op < t->op + t->nops; op++) {
+		switch (op->type) {
+			case STR_VERBATIM:
+				TMPL_PUT(op->text, op->len);
+				break;
+			case STR_VAR:
+				TMPL_PUT(dynstr_ptr(vars[op->arg]), dynstr_len(vars[op->arg]));
 				break;
-
 			case STR_CAPTURE_GROUP:
-				if ((int)ctx->re_match->sm_nmatch > part->value.number) {
-					str = dynstr_ccat(str, ctx->re_match->sm_match[part->value.number]);
-				}
+				if (_capture_len(ctx, op->arg))
+					TMPL_PUT(STR_MATCH_PTR(ctx->re_match, op->arg),
+							 _capture_len(ctx, op->arg));
 				break;
-
 			case STR_DATETIME:
-				str = dynstr_ccat(str, ctx->datetime);
+				dt = _exec_datetime(ctx, &dtlen);
+				TMPL_PUT(dt, dtlen);
 				break;
-
 			case STR_SOURCE:
-				str = dynstr_cat(str, ctx->source);
+				TMPL_PUT(dynstr_ptr(ctx->source), dynstr_len(ctx->source));
 				break;
-
 			case STR_LOGLINE:
-				str = dynstr_cat(str, ctx->line);
+				TMPL_PUT(ctx->line->ptr, ctx->line->len);
 				break;
-
 			case STR_FRACTSECOND:
-				str = dynstr_padright(str, 10);
-				int ret = snprintf(dynstr_wendptr(str), 10, "%ld", ctx->fract_sec);
-				dynstr_fill(str, ret);
+				TMPL_PUT(fract, fractlen);
 				break;
-
 			case STR_DATETIMEFRACT:
-				str = dynstr_ccat(str, ctx->datetime);
-				snprintf(fract, sizeof(fract)-1, "%ld", ctx->fract_sec);
-				fract[sizeof(fract)-1] = 0;
-				str = dynstr_ccat(str, ".");
-				str = dynstr_ccat(str, fract);
+				dt = _exec_datetime(ctx, &dtlen);
+				TMPL_PUT(dt, dtlen);
+				*w++ = '.';
+				TMPL_PUT(fract, fractlen);
 				break;
+		}
+	}
+#undef TMPL_PUT
 
-			default:
-				goto fail;
+	if (eol && (w == start || w[-1] != '\n'))
+		*w++ = '\n';
+	dynstr_fill(dst, w - start);
+	return dst;
+}
+
+static const struct str_pattern*
+_pattern_cache_get(struct node_state* st, const char* text, const char** err)
+{
+	struct str_pattern* prog;
+	int i;
+
+	for (i=0; i<st->pcache_nb; i++) {
+		if (!strcmp(st->pcache[i].text, text))
+			break;
+	}
+
+	if (i < st->pcache_nb) {
+		if (i > 0) {
+			/* move to front */
+			char* t = st->pcache[i].text;
+			prog = st->pcache[i].prog;
+			memmove(&st->pcache[1], &st->pcache[0], i * sizeof(st->pcache[0]));
+			st->pcache[0].text = t;
+			st->pcache[0].prog = prog;
 		}
-		part = part->next;
+		return st->pcache[0].prog;
 	}
 
-	return str;
+	if (!(prog = str_pattern_compile(text, err)))
+		return NULL;
 
-fail:
-	dynstr_free(str);
-	return NULL;
+	if (st->pcache_nb == DLOG_PATTERN_CACHE_SIZE) {
+		/* evict the least recently used */
+		st->pcache_nb--;
+		free(st->pcache[st->pcache_nb].text);
+		str_pattern_free(st->pcache[st->pcache_nb].prog);
+	}
+	memmove(&st->pcache[1], &st->pcache[0], st->pcache_nb * sizeof(st->pcache[0]));
+	st->pcache[0].text = strdup(text);
+	st->pcache[0].prog = prog;
+	st->pcache_nb++;
+	return prog;
 }
 
 static eval_result
-_eval_node(struct node* n, struct exec_ctx* ctx, eval_result prev_res)
+_eval_node_assign(struct node* n, struct exec_ctx* ex_ctx)
 {
-	eval_result topr, r;
+	struct node_ctx_assign* ctx = &n->context.assign;
+	struct node_state* st = ex_ctx->st;
+	dynstr* old;
 
-	topr = _handler[n->context.type].eval(n, ctx, prev_res);
+	/* formatted aside, the value may refer to the var itself */
+	st->var_spare = _tmpl_format(ctx->tmpl, ex_ctx, st->var_spare, false);
 
-	if (topr == EVAL_BREAK || topr == EVAL_ERROR) {
-		goto end;
-	}
+	old = st->vars[ctx->slot];
+	st->vars[ctx->slot] = st->var_spare;
+	st->var_spare = old;
+	return EVAL_TRUE;
+}
 
-	if (EVAL_TRUE == topr && n->child) {
+/* a pattern that is only a var is used as is */
+static const char*
+_match_pattern(struct node_ctx_match* ctx, struct exec_ctx* ex_ctx)
+{
+	const struct tmpl* t = ctx->re_tmpl;
+	struct node_state* st = ex_ctx->st;
 
-		r = _eval_node(n->child, ctx, topr);
+	if (t->nops == 1 && t->op[0].type == STR_VAR)
+		return dynstr_ptr(st->vars[t->op[0].arg]);
 
-		if (_handler[n->context.type].node_cleanup)
-			_handler[n->context.type].node_cleanup(n, ctx);
+	st->pattern_text = _tmpl_format(t, ex_ctx, st->pattern_text, false);
+	return dynstr_ptr(st->pattern_text);
+}
 
-		if (r == EVAL_BREAK || r == EVAL_ERROR) {
-			/* don't let breaks escape this block */
-			goto end;
-		}
+/* the line, a capture or constant text are used where they are,
+ * anything else is formatted into 'buf' */
+static const char*
+_tmpl_view(const struct tmpl* t, struct exec_ctx* ex_ctx, dynstr** buf, int* len)
+{
+	const struct tmpl_op* op = &t->op[0];
+
+	if (t->nops == 0) {
+		*len = 0;
+		return "";
 	}
 
-	if (n->sibling) {
-		r = _eval_node(n->sibling, ctx, topr);
+	if (t->nops == 1) {
+		switch (op->type) {
+			case STR_LOGLINE:
+				*len = ex_ctx->line->len;
+				return ex_ctx->line->ptr;
+
+			case STR_CAPTURE_GROUP:
+				if (!(*len = _capture_len(ex_ctx, op->arg)))
+					return "";
+				return STR_MATCH_PTR(ex_ctx->re_match, op->arg);
+
+			case STR_VERBATIM:
+				*len = op->len;
+				return op->text;
+		}
 	}
 
-end:
-	if (_handler[n->context.type].block_cleanup)
-		_handler[n->context.type].block_cleanup(n);
-	return topr;
+	*buf = _tmpl_format(t, ex_ctx, *buf, false);
+	*len = dynstr_len(*buf);
+	return dynstr_ptr(*buf);
 }
 
-static eval_result
-_eval_node_assign(struct node* n, struct exec_ctx* ex_ctx, eval_result prev_res)
+/* captures point into the target, the frame is untouched while in scope */
+static const char*
+_match_target(struct node_ctx_match* ctx, struct exec_ctx* ex_ctx, int* len)
 {
-	struct node_ctx_assign* ctx = &n->context.assign;
-	dynstr* res = strpartial_resolve(ctx->pattern, ex_ctx);
-	if (res) {
-		ht_upsert(dlogenv->vars_table, (intptr_t)ctx->var, res);
-		return EVAL_TRUE;
+	return _tmpl_view(ctx->target_tmpl, ex_ctx, &ex_ctx->frames[ctx->depth].target, len);
+}
+
+static unsigned
+_case_hash(const char* s, int len)
+{
+	unsigned h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static struct case_table*
+_case_table_new(struct node* n)
+{
+	struct case_table* t;
+	unsigned size = 4, i;
+
+	while (size < 2 * (unsigned)n->context.nswitch.ncases)
+		size *= 2;
+	t = calloc(1, sizeof(*t) + size * sizeof(t->slot[0]));
+	t->mask = size - 1;
+
+	for (struct node* c = n->child->child; c; c = c->sibling) {
+		const dynstr* label = c->context.ncase.label;
+
+		if (!label)
+			continue;
+		i = _case_hash(dynstr_ptr(label), dynstr_len(label)) & t->mask;
+		while (t->slot[i].label)
+			i = (i + 1) & t->mask;
+		t->slot[i].label = label;
+		t->slot[i].index = c->context.ncase.index;
+	}
+	return t;
+}
+
+/* index of the case labelled 'key', -1 if none */
+static int
+_case_find(const struct case_table* t, const char* key, int len)
+{
+	unsigned i = _case_hash(key, len) & t->mask;
+
+	for (; t->slot[i].label; i = (i + 1) & t->mask) {
+		if (dynstr_len(t->slot[i].label) == len &&
+			!memcmp(dynstr_ptr(t->slot[i].label), key, len))
+			return t->slot[i].index;
 	}
+	return -1;
+}
+
+static int
+_eval_node_switch(struct node* n, struct exec_ctx* ex_ctx)
+{
+	struct node_ctx_switch* ctx = &n->context.nswitch;
+	const char* key;
+	int len;
 
-	return EVAL_ERROR;
+	key = _tmpl_view(ctx->key_tmpl, ex_ctx, &ex_ctx->st->key, &len);
+	return _case_find(ctx->table, key, len);
 }
 
 static eval_result
-_eval_node_match(struct node* n, struct exec_ctx* ex_ctx, eval_result prev_res)
+_eval_node_match(struct node* n, struct exec_ctx* ex_ctx)
 {
 	const char* err = NULL;
 	eval_result ret;
 
 	struct node_ctx_match* ctx = &n->context.match;
-	struct str_match *sm = &ctx->cur_match;
+	struct match_frame* f = &ex_ctx->frames[ctx->depth];
+	struct str_match *sm = &f->match;
 
-	dynstr* re = strpartial_resolve(ctx->re_pattern, ex_ctx);
-	dynstr* t = strpartial_resolve(ctx->target, ex_ctx);
+	const struct str_pattern* prog = ctx->re_prog;
+	const char* target;
+	int len;
 
-	ctx->prev_match = ex_ctx->re_match;
+	f->prev = ex_ctx->re_match;
 
-	if (re && t) {
-		if (!ctx->source || (ctx->source && !dynstr_cmp(ctx->source, ex_ctx->source))) {
-			if (-1 == str_match(dynstr_ptr(t), dynstr_ptr(re), sm, &err)) {
-				if (err) {
-					free((void *)err);
-					ret = EVAL_ERROR;
-				} else {
-					ret = EVAL_FALSE;
-				}
+	if (ctx->prefilter_id) {
+		if (!ex_ctx->pf_scanned) {
+			prefilter_scan(_prefilter, ex_ctx->line->ptr, ex_ctx->line->len,
+						   ex_ctx->pf_hits);
+			ex_ctx->pf_scanned = true;
+		}
+		if (!PREFILTER_HIT(ex_ctx->pf_hits, ctx->prefilter_id))
+			return EVAL_FALSE;
+	}
+
+	if (ctx->re_rx) {
+		target = _match_target(ctx, ex_ctx, &len);
+		if (!rx_match(ex_ctx->st->rx[ctx->rx_id], target, len, sm))
+			return EVAL_FALSE;
+		ex_ctx->re_match = sm;
+		return EVAL_TRUE;
+	}
+
+	if (!prog)
+		prog = _pattern_cache_get(ex_ctx->st, _match_pattern(ctx, ex_ctx), &err);
+
+	target = _match_target(ctx, ex_ctx, &len);
+
+	if (prog) {
+		if (-1 == str_match_pattern_len(target, len, prog, sm, &err)) {
+			/* errors are static strings */
+			if (err) {
+				ret = EVAL_ERROR;
 			} else {
-				/* save current regex context into global context */
-				ex_ctx->re_match = sm;
-				ret = sm->sm_nmatch > 0 ? EVAL_TRUE : EVAL_FALSE;
+				ret = EVAL_FALSE;
 			}
+		} else if (sm->sm_nmatch > 0) {
+			/* captures are visible until the block ends */
+			ex_ctx->re_match = sm;
+			ret = EVAL_TRUE;
 		} else {
 			ret = EVAL_FALSE;
 		}
@@ -259,56 +739,36 @@ _eval_node_match(struct node* n, struct exec_ctx* ex_ctx, eval_result prev_res)
 		ret = EVAL_ERROR;
 	}
 
-	dynstr_free(re);
-	dynstr_free(t);
-
 	return ret;
 }
 
-static eval_result
-_eval_node_matchall(struct node* n, struct exec_ctx* ex_ctx, eval_result prev_res)
+static void
+_eval_node_write(struct node* n, struct exec_ctx* ex_ctx)
 {
-	eval_result ret = EVAL_FALSE;
-	struct node_ctx_matchall* ctx = &n->context.matchall;
+	struct node_ctx_write* ctx = &n->context.nwrite;
+	dynstr* line = _tmpl_format(ctx->tmpl, ex_ctx, NULL, true);
+	struct node_state* st = ex_ctx->st;
+	struct batch_write* w;
 
-	if (!ctx->source || (ctx->source && !dynstr_cmp(ctx->source, ex_ctx->source))) {
-		ret = EVAL_TRUE;
+	if (ex_ctx->write_cb) {
+		ex_ctx->write_cb(ctx->dest, line);
+		return;
 	}
 
-	return ret;
-}
-
-static eval_result
-_eval_node_match_else(struct node* n, struct exec_ctx* ex_ctx, eval_result prev_res)
-{
-	return prev_res == EVAL_FALSE ? EVAL_TRUE : EVAL_FALSE;
-}
-
-static eval_result
-_eval_node_write(struct node* n, struct exec_ctx* ex_ctx, eval_result prev_res)
-{
-	dynstr* val = strpartial_resolve(n->context.nwrite.string_fmt, ex_ctx);
-	dynstr* dst = n->context.nwrite.dest_sym;
-
-	if (val && dst) {
-		ex_ctx->write_cb(dst, val);
-	} else {
-		LOG_ERROR("NODE_WRITE failed to resolve format and/or destination");
+	if (st->batch.nout == st->batch.out_cap) {
+		st->batch.out_cap = st->batch.out_cap ? st->batch.out_cap * 2 : 256;
+		st->batch.out = realloc(st->batch.out, st->batch.out_cap * sizeof(struct batch_write));
 	}
-
-	return EVAL_TRUE;
-}
-
-static eval_result
-_eval_node_passthrough(struct node* n, struct exec_ctx* ex_ctx, eval_result prev_res)
-{
-	return EVAL_TRUE;
-}
-
-static eval_result
-_eval_node_break(struct node* n, struct exec_ctx* ex_ctx, eval_result prev_res)
-{
-	return EVAL_BREAK;
+	w = &st->batch.out[st->batch.nout];
+	w->dest = ctx->dest;
+	w->line = line;
+	w->next = -1;
+
+	if (st->batch.head[ex_ctx->idx] == -1)
+		st->batch.head[ex_ctx->idx] = st->batch.nout;
+	else
+		st->batch.out[st->batch.tail[ex_ctx->idx]].next = st->batch.nout;
+	st->batch.tail[ex_ctx->idx] = st->batch.nout++;
 }
 
 static void
@@ -316,28 +776,28 @@ _del_assign(struct node* n)
 {
 	dynstr_free(n->context.assign.var);
 	strpartial_del(n->context.assign.pattern);
+	free(n->context.assign.tmpl);
 }
 
 static void
 _match_outofscope(struct node* n, struct exec_ctx* ctx)
 {
-	ctx->re_match = n->context.match.prev_match;
-	str_match_free(&n->context.match.cur_match);
-}
+	struct match_frame* f = &ctx->frames[n->context.match.depth];
 
-static void
-_del_block_match(struct node* n)
-{
-	str_match_free(&n->context.match.cur_match);
+	ctx->re_match = f->prev;
+	str_match_free(&f->match);
 }
 
 static void
 _del_match(struct node* n)
 {
 	strpartial_del(n->context.match.re_pattern);
+	str_pattern_free(n->context.match.re_prog);
+	rx_free(n->context.match.re_rx);
 	strpartial_del(n->context.match.target);
+	free(n->context.match.re_tmpl);
+	free(n->context.match.target_tmpl);
 	dynstr_free(n->context.match.source);
-	str_match_free(&n->context.match.cur_match);
 }
 
 static void
@@ -350,12 +810,27 @@ static void
 _del_write(struct node*n )
 {
 	strpartial_del(n->context.nwrite.string_fmt);
+	free(n->context.nwrite.tmpl);
 	dynstr_free(n->context.nwrite.dest_sym);
 }
 
 
-void
-node_destroyall(struct node* root)
+static void
+_del_switch(struct node* n)
+{
+	strpartial_del(n->context.nswitch.key);
+	free(n->context.nswitch.key_tmpl);
+	free(n->context.nswitch.table);
+}
+
+static void
+_del_case(struct node* n)
+{
+	dynstr_free(n->context.ncase.label);
+}
+
+static void
+_destroy_nodes(struct node* root)
 {
 	if (!root)
 		return;
@@ -367,41 +842,1077 @@ node_destroyall(struct node* root)
 		_handler[root->context.type].final_cleanup(root);
 
 	free(root);
-	node_destroyall(ch);
-	node_destroyall(sib);
+	_destroy_nodes(ch);
+	_destroy_nodes(sib);
+}
+
+/* the state of a thread, made by the thread using it */
+static void
+_state_init(struct node_state* st, bool clone_rx)
+{
+	st->tscache.sec = -1;
+	st->frames = calloc(_ndepth, sizeof(struct match_frame));
+	if (_prefilter)
+		st->pf_hits = calloc(PREFILTER_WORDS(prefilter_count(_prefilter)), sizeof(uint64_t));
+
+	st->vars = calloc(dlogenv->vars.nb + 1, sizeof(dynstr*));
+	for (int i=0; i<dlogenv->vars.nb; i++)
+		st->vars[i] = dynstr_copy(dlogenv->vars.init[i]);
+	st->var_spare = dynstr_new(NULL);
+
+	/* a compiled expression can't be shared between threads */
+	st->rx = _rx;
+	if (clone_rx) {
+		st->rx = calloc(_nrx + 1, sizeof(struct rx*));
+		for (int i=0; i<_nrx; i++)
+			st->rx[i] = rx_clone(_rx[i]);
+	}
+}
+
+static void
+_state_clear(struct node_state* st)
+{
+	for (int i=0; i<st->pcache_nb; i++) {
+		free(st->pcache[i].text);
+		str_pattern_free(st->pcache[i].prog);
+	}
+	for (int i=0; st->vars && i<dlogenv->vars.nb; i++)
+		dynstr_free(st->vars[i]);
+	free(st->vars);
+	dynstr_free(st->var_spare);
+	dynstr_free(st->pattern_text);
+	dynstr_free(st->key);
+	free(st->pf_hits);
+
+	for (int i=0; st->frames && i<_ndepth; i++)
+		dynstr_free(st->frames[i].target);
+	free(st->frames);
+	if (st->rx != _rx) {
+		for (int i=0; i<_nrx; i++)
+			rx_free(st->rx[i]);
+		free(st->rx);
+	}
+
+	for (int i=0; i<st->batch.cap * _ndepth; i++)
+		dynstr_free(st->batch.frames[i].target);
+	free(st->batch.ctx);
+	free(st->batch.pc);
+	free(st->batch.flag);
+	free(st->batch.frames);
+	free(st->batch.pf_hits);
+	free(st->batch.head);
+	free(st->batch.tail);
+	free(st->batch.out);
+	memset(st, 0, sizeof(*st));
+}
+
+struct node_state*
+node_state_new(void)
+{
+	struct node_state* st = calloc(1, sizeof(*st));
+
+	_state_init(st, true);
+	return st;
 }
 
 void
-node_eval_root(struct node* root, const dynstr* line, const dynstr* source_sym, write_line_cb wcb)
+node_state_free(struct node_state* st)
 {
-	struct tm tme;
-	struct timespec ts;
+	if (!st)
+		return;
+	_state_clear(st);
+	free(st);
+}
+
+void
+node_destroyall(struct node* root)
+{
+	_state_clear(&_main);
+	_destroy_nodes(root);
+
+	prefilter_free(_prefilter);
+	_prefilter = NULL;
+	free(_rx);
+	_rx = NULL;
+	_nrx = 0;
+
+	for (int i=0; _progs && i<=_nsources; i++)
+		free(_progs[i].code);
+	for (int i=0; i<_nsources; i++)
+		free(_sources[i]);
+	free(_progs);
+	free(_sources);
+
+	if (_rules_so)
+		dlclose(_rules_so);
+	_rules_so = NULL;
+	_rules_eval = NULL;
+	free(_cc.exits);
+	_progs = NULL;
+	_sources = NULL;
+	_nsources = 0;
+	memset(&_cc, 0, sizeof(_cc));
+}
+
+/* register the required literal of every match on the bare line,
+ * with no prefilter just clear the ids */
+static void
+_prefilter_collect(struct node* n, prefilter* pf)
+{
+	for (; n; n = n->sibling) {
+		if (n->context.type == NODE_MATCH) {
+			struct node_ctx_match* ctx = &n->context.match;
+			const char* lit;
+			size_t len = 0;
+
+			ctx->prefilter_id = 0;
+			if (pf && ctx->re_prog &&
+				ctx->target->type == STR_LOGLINE && !ctx->target->next) {
+				lit = str_pattern_literal(ctx->re_prog, &len);
+				if (len >= DLOG_PREFILTER_MIN_LITERAL)
+					ctx->prefilter_id = prefilter_add(pf, lit, len);
+			}
+		}
+		_prefilter_collect(n->child, pf);
+	}
+}
+
+static void
+_prefilter_prepare(struct node* root)
+{
+	prefilter* pf = prefilter_new();
 
-	char tbuf[1024];
+	_prefilter_collect(root, pf);
 
-	if (unlikely(-1 == clock_gettime(CLOCK_REALTIME, &ts))) {
-		LOG_SYS_ERROR("node_eval_root failed to acquire time, bailing.");
+	if (!prefilter_count(pf) || prefilter_build(pf)) {
+		_prefilter_collect(root, NULL);
+		prefilter_free(pf);
 		return;
 	}
 
-	localtime_r(&ts.tv_sec, &tme);
-	strftime(tbuf, sizeof(tbuf), dlogenv->config.datetime_format, &tme);
+	LOG_DEBUG("Match prefilter with %d literals", prefilter_count(pf));
+	_prefilter = pf;
+}
 
-	struct exec_ctx ctx = {
-		.re_match = NULL,
-		.datetime = tbuf,
-		.fract_sec = ts.tv_nsec / dlogenv->config.fractsec_divider,
-		.source = source_sym,
-		.line = line,
-		.write_cb = wcb
-	};
+static void
+_tmpl_collect(struct node* n)
+{
+	for (; n; n = n->sibling) {
+		switch (n->context.type) {
+			case NODE_ASSIGN:
+				n->context.assign.tmpl = _tmpl_compile(n->context.assign.pattern);
+				break;
+			case NODE_MATCH:
+				if (!n->context.match.re_prog && !n->context.match.re_rx)
+					n->context.match.re_tmpl = _tmpl_compile(n->context.match.re_pattern);
+				n->context.match.target_tmpl = _tmpl_compile(n->context.match.target);
+				if (n->context.match.re_rx) {
+					_rx = realloc(_rx, (_nrx + 1) * sizeof(struct rx*));
+					_rx[_nrx] = n->context.match.re_rx;
+					n->context.match.rx_id = _nrx++;
+				}
+				break;
+			case NODE_WRITE:
+				n->context.nwrite.tmpl = _tmpl_compile(n->context.nwrite.string_fmt);
+				break;
+			case NODE_SWITCH:
+				n->context.nswitch.key_tmpl = _tmpl_compile(n->context.nswitch.key);
+				n->context.nswitch.table = _case_table_new(n);
+				break;
+		}
+		_tmpl_collect(n->child);
+	}
+}
+
+static int
+_source_intern(const dynstr* sym)
+{
+	int id = node_source_id(dynstr_ptr(sym));
 
-	(void) _eval_node(root, &ctx, EVAL_TRUE);
+	if (!id) {
+		_sources = realloc(_sources, (_nsources + 1) * sizeof(char*));
+		_sources[_nsources++] = strdup(dynstr_ptr(sym));
+		id = _nsources;
+	}
+	return id;
 }
 
-void
-print_node_tree(struct node* root)
+/* matches at the same depth are never in scope together, they share a frame */
+static void
+_depth_collect(struct node* n, int depth)
 {
-	_print_tree(root, 0);
+	for (; n; n = n->sibling) {
+		if (n->context.type == NODE_MATCH) {
+			n->context.match.depth = depth;
+			if (depth >= _ndepth)
+				_ndepth = depth + 1;
+			_depth_collect(n->child, depth + 1);
+		} else {
+			_depth_collect(n->child, depth);
+		}
+	}
+}
+
+static void
+_source_collect(struct node* n)
+{
+	for (; n; n = n->sibling) {
+		if (n->context.type == NODE_MATCH && n->context.match.source)
+			n->context.match.source_id = _source_intern(n->context.match.source);
+		else if (n->context.type == NODE_MATCHALL)
+			n->context.matchall.source_id = _source_intern(n->context.matchall.source);
+		_source_collect(n->child);
+	}
+}
+
+static int
+_emit(opcode op, struct node* n)
+{
+	struct program* p = _cc.prog;
+
+	if (p->len == p->cap) {
+		p->cap = p->cap ? p->cap * 2 : 64;
+		p->code = realloc(p->code, p->cap * sizeof(struct insn));
+	}
+	p->code[p->len].op = op;
+	p->code[p->len].jump = -1;
+	p->code[p->len].n = n;
+	return p->len++;
+}
+
+/* instruction leaving the current block, patched once its end is known */
+static void
+_emit_exit(opcode op, struct node* n)
+{
+	if (_cc.nexits == _cc.exits_cap) {
+		_cc.exits_cap = _cc.exits_cap ? _cc.exits_cap * 2 : 16;
+		_cc.exits = realloc(_cc.exits, _cc.exits_cap * sizeof(int));
+	}
+	_cc.exits[_cc.nexits++] = _emit(op, n);
+}
+
+static void _compile_stmt(struct node* n);
+static void _compile_block(struct node* block);
+
+/* jump table with one entry per case, then the case blocks. default
+ * comes last so it ends the switch without a jump */
+static void
+_compile_switch(struct node* n)
+{
+	struct node* def = NULL;
+	int sw = _emit(OP_SWITCH, n), nends = 0;
+	int* ends = calloc(n->context.nswitch.ncases + 1, sizeof(int));
+
+	for (struct node* c = n->child->child; c; c = c->sibling) {
+		if (c->context.ncase.label)
+			_emit(OP_CASE, c);
+	}
+
+	for (struct node* c = n->child->child; c; c = c->sibling) {
+		if (!c->context.ncase.label) {
+			def = c;
+			continue;
+		}
+		_cc.prog->code[sw + 1 + c->context.ncase.index].jump = _cc.prog->len;
+		_compile_block(c->child);
+		ends[nends++] = _emit(OP_END_CASE, c);
+	}
+
+	_cc.prog->code[sw].jump = _cc.prog->len;
+	if (def) {
+		_compile_block(def->child);
+		_emit(OP_END_BLOCK, def);
+	}
+
+	while (nends)
+		_cc.prog->code[ends[--nends]].jump = _cc.prog->len;
+	free(ends);
+}
+
+static void
+_compile_block(struct node* block)
+{
+	int mark = _cc.nexits;
+
+	/* blocks are entered with the flag set */
+	_cc.flag = 1;
+	for (struct node* n = block ? block->child : NULL; n; n = n->sibling) {
+		_compile_stmt(n);
+		if (n->context.type == NODE_BREAK)
+			break;
+	}
+
+	/* breaks and errors don't escape the block */
+	while (_cc.nexits > mark)
+		_cc.prog->code[_cc.exits[--_cc.nexits]].jump = _cc.prog->len;
+}
+
+/* block whose condition is known, if taken it runs unconditionally */
+static void
+_compile_known(struct node* n, bool taken)
+{
+	if (taken)
+		_compile_block(n->child);
+	_cc.flag = taken;
+}
+
+static void
+_compile_stmt(struct node* n)
+{
+	int jif;
+
+	switch (n->context.type) {
+		case NODE_PASSTHROUGH:
+			_compile_block(n);
+			_cc.flag = 1;
+			break;
+
+		case NODE_ASSIGN:
+			_emit_exit(OP_ASSIGN, n);
+			_cc.prog->assigns = true;
+			_cc.flag = 1;
+			break;
+
+		case NODE_BREAK:
+			_emit_exit(OP_BREAK, n);
+			break;
+
+		case NODE_WRITE:
+			_emit(OP_WRITE, n);
+			_cc.flag = 1;
+			break;
+
+		case NODE_MATCH:
+			if (n->context.match.source_id &&
+				n->context.match.source_id != _cc.source_id) {
+				_compile_known(n, false);
+				break;
+			}
+			_emit_exit(OP_MATCH, n);
+			jif = _emit(OP_JUMP_IF_FALSE, n);
+			_compile_block(n->child);
+			_emit(OP_POP_MATCH, n);
+			_cc.prog->code[jif].jump = _cc.prog->len;
+			_cc.flag = -1;
+			break;
+
+		case NODE_MATCHALL:
+			_compile_known(n, n->context.matchall.source_id == _cc.source_id);
+			break;
+
+		case NODE_SWITCH:
+			_compile_switch(n);
+			_cc.flag = n->context.nswitch.has_default ? 1 : -1;
+			break;
+
+		case NODE_MELSE:
+			if (_cc.flag != -1) {
+				_compile_known(n, !_cc.flag);
+				break;
+			}
+			_emit(OP_ELSE, n);
+			jif = _emit(OP_JUMP_IF_FALSE, n);
+			_compile_block(n->child);
+			_emit(OP_END_BLOCK, n);
+			_cc.prog->code[jif].jump = _cc.prog->len;
+			_cc.flag = -1;
+			break;
+	}
+}
+
+int
+node_source_id(const char* symbol)
+{
+	for (int i=0; i<_nsources; i++) {
+		if (!strcmp(_sources[i], symbol))
+			return i + 1;
+	}
+	return 0;
+}
+
+bool
+node_source_writes(int source_id, const struct dest_handle* dest)
+{
+	const struct program* prog;
+
+	if (!_progs)
+		return false;
+	if (source_id < 0 || source_id > _nsources)
+		source_id = 0;
+
+	prog = &_progs[source_id];
+	for (int pc=0; pc<prog->len; pc++) {
+		if (prog->code[pc].op == OP_WRITE && prog->code[pc].n->context.nwrite.dest == dest)
+			return true;
+	}
+	return false;
+}
+
+void
+node_tree_prepare(struct node* root)
+{
+	_prefilter_prepare(root);
+	_source_collect(root);
+	_tmpl_collect(root);
+
+	_ndepth = 1;
+	_depth_collect(root, 0);
+	_state_init(&_main, false);
+
+	_progs = calloc(_nsources + 1, sizeof(struct program));
+	for (int id=0; id<=_nsources; id++) {
+		_cc.prog = &_progs[id];
+		_cc.source_id = id;
+		_compile_block(root);
+		_emit(OP_END, NULL);
+	}
+	LOG_DEBUG("Rules compiled for %d sources", _nsources);
+}
+
+/*
+ * compiled rules
+ */
+
+/* the node of an instruction named by compiled code, NULL if the code
+ * doesn't fit these programs */
+static struct node*
+_api_node(int prog, int pc, opcode op)
+{
+	if (prog < 0 || prog > _nsources || pc < 0 || pc >= _progs[prog].len ||
+		_progs[prog].code[pc].op != op) {
+		LOG_ERROR("Compiled rules call for a bad instruction (%d:%d)", prog, pc);
+		return NULL;
+	}
+	return _progs[prog].code[pc].n;
+}
+
+static int
+_api_match(void* ctx, int prog, int pc)
+{
+	struct node* n = _api_node(prog, pc, OP_MATCH);
+
+	if (!n)
+		return -1;
+	switch (_eval_node_match(n, ctx)) {
+		case EVAL_TRUE:
+			return 1;
+		case EVAL_FALSE:
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/* a plain pattern matched by the compiled code, same captures as
+ * _eval_node_match() would give */
+static void
+_api_found(void* c, int prog, int pc, int so, int eo)
+{
+	struct exec_ctx* ctx = c;
+	struct node* n = _api_node(prog, pc, OP_MATCH);
+	struct match_frame* f;
+
+	if (!n)
+		return;
+	f = &ctx->frames[n->context.match.depth];
+	f->prev = ctx->re_match;
+	f->match.sm_str = ctx->line->ptr;
+	f->match.sm_find[0].sm_so = 0;
+	f->match.sm_find[0].sm_eo = ctx->line->len;
+	f->match.sm_find[1].sm_so = so;
+	f->match.sm_find[1].sm_eo = eo;
+	f->match.sm_nmatch = 2;
+	ctx->re_match = &f->match;
+}
+
+static void
+_api_write(void* ctx, int prog, int pc)
+{
+	struct node* n = _api_node(prog, pc, OP_WRITE);
+
+	if (!n)
+		return;
+	_eval_node_write(n, ctx);
+}
+
+static int
+_api_assign(void* ctx, int prog, int pc)
+{
+	struct node* n = _api_node(prog, pc, OP_ASSIGN);
+
+	if (!n)
+		return -1;
+	return _eval_node_assign(n, ctx) == EVAL_ERROR ? -1 : 0;
+}
+
+static void
+_api_pop_match(void* ctx, int prog, int pc)
+{
+	struct node* n = _api_node(prog, pc, OP_POP_MATCH);
+
+	if (!n)
+		return;
+	_match_outofscope(n, ctx);
+}
+
+static int
+_api_select(void* ctx, int prog, int pc)
+{
+	struct node* n = _api_node(prog, pc, OP_SWITCH);
+
+	if (!n)
+		return -1;
+	return _eval_node_switch(n, ctx);
+}
+
+static const char*
+_api_line(void* c, int* len)
+{
+	struct exec_ctx* ctx = c;
+
+	*len = ctx->line->len;
+	return ctx->line->ptr;
+}
+
+static const struct dlog_rules_api _rules_api = {
+	.match = _api_match,
+	.found = _api_found,
+	.write = _api_write,
+	.assign = _api_assign,
+	.pop_match = _api_pop_match,
+	.select = _api_select,
+	.line = _api_line
+};
+
+static void
+_gen_cstring(FILE* fp, const char* s, size_t len)
+{
+	fputc('"', fp);
+	for (size_t i=0; i<len; i++) {
+		unsigned char c = s[i];
+
+		if (c == '"' || c == '\\' || c == '?')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20 || c >= 0x7f)
+			fprintf(fp, "\\%03o", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+/* literal text of a verbatim pattern matched against the whole line */
+static const char*
+_gen_plain(const struct node* n, size_t* len, int* anchor)
+{
+	const struct node_ctx_match* ctx = &n->context.match;
+
+	if (!ctx->re_prog || ctx->target_tmpl->nops != 1 ||
+		ctx->target_tmpl->op[0].type != STR_LOGLINE)
+		return NULL;
+
+	/* env vars could differ when the rules are loaded */
+	for (const strpartial* p = ctx->re_pattern; p; p = p->next) {
+		if (p->type != STR_VERBATIM)
+			return NULL;
+	}
+	return str_pattern_plain(ctx->re_prog, len, anchor);
+}
+
+static void
+_gen_match(FILE* fp, int id, int pc, const struct insn* in)
+{
+	const char* lit;
+	size_t len;
+	int anchor;
+
+	if (!(lit = _gen_plain(in->n, &len, &anchor))) {
+		fprintf(fp, "\tif ((r = api->match(ctx, %d, %d)) < 0)\n\t\tgoto L%d;\n"
+				"\tflag = r;\n", id, pc, in->jump);
+		return;
+	}
+
+	if (anchor) {
+		fprintf(fp, "\tflag = len >= %zu && !memcmp(s, ", len);
+		_gen_cstring(fp, lit, len);
+		fprintf(fp, ", %zu);\n\tif (flag)\n\t\tapi->found(ctx, %d, %d, 0, %zu);\n",
+				len, id, pc, len);
+	} else {
+		fprintf(fp, "\tp = memmem(s, len, ");
+		_gen_cstring(fp, lit, len);
+		fprintf(fp, ", %zu);\n\tflag = p != NULL;\n\tif (flag)\n"
+				"\t\tapi->found(ctx, %d, %d, p - s, p - s + %zu);\n", len, id, pc, len);
+	}
+}
+
+static void
+_gen_program(FILE* fp, int id)
+{
+	const struct program* prog = &_progs[id];
+	const struct insn* in;
+	bool* target = calloc(prog->len + 1, sizeof(bool));
+
+	for (int pc=0; pc<prog->len; pc++) {
+		if (prog->code[pc].jump >= 0)
+			target[prog->code[pc].jump] = true;
+	}
+
+	fprintf(fp, "static void\n_prog_%d(const struct dlog_rules_api* api, void* ctx)\n{\n"
+			"\tconst char *s, *p;\n\tint len, flag = 1, r;\n\n"
+			"\ts = api->line(ctx, &len);\n\t(void)p; (void)r; (void)flag;\n", id);
+
+	for (int pc=0; pc<prog->len; pc++) {
+		in = &prog->code[pc];
+
+		if (target[pc])
+			fprintf(fp, "L%d:\n", pc);
+		switch (in->op) {
+			case OP_MATCH:
+				_gen_match(fp, id, pc, in);
+				break;
+
+			case OP_ELSE:
+				fprintf(fp, "\tflag = !flag;\n");
+				break;
+
+			case OP_JUMP_IF_FALSE:
+				fprintf(fp, "\tif (!flag)\n\t\tgoto L%d;\n", in->jump);
+				break;
+
+			case OP_WRITE:
+				fprintf(fp, "\tapi->write(ctx, %d, %d);\n\tflag = 1;\n", id, pc);
+				break;
+
+			case OP_ASSIGN:
+				fprintf(fp, "\tif (api->assign(ctx, %d, %d) < 0)\n\t\tgoto L%d;\n"
+						"\tflag = 1;\n", id, pc, in->jump);
+				break;
+
+			case OP_BREAK:
+				fprintf(fp, "\tgoto L%d;\n", in->jump);
+				break;
+
+			case OP_POP_MATCH:
+				fprintf(fp, "\tapi->pop_match(ctx, %d, %d);\n\tflag = 1;\n", id, pc);
+				break;
+
+			case OP_END_BLOCK:
+				fprintf(fp, "\tflag = 1;\n");
+				break;
+
+			case OP_SWITCH:
+				fprintf(fp, "\tswitch (api->select(ctx, %d, %d)) {\n", id, pc);
+				for (int i=0; i<in->n->context.nswitch.ncases; i++)
+					fprintf(fp, "\t\tcase %d: flag = 1; goto L%d;\n", i, prog->code[pc + 1 + i].jump);
+				fprintf(fp, "\t\tdefault: flag = %d; goto L%d;\n\t}\n",
+						in->n->context.nswitch.has_default, in->jump);
+				break;
+
+			case OP_CASE:
+				break;
+
+			case OP_END_CASE:
+				fprintf(fp, "\tflag = 1;\n\tgoto L%d;\n", in->jump);
+				break;
+
+			case OP_END:
+				fprintf(fp, "\treturn;\n");
+				break;
+		}
+	}
+	fprintf(fp, "}\n\n");
+	free(target);
+}
+
+static uint64_t
+_hash_bytes(uint64_t h, const void* p, size_t len)
+{
+	const unsigned char* b = p;
+
+	while (len--)
+		h = (h ^ *b++) * 1099511628211ULL;
+	return h;
+}
+
+/* the config alone doesn't pin the generated code, a different dlog
+ * binary may compile it to other programs. hash what the generated
+ * code relies on: sources, opcodes, jumps and the inlined literals */
+static uint64_t
+_rules_hash(void)
+{
+	uint64_t h = dlogenv->config_hash;
+
+	h = _hash_bytes(h, &_nsources, sizeof(_nsources));
+	for (int id=1; id<=_nsources; id++)
+		h = _hash_bytes(h, _sources[id-1], strlen(_sources[id-1]) + 1);
+
+	for (int id=0; id<=_nsources; id++) {
+		const struct program* prog = &_progs[id];
+
+		h = _hash_bytes(h, &prog->len, sizeof(prog->len));
+		for (int pc=0; pc<prog->len; pc++) {
+			const struct insn* in = &prog->code[pc];
+			const char* lit;
+			size_t len;
+			int anchor;
+
+			h = _hash_bytes(h, &in->op, sizeof(in->op));
+			h = _hash_bytes(h, &in->jump, sizeof(in->jump));
+			if (in->op == OP_MATCH && (lit = _gen_plain(in->n, &len, &anchor))) {
+				h = _hash_bytes(h, &anchor, sizeof(anchor));
+				h = _hash_bytes(h, lit, len);
+			} else if (in->op == OP_SWITCH) {
+				h = _hash_bytes(h, &in->n->context.nswitch.ncases, sizeof(int));
+				h = _hash_bytes(h, &in->n->context.nswitch.has_default, sizeof(bool));
+			}
+		}
+	}
+	return h;
+}
+
+static int
+_gen_build(const char* csrc, const char* so)
+{
+	const char* cc = getenv("CC") ? getenv("CC") : "cc";
+	char* argv[] = { (char*)cc, "-O2", "-shared", "-fPIC", "-o", (char*)so, (char*)csrc, NULL };
+	int status;
+	pid_t pid;
+
+	if (-1 == (pid = fork())) {
+		LOG_SYS_ERROR("fork failed");
+		return -1;
+	}
+	if (pid == 0) {
+		execvp(cc, argv);
+		_exit(127);
+	}
+	if (-1 == waitpid(pid, &status, 0) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		LOG_ERROR("Failed to build %s with %s", so, cc);
+		return -1;
+	}
+	return 0;
+}
+
+int
+node_compile_rules(const char* config)
+{
+	char csrc[DLOG_PATH_MAX], so[DLOG_PATH_MAX];
+	FILE* fp;
+
+	if (!_progs)
+		return -1;
+
+	snprintf(csrc, sizeof(csrc), "%s.c", config);
+	snprintf(so, sizeof(so), "%s.so", config);
+	if (!(fp = fopen(csrc, "w"))) {
+		LOG_SYS_ERROR("Failed to create %s", csrc);
+		return -1;
+	}
+
+	fprintf(fp, "/* rules of %s, generated by dlog -C */\n"
+			"#define _GNU_SOURCE\n#include <stddef.h>\n#include <string.h>\n\n"
+			"%s\n\n"
+			"const int dlog_rules_abi = %d;\n"
+			"const unsigned long long dlog_rules_hash = 0x%016llxULL;\n\n",
+			config, RULES_STR(RULES_API_DECL), RULES_ABI,
+			(unsigned long long)_rules_hash());
+
+	for (int id=0; id<=_nsources; id++)
+		_gen_program(fp, id);
+
+	fprintf(fp, "void\ndlog_rules_eval(const struct dlog_rules_api* api, int source_id, void* ctx)\n"
+			"{\n\tswitch (source_id) {\n");
+	for (int id=1; id<=_nsources; id++)
+		fprintf(fp, "\t\tcase %d: _prog_%d(api, ctx); return;\n", id, id);
+	fprintf(fp, "\t\tdefault: _prog_0(api, ctx); return;\n\t}\n}\n");
+
+	if (fclose(fp)) {
+		LOG_SYS_ERROR("Failed to write %s", csrc);
+		return -1;
+	}
+
+	if (_gen_build(csrc, so))
+		return -1;
+	LOG_INFO("Rules compiled to %s", so);
+	return 0;
+}
+
+void
+node_load_rules(const char* config)
+{
+	char so[DLOG_PATH_MAX];
+	const unsigned long long* hash;
+	const int* abi;
+	void* h;
+
+	/* dlopen() searches the library path for names without a slash */
+	snprintf(so, sizeof(so), "%s%s.so", strchr(config, '/') ? "" : "./", config);
+	if (!_progs || access(so, F_OK))
+		return;
+
+	if (!(h = dlopen(so, RTLD_NOW | RTLD_LOCAL))) {
+		LOG_WARNING("Failed to load %s (%s), rules are interpreted", so, dlerror());
+		return;
+	}
+
+	abi = dlsym(h, "dlog_rules_abi");
+	hash = dlsym(h, "dlog_rules_hash");
+	_rules_eval = (rules_eval_fn)dlsym(h, "dlog_rules_eval");
+	if (!abi || !hash || !_rules_eval || *abi != RULES_ABI ||
+		*hash != _rules_hash()) {
+		LOG_WARNING("%s wasn't built for these rules, they are interpreted", so);
+		_rules_eval = NULL;
+		dlclose(h);
+		return;
+	}
+
+	_rules_so = h;
+	LOG_INFO("Rules loaded from %s", so);
+}
+
+/* runs the instruction at 'pc' for one line, returns the next pc or
+ * -1 once the line is done. jumps only go forward */
+static inline int
+_exec(const struct insn* code, int pc, struct exec_ctx* ctx, bool* flag)
+{
+	const struct insn* in = &code[pc++];
+	eval_result r;
+	int i;
+
+	switch (in->op) {
+		case OP_MATCH:
+			r = _eval_node_match(in->n, ctx);
+			if (r == EVAL_ERROR)
+				pc = in->jump;
+			else
+				*flag = r == EVAL_TRUE;
+			break;
+
+		case OP_ELSE:
+			*flag = !*flag;
+			break;
+
+		case OP_JUMP_IF_FALSE:
+			if (!*flag)
+				pc = in->jump;
+			break;
+
+		case OP_WRITE:
+			_eval_node_write(in->n, ctx);
+			*flag = true;
+			break;
+
+		case OP_ASSIGN:
+			if (_eval_node_assign(in->n, ctx) == EVAL_ERROR)
+				pc = in->jump;
+			else
+				*flag = true;
+			break;
+
+		case OP_BREAK:
+			pc = in->jump;
+			break;
+
+		case OP_POP_MATCH:
+			_match_outofscope(in->n, ctx);
+			*flag = true;
+			break;
+
+		case OP_END_BLOCK:
+			*flag = true;
+			break;
+
+		case OP_SWITCH:
+			i = _eval_node_switch(in->n, ctx);
+			if (i >= 0) {
+				pc = code[pc + i].jump;
+				*flag = true;
+			} else {
+				/* default is entered with the flag set like any block */
+				pc = in->jump;
+				*flag = in->n->context.nswitch.has_default;
+			}
+			break;
+
+		case OP_CASE:
+			break;
+
+		case OP_END_CASE:
+			pc = in->jump;
+			*flag = true;
+			break;
+
+		case OP_END:
+			return -1;
+	}
+	return pc;
+}
+
+static void
+_eval_line(struct node_state* st, const strview* line, const dynstr* source_sym,
+		   int source_id, write_line_cb wcb)
+{
+	/* time is only read if the line needs a timestamp */
+	struct exec_time t = { .valid = false };
+	struct exec_ctx ctx = {
+		.re_match = NULL,
+		.frames = st->frames,
+		.time = &t,
+		.pf_hits = st->pf_hits,
+		.pf_scanned = false,
+		.source = source_sym,
+		.line = line,
+		.idx = 0,
+		.st = st,
+		.write_cb = wcb
+	};
+	const struct insn* code = _progs[source_id].code;
+	bool flag = true;
+	int pc = 0;
+
+	if (_rules_eval) {
+		_rules_eval(&_rules_api, source_id, &ctx);
+		return;
+	}
+
+	while (pc != -1)
+		pc = _exec(code, pc, &ctx, &flag);
+}
+
+void
+node_eval_root(struct node* root, const strview* line, const dynstr* source_sym,
+			   int source_id, write_line_cb wcb)
+{
+	/* the programs were compiled from root by node_tree_prepare */
+	if (!root || !_progs)
+		return;
+
+	if (source_id < 0 || source_id > _nsources)
+		source_id = 0;
+	_eval_line(&_main, line, source_sym, source_id, wcb);
+}
+
+static void
+_batch_reserve(struct node_state* st, int nlines, int words)
+{
+	if (nlines <= st->batch.cap)
+		return;
+
+	st->batch.ctx = realloc(st->batch.ctx, nlines * sizeof(struct exec_ctx));
+	st->batch.pc = realloc(st->batch.pc, nlines * sizeof(int));
+	st->batch.flag = realloc(st->batch.flag, nlines * sizeof(bool));
+	st->batch.head = realloc(st->batch.head, nlines * sizeof(int));
+	st->batch.tail = realloc(st->batch.tail, nlines * sizeof(int));
+	st->batch.pf_hits = realloc(st->batch.pf_hits, (nlines * words + 1) * sizeof(uint64_t));
+	st->batch.frames = realloc(st->batch.frames, nlines * _ndepth * sizeof(struct match_frame));
+	memset(st->batch.frames + st->batch.cap * _ndepth, 0,
+		   (nlines - st->batch.cap) * _ndepth * sizeof(struct match_frame));
+	st->batch.cap = nlines;
+}
+
+void
+node_eval_batch(struct node_state* st, struct node* root, const strview* lines,
+				int nlines, const dynstr* source_sym, int source_id, write_line_cb wcb)
+{
+	/* one timestamp for the whole batch */
+	struct exec_time t = { .valid = false };
+	const struct program* prog;
+	int words = _prefilter ? PREFILTER_WORDS(prefilter_count(_prefilter)) : 0;
+
+	if (!root || !_progs)
+		return;
+
+	if (!st)
+		st = &_main;
+	if (source_id < 0 || source_id > _nsources)
+		source_id = 0;
+	prog = &_progs[source_id];
+
+	/* an assignment has to be seen by the lines after it, compiled
+	 * rules take one line at a time */
+	if (nlines == 1 || prog->assigns || _rules_eval) {
+		for (int i=0; i<nlines; i++)
+			_eval_line(st, &lines[i], source_sym, source_id, wcb);
+		return;
+	}
+
+	_batch_reserve(st, nlines, words);
+	for (int i=0; i<nlines; i++) {
+		struct exec_ctx* ctx = &st->batch.ctx[i];
+
+		ctx->re_match = NULL;
+		ctx->frames = st->batch.frames + i * _ndepth;
+		ctx->time = &t;
+		ctx->pf_hits = st->batch.pf_hits + i * words;
+		ctx->pf_scanned = false;
+		ctx->source = source_sym;
+		ctx->line = &lines[i];
+		ctx->idx = i;
+		ctx->st = st;
+		ctx->write_cb = NULL;
+
+		st->batch.pc[i] = 0;
+		st->batch.flag[i] = true;
+		st->batch.head[i] = -1;
+	}
+	st->batch.nout = 0;
+
+	/* the lines sitting at an instruction are its selection, as jumps
+	 * only go forward a single pass takes every line to the end */
+	for (int pc=0; pc<prog->len; pc++) {
+		for (int i=0; i<nlines; i++) {
+			if (st->batch.pc[i] == pc)
+				st->batch.pc[i] = _exec(prog->code, pc, &st->batch.ctx[i], &st->batch.flag[i]);
+		}
+	}
+
+	/* writes were held back, let them out line by line */
+	for (int i=0; i<nlines; i++) {
+		for (int w=st->batch.head[i]; w != -1; w = st->batch.out[w].next)
+			wcb(st->batch.out[w].dest, st->batch.out[w].line);
+	}
+}
+
+static void
+_print_program(const struct program* p)
+{
+	const struct insn* in;
+	const char* arg;
+
+	for (int pc=0; pc<p->len; pc++) {
+		in = &p->code[pc];
+		arg = "";
+		switch (in->op) {
+			case OP_WRITE:
+				arg = in->n->context.nwrite.dest_sym->str;
+				break;
+			case OP_ASSIGN:
+				arg = in->n->context.assign.var->str;
+				break;
+			case OP_CASE:
+				arg = in->n->context.ncase.label->str;
+				break;
+			default:
+				break;
+		}
+		if (in->jump >= 0)
+			LOG_INFO("%4d %-13s %s -> %d", pc, _opname[in->op], arg, in->jump);
+		else
+			LOG_INFO("%4d %-13s %s", pc, _opname[in->op], arg);
+	}
+}
+
+void
+print_node_tree(struct node* root)
+{
+	_print_tree(root, 0);
+
+	for (int id=0; _progs && id<=_nsources; id++) {
+		if (id)
+			LOG_INFO("Program for source %s:", _sources[id - 1]);
+		else
+			LOG_INFO("Program for other sources:");
+		_print_program(&_progs[id]);
+	}
 }
 
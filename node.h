@@ -1,25 +1,53 @@
 #ifndef DLOG_NODE_H__
 #define DLOG_NODE_H__
+#include <time.h>
 #include "def.h"
 #include "patterns.h"
 #include "strpartial.h"
 #include "dynstr.h"
 
-typedef void (*write_line_cb)(dynstr* symbol, dynstr* line);
+struct dest_handle;
+struct tmpl;
+struct rx;
+struct case_table;
+struct node_state;
 
+typedef void (*write_line_cb)(struct dest_handle* dest, dynstr* line);
+
+
+/*
+ * captures of the match at one nesting depth, they point into target
+ */
+struct match_frame
+{
+	struct str_match	 match;
+	struct str_match	*prev;
+	dynstr				*target;
+};
+
+/* read on first use, shared by the lines evaluated together */
+struct exec_time
+{
+	struct timespec		 now;
+	bool				 valid;
+};
 
 /*
- * current execution context
+ * current execution context, one per line
  */
 struct exec_ctx
 {
 	struct str_match*	 re_match;
-	const char			*datetime;
-	long				 fract_sec;
+	struct match_frame	*frames;	/* by match depth */
+	struct exec_time	*time;
+	uint64_t			*pf_hits;	/* prefilter literals in the line */
+	bool				 pf_scanned;
 	const dynstr		*source;
-	const dynstr		*line;
+	const strview		*line;
+	int					 idx;		/* line in the batch */
+	struct node_state	*st;		/* of the thread evaluating it */
 
-	write_line_cb		write_cb;
+	write_line_cb		write_cb;	/* NULL when writes are deferred */
 };
 
 typedef enum {
@@ -29,7 +57,9 @@ typedef enum {
 	NODE_MATCH,
 	NODE_MATCHALL,
 	NODE_MELSE,
-	NODE_WRITE
+	NODE_WRITE,
+	NODE_SWITCH,
+	NODE_CASE
 } node_type;
 
 /*
@@ -39,27 +69,53 @@ typedef enum {
 struct node_ctx_assign
 {
 	dynstr			*var;
+	int				 slot;
 	strpartial      *pattern;
+	struct tmpl		*tmpl;
 };
 
 struct node_ctx_match
 {
 	strpartial			*re_pattern;
+	struct tmpl			*re_tmpl;		/* dynamic re_pattern */
+	struct str_pattern	*re_prog;		/* compiled static re_pattern */
+	struct rx			*re_rx;			/* rematch, replaces re_prog */
+	int					 rx_id;			/* rematch, clone in node_state */
+	int					 prefilter_id;	/* required literal in the line, 0 if none */
 	strpartial			*target;
+	struct tmpl			*target_tmpl;
 	dynstr				*source;
-	struct str_match	 cur_match;
-	struct str_match	*prev_match;
+	int					 source_id;		/* interned source, 0 if any */
+	int					 depth;			/* enclosing matches, frame in exec_ctx */
 };
 
 struct node_ctx_matchall
 {
 	dynstr			*source;
+	int				 source_id;
 };
 
 struct node_ctx_write
 {
 	strpartial *string_fmt;
+	struct tmpl *tmpl;
 	dynstr* dest_sym;
+	struct dest_handle* dest;	/* bound at config time */
+};
+
+struct node_ctx_switch
+{
+	strpartial			*key;
+	struct tmpl			*key_tmpl;
+	struct case_table	*table;			/* case labels to case index */
+	int					 ncases;		/* not counting default */
+	bool				 has_default;
+};
+
+struct node_ctx_case
+{
+	dynstr	*label;		/* NULL for default */
+	int		 index;
 };
 
 struct node
@@ -75,13 +131,43 @@ struct node
 			struct node_ctx_match		match;
 			struct node_ctx_matchall	matchall;
 			struct node_ctx_write		nwrite;
+			struct node_ctx_switch		nswitch;
+			struct node_ctx_case		ncase;
 		};
 	} context;
 };
 
 
+/* compile the complete tree, run once before any evaluation */
+void node_tree_prepare(struct node* root);
+
+/* rules to run for lines from 'symbol', 0 if no rule names it */
+int node_source_id(const char* symbol);
+
+/* whether the rules for 'source_id' may write to 'dest' */
+bool node_source_writes(int source_id, const struct dest_handle* dest);
+
 /* entry point */
-void node_eval_root(struct node* root, const dynstr* line, const dynstr* source, write_line_cb);
+void node_eval_root(struct node* root, const strview* line, const dynstr* source,
+					int source_id, write_line_cb);
+
+/* same as node_eval_root() on each line in turn, but each instruction
+ * runs for all the lines it selects. writes come out in the same order.
+ * 'st' is the state of the calling thread, NULL for the event loop */
+void node_eval_batch(struct node_state* st, struct node* root, const strview* lines,
+					 int nlines, const dynstr* source, int source_id, write_line_cb);
+
+/* evaluation state of a worker thread, vars and caches are its own.
+ * made and freed by the thread using it, after node_tree_prepare() */
+struct node_state* node_state_new(void);
+void node_state_free(struct node_state*);
+
+/* dlog -C, writes '<config>.c' for the programs and builds '<config>.so' */
+int node_compile_rules(const char* config);
+
+/* run the rules from '<config>.so' if it was built for this config */
+void node_load_rules(const char* config);
+
 void node_destroyall(struct node* root);
 void print_node_tree(struct node* root);
 
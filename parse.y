@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <err.h>
 
 #include "def.h"
@@ -16,6 +17,8 @@
 #include "strpartial.h"
 #include "coredesc.h"
 #include "node.h"
+#include "rx.h"
+#include "lr.h"
 #include "env.h"
 
 // #define YYDEBUG 1
@@ -26,10 +29,18 @@ int yylex(void);
 int parse_config(void);
 
 static void node_add_child(struct node* parent, struct node* n);
+static void cfgfile_hash(FILE* fp);
 static int tstring_is_symbol(const char* s);
 static void add_origin(struct dorigin* or);
 static dynstr *strpartial_resolve_ex(const strpartial* part);
 static bool strpartial_isstatic(const strpartial* part, bool allow_vars);
+static int parse_line_term(const char* s);
+static long long parse_size(const char* s);
+static struct str_pattern *compile_static_pattern(const strpartial* re);
+static struct rx *compile_regex(const strpartial* re);
+static void add_var(const char* sym, dynstr* val);
+static int var_slot(const char* sym);
+static bool bind_vars(strpartial* part);
 
 struct yystype_t
 {
@@ -63,9 +74,24 @@ cfgfile_include(const char* filename)
 
 	nfile->filename = strdup(filename);
 	TAILQ_INSERT_TAIL(&cfgfiles, nfile, entry);
+	cfgfile_hash(nfile->fp);
 	return nfile;
 }
 
+/* FNV-1a over the contents of every file, in the order they are read */
+static void
+cfgfile_hash(FILE* fp)
+{
+	char buf[4096];
+	size_t n;
+
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		for (size_t i=0; i<n; i++)
+			dlogenv->config_hash = (dlogenv->config_hash ^ (unsigned char)buf[i]) * 1099511628211ULL;
+	}
+	rewind(fp);
+}
+
 void
 cfgfile_pop()
 {
@@ -79,23 +105,35 @@ cfgfile_pop()
 	yyfp = f;
 }
 
+/* optional source settings, reset after each source */
+static struct source_opts
+{
+	int line_term;
+	int weight;
+	int priority;
+} srcopts;
+
+/* optional destination settings, reset after each destination */
+static struct dest_opts
+{
+	bool thread;
+	bool backpressure;
+	size_t buffer;
+	char* spill;
+	size_t spill_max;
+} destopts;
+
 /* nodes */
 static struct node	*rootnode;
 static struct node	*curblock;
 static struct node	*curnode;
 
-/* hashtable deep-copies the key (dynstr) */
-#define ADD_VAR(char_sym, val) \
-	do {\
-		dynstr* _sym = dynstr_new((char_sym));\
-		ht_upsert(dlogenv->vars_table, (uintptr_t)(_sym), (val));\
-		dynstr_free(_sym);\
-	}while(0)
-
 #define CHECK_PARTIAL(var, arg) \
 	do { var = strpartial_split(arg.v);\
 	if (!var) {\
 		yyerror("invalid format (%s)", arg.v);\
+		YYABORT;\
+	} else if (!bind_vars(var)) {\
 		strpartial_del(var);\
 		YYABORT;\
 	} }while(0)
@@ -104,6 +142,8 @@ static struct node	*curnode;
 	do { var = strpartial_split(arg.v);\
 	if (!var) {\
 		yyerror("invalid format (%s)", arg.v);\
+		YYABORT;\
+	} else if (!bind_vars(var)) {\
 		strpartial_del(var);\
 		YYABORT;\
 	} else {\
@@ -115,12 +155,42 @@ static struct node	*curnode;
 	}}while(0)
 
 
+/* static patterns are compiled (and checked) once */
+#define CHECK_PATTERN(prog, re) \
+	do { prog = NULL;\
+	if (strpartial_isstatic(re, false) &&\
+		!(prog = compile_static_pattern(re))) {\
+		strpartial_del(re);\
+		YYABORT;\
+	} }while(0)
+
+/* regexes are always static, 'tgt' is already parsed and goes too */
+#define CHECK_REGEX(rx, re, tgt, arg) \
+	do { rx = NULL;\
+	if (!strpartial_isstatic(re, false)) {\
+		yyerror("regex not static (%s)", arg.v);\
+		strpartial_del(re);\
+		strpartial_del(tgt);\
+		YYABORT;\
+	} else if (!(rx = compile_regex(re))) {\
+		strpartial_del(re);\
+		strpartial_del(tgt);\
+		YYABORT;\
+	} }while(0)
+
 #define CHECK_SYMBOL(arg) \
 	do {if (arg.is_quoted || !(arg.is_symbol)) {\
 		yyerror("invalid symbol (%s)", arg.v);\
 		YYABORT;\
 	}} while(0)
 
+/* only a tcp destination goes down */
+#define CHECK_NO_SPILL(arg) \
+	do {if (destopts.spill) {\
+		yyerror("spill is for tcp destinations (%s)", arg.v);\
+		YYABORT;\
+	}} while(0)
+
 
 #define ADD_NODE(n, typ)\
 		do { n = calloc(1, sizeof(struct node));\
@@ -136,9 +206,11 @@ static struct node	*curnode;
 
 %}
 
-%token TINCLUDE TPIDFILE TLOGFILE TLISTEN TDATETIMEFORMAT TTIMESTAMPRES TSOURCE TDESTINATION
+%token TINCLUDE TPIDFILE TLOGFILE TLISTEN TDATETIMEFORMAT TTIMESTAMPRES TTIMESTAMPCLOCK TTHREADS TWORKERS TSOURCE TDESTINATION
 %token TTCP TFILE TFIFO TMAXSIZE TROTLOG
-%token TRULE TMATCH TMATCHALL TFROM TELSE TWRITE TBREAK TVAR TAS
+%token TRULE TMATCH TREMATCH TMATCHALL TFROM TELSE TWRITE TBREAK TVAR TAS
+%token TSWITCH TCASE TDEFAULT
+%token TTERMINATOR TTHREAD TWEIGHT TPRIORITY TBACKPRESSURE TBUFFER TSPILL
 %token T__INVALID__
 //%token <v.string> TSTRING
 %token TSTRING
@@ -160,14 +232,15 @@ command:
 
 var:
 	TVAR TSTRING '=' TSTRING {
-	/* var  <symbol> = <value (strpartial)> */
+	/* var  <symbol> = <value (static strpartial)> */
 		strpartial* val;
 
 		CHECK_SYMBOL($2);
-		CHECK_PARTIAL(val, $4);
+		CHECK_PARTIAL_STATIC(val, $4);
 		LOG_DEBUG("Adding VAR for symbol %s", $2.v);
 
-		ADD_VAR($2.v, val);
+		add_var($2.v, strpartial_resolve_ex(val));
+		strpartial_del(val);
 	}
 	;
 
@@ -187,7 +260,7 @@ include:
 	;
 
 descriptor_cmd:
-	TSOURCE TFILE TSTRING TAS TSTRING {
+	TSOURCE TFILE TSTRING TAS TSTRING source_opts {
 	/*source file <path (partial_ex)> as <symbol> */
 		strpartial *f;
 		dynstr *filename;
@@ -200,13 +273,17 @@ descriptor_cmd:
 		or->type = D_FILER;
 		or->symbol = strdup($5.v);
 		or->file.path = strdup(dynstr_ptr(filename));
+		or->line_term = srcopts.line_term;
+		or->weight = srcopts.weight;
+		or->priority = srcopts.priority;
 		add_origin(or);
+		memset(&srcopts, 0, sizeof(srcopts));
 
 		dynstr_free(filename);
 		strpartial_del(f);
 	}
 	|
-	TSOURCE TFIFO TSTRING TAS TSTRING {
+	TSOURCE TFIFO TSTRING TAS TSTRING source_opts {
 	/*source fifo <path (partial_ex)> as <symbol> */
 		strpartial *f;
 		dynstr *fifopath;
@@ -219,18 +296,23 @@ descriptor_cmd:
 		or->type = D_FIFOR;
 		or->symbol = strdup($5.v);
 		or->file.path = strdup(dynstr_ptr(fifopath));
+		or->line_term = srcopts.line_term;
+		or->weight = srcopts.weight;
+		or->priority = srcopts.priority;
 		add_origin(or);
+		memset(&srcopts, 0, sizeof(srcopts));
 
 		dynstr_free(fifopath);
 		strpartial_del(f);
 	}
 	|
-	TDESTINATION TFILE TSTRING TAS TSTRING {
+	TDESTINATION TFILE TSTRING TAS TSTRING dest_opts {
 
 		strpartial *f;
 		dynstr *filename;
 		CHECK_PARTIAL_STATIC(f, $3);
 		CHECK_SYMBOL($5);
+		CHECK_NO_SPILL($5);
 
 		filename = strpartial_resolve_ex(f);
 
@@ -243,7 +325,11 @@ descriptor_cmd:
 		or->type = D_FILEW;
 		or->symbol = strdup($5.v);
 		or->file.path = strdup(dynstr_ptr(filename));
+		or->write_thread = destopts.thread;
+		or->backpressure = destopts.backpressure;
+		or->write_buffer = destopts.buffer ? destopts.buffer : DLOG_WRITE_BUFFER;
 		add_origin(or);
+		memset(&destopts, 0, sizeof(destopts));
 
 		LOG_DEBUG("Adding destination file %s (%s)", or->file.path, or->symbol);
 
@@ -251,12 +337,21 @@ descriptor_cmd:
 		strpartial_del(f);
 	}
 	|
-	TDESTINATION TFIFO TSTRING TAS TSTRING {
+	TDESTINATION TFIFO TSTRING TAS TSTRING dest_opts {
 	/* destination fifo <path/strpartial> as <symbol> */
 		strpartial *f;
 		dynstr *fifopath;
 		CHECK_PARTIAL_STATIC(f, $3);
 		CHECK_SYMBOL($5);
+		CHECK_NO_SPILL($5);
+
+		/* a stalled reader would hold the thread, and the event loop
+		   waiting for it to drain */
+		if (destopts.thread) {
+			yyerror("writer thread is for file destinations (%s)", $5.v);
+			strpartial_del(f);
+			YYABORT;
+		}
 
 		fifopath = strpartial_resolve_ex(f);
 
@@ -269,20 +364,25 @@ descriptor_cmd:
 		or->type = D_FIFOW;
 		or->symbol = strdup($5.v);
 		or->file.path = strdup(dynstr_ptr(fifopath));
+		or->write_thread = destopts.thread;
+		or->backpressure = destopts.backpressure;
+		or->write_buffer = destopts.buffer ? destopts.buffer : DLOG_WRITE_BUFFER;
 		add_origin(or);
+		memset(&destopts, 0, sizeof(destopts));
 		LOG_DEBUG("Adding destination FIFO %s (%s)", or->file.path, or->symbol);
 
 		dynstr_free(fifopath);
 		strpartial_del(f);
 	}
 	|
-	TDESTINATION TROTLOG TSTRING TSTRING TAS TSTRING {
+	TDESTINATION TROTLOG TSTRING TSTRING TAS TSTRING dest_opts {
 	/* destination rotlog <file path> <max file size as string> as <symbol> */
 
 		strpartial *f;
 		dynstr *filename;
 		CHECK_PARTIAL_STATIC(f, $3);
 		CHECK_SYMBOL($6);
+		CHECK_NO_SPILL($6);
 
 		filename = strpartial_resolve_ex(f);
 
@@ -297,14 +397,18 @@ descriptor_cmd:
 		or->symbol = strdup($6.v);
 		or->file.path = strdup(dynstr_ptr(filename));
 		or->file.size = maxsizebytes;
+		or->write_thread = destopts.thread;
+		or->backpressure = destopts.backpressure;
+		or->write_buffer = destopts.buffer ? destopts.buffer : DLOG_WRITE_BUFFER;
 		add_origin(or);
+		memset(&destopts, 0, sizeof(destopts));
 		LOG_DEBUG("Adding destination Rotlog %s (%s)", or->file.path, or->symbol);
 
 		dynstr_free(filename);
 		strpartial_del(f);
 	}
 	|
-	TDESTINATION TTCP TSTRING TSTRING TAS TSTRING {
+	TDESTINATION TTCP TSTRING TSTRING TAS TSTRING dest_opts {
 	/* destination tcp <host> <port> as <symbol> */
 
 		strpartial *host, *port;
@@ -314,6 +418,12 @@ descriptor_cmd:
 		CHECK_PARTIAL_STATIC(port, $4);
 		CHECK_SYMBOL($6);
 
+		/* sockets don't block the event loop */
+		if (destopts.thread) {
+			yyerror("writer thread is for file destinations (%s)", $6.v);
+			YYABORT;
+		}
+
 		shost = strpartial_resolve_ex(host);
 		sport = strpartial_resolve_ex(port);
 
@@ -322,7 +432,12 @@ descriptor_cmd:
 		or->symbol = strdup($6.v);
 		or->socket.host = strdup(dynstr_ptr(shost));
 		or->socket.port = strdup(dynstr_ptr(sport));
+		or->backpressure = destopts.backpressure;
+		or->write_buffer = destopts.buffer ? destopts.buffer : DLOG_WRITE_BUFFER;
+		or->spill_dir = destopts.spill;
+		or->spill_max = destopts.spill_max ? destopts.spill_max : DLOG_SPILL_MAX;
 		add_origin(or);
+		memset(&destopts, 0, sizeof(destopts));
 
 		dynstr_free(shost);
 		dynstr_free(sport);
@@ -331,6 +446,83 @@ descriptor_cmd:
 	}
 	;
 
+source_opts:
+	| source_opts source_opt
+	;
+
+dest_opts:
+	| dest_opts dest_opt
+	;
+
+dest_opt:
+	TTHREAD {
+	/* thread, written by a thread of its own */
+		destopts.thread = true;
+	}
+	| TBACKPRESSURE {
+	/* backpressure, pause the sources feeding it instead of dropping lines */
+		destopts.backpressure = true;
+	}
+	| TBUFFER TSTRING {
+	/* buffer <bytes>[K|M|G], queued for writing at most */
+		long long sz = parse_size($2.v);
+		if (sz <= 0) {
+			yyerror("invalid buffer size (%s)", $2.v);
+			YYABORT;
+		}
+		destopts.buffer = sz;
+	}
+	| TSPILL TSTRING {
+	/* spill <dir>, what the destination can't take goes to disk */
+		destopts.spill = strdup($2.v);
+	}
+	| TSPILL TSTRING TSTRING {
+	/* spill <dir> <bytes>[K|M|G], on disk at most */
+		long long sz = parse_size($3.v);
+		if (sz <= 0) {
+			yyerror("invalid spill size (%s)", $3.v);
+			YYABORT;
+		}
+		destopts.spill = strdup($2.v);
+		destopts.spill_max = sz;
+	}
+	;
+
+source_opt:
+	TTERMINATOR TSTRING {
+	/* terminator lf|crlf|nul|<char>|<0xNN> */
+		int t = parse_line_term($2.v);
+		if (t < 0) {
+			yyerror("invalid line terminator (%s)", $2.v);
+			YYABORT;
+		}
+		srcopts.line_term = t;
+	}
+	| TWEIGHT TSTRING {
+	/* weight <n>, read share against the other sources */
+		char* end;
+		long n = strtol($2.v, &end, 10);
+		if (*end || n < 1 || n > DLOG_MAX_WEIGHT) {
+			yyerror("invalid source weight (%s)", $2.v);
+			YYABORT;
+		}
+		srcopts.weight = n;
+	}
+	| TPRIORITY TSTRING {
+	/* priority high|normal|low */
+		if (!strcmp($2.v, "high")) {
+			srcopts.priority = DPRIO_HIGH;
+		} else if (!strcmp($2.v, "normal")) {
+			srcopts.priority = DPRIO_NORMAL;
+		} else if (!strcmp($2.v, "low")) {
+			srcopts.priority = DPRIO_LOW;
+		} else {
+			yyerror("invalid source priority (%s)", $2.v);
+			YYABORT;
+		}
+	}
+	;
+
 config_cmd:
 	TPIDFILE TSTRING {
 		free(dlogenv->config.pidfile);
@@ -366,6 +558,39 @@ config_cmd:
 		}
 		dlogenv->config.fractsec_divider = div;
 	}
+	| TTIMESTAMPCLOCK TSTRING {
+		if (!strcmp($2.v, "realtime")) {
+			dlogenv->config.timestamp_clock = CLOCK_REALTIME;
+		} else if (!strcmp($2.v, "coarse")) {
+#ifdef CLOCK_REALTIME_COARSE
+			dlogenv->config.timestamp_clock = CLOCK_REALTIME_COARSE;
+#else
+			LOG_WARNING("Coarse clock not available, using realtime");
+			dlogenv->config.timestamp_clock = CLOCK_REALTIME;
+#endif
+		} else {
+			yyerror("invalid value for timestamp clock (%s)", $2.v);
+			YYABORT;
+		}
+	}
+	| TTHREADS TSTRING {
+		char* end;
+		long n = strtol($2.v, &end, 10);
+		if (*end || n < 0 || n > DLOG_MAX_THREADS) {
+			yyerror("invalid number of threads (%s)", $2.v);
+			YYABORT;
+		}
+		dlogenv->config.threads = n;
+	}
+	| TWORKERS TSTRING {
+		char* end;
+		long n = strtol($2.v, &end, 10);
+		if (*end || n < 1 || n > DLOG_MAX_WORKERS) {
+			yyerror("invalid number of workers (%s)", $2.v);
+			YYABORT;
+		}
+		dlogenv->config.workers = n;
+	}
 	;
 
 rule_cmd:
@@ -380,6 +605,7 @@ rule_statements:
 rule_statement:
 	match_block
 	| else_block
+	| switch_block
 	| match_cmd ';'
 	;
 
@@ -396,6 +622,7 @@ match_cmd:
 		ADD_NODE(n, NODE_WRITE);
 		n->context.nwrite.string_fmt = writep;
 		n->context.nwrite.dest_sym = dynstr_new($3.v);
+		n->context.nwrite.dest = dest_handle_get($3.v);
 
 	}
 	|
@@ -408,20 +635,20 @@ match_cmd:
 	/* <var (symbol)> = <value (strpartial)> */
 		strpartial* val;
 		struct node* n;
+		int slot;
 		CHECK_SYMBOL($1);
 		CHECK_PARTIAL(val, $3);
 
-		dynstr* vval = dynstr_new($1.v);
-		if (NULL == ht_find(dlogenv->vars_table, (intptr_t)vval)) {
-			yyerror("Unitialised var (%s)", $1.v);\
-			dynstr_free(vval);
-			YYABORT;\
+		if (-1 == (slot = var_slot($1.v))) {
+			yyerror("Unitialised var (%s)", $1.v);
+			strpartial_del(val);
+			YYABORT;
 		}
 
 		ADD_NODE(n, NODE_ASSIGN);
-		n->context.assign.var = vval;
+		n->context.assign.var = dynstr_new($1.v);
+		n->context.assign.slot = slot;
 		n->context.assign.pattern = val;
-		//ht_upsert(dlogenv->vars_table, (uintptr_t)n->context.assign.var, NULL);
 	}
 	;
 
@@ -431,12 +658,15 @@ match_block:
 		LOG_INFO("Action: MATCH <%s> <%s>", $2.v, $3.v);
 
 		strpartial *re, *tgt;
+		struct str_pattern *prog;
 		struct node* n;
 
 		CHECK_PARTIAL(re, $2);
 		CHECK_PARTIAL(tgt, $3);
+		CHECK_PATTERN(prog, re);
 		ADD_NODE_WPARENT(n, NODE_MATCH);
 		n->context.match.re_pattern = re;
+		n->context.match.re_prog = prog;
 		n->context.match.target = tgt;
 		n->context.match.source = NULL;
 	}
@@ -446,13 +676,53 @@ match_block:
 		LOG_INFO("Action: MATCH <%s> <%s> FROM <%s>", $2.v, $3.v, $5.v);
 
 		strpartial *re, *tgt;
+		struct str_pattern *prog;
 		struct node* n;
 
 		CHECK_PARTIAL(re, $2);
 		CHECK_PARTIAL(tgt, $3);
 		CHECK_SYMBOL($5);
+		CHECK_PATTERN(prog, re);
 		ADD_NODE_WPARENT(n, NODE_MATCH);
 		n->context.match.re_pattern = re;
+		n->context.match.re_prog = prog;
+		n->context.match.target = tgt;
+		n->context.match.source = dynstr_new($5.v);
+	}
+	|
+	TREMATCH TSTRING TSTRING block {
+	/* rematch <regex (static)> <target (partial)> */
+		LOG_INFO("Action: REMATCH <%s> <%s>", $2.v, $3.v);
+
+		strpartial *re, *tgt;
+		struct rx *rx;
+		struct node* n;
+
+		CHECK_PARTIAL(re, $2);
+		CHECK_PARTIAL(tgt, $3);
+		CHECK_REGEX(rx, re, tgt, $2);
+		ADD_NODE_WPARENT(n, NODE_MATCH);
+		n->context.match.re_pattern = re;
+		n->context.match.re_rx = rx;
+		n->context.match.target = tgt;
+		n->context.match.source = NULL;
+	}
+	|
+	TREMATCH TSTRING TSTRING TFROM TSTRING block {
+	/* rematch <regex> <target> from <source> */
+		LOG_INFO("Action: REMATCH <%s> <%s> FROM <%s>", $2.v, $3.v, $5.v);
+
+		strpartial *re, *tgt;
+		struct rx *rx;
+		struct node* n;
+
+		CHECK_SYMBOL($5);
+		CHECK_PARTIAL(re, $2);
+		CHECK_PARTIAL(tgt, $3);
+		CHECK_REGEX(rx, re, tgt, $2);
+		ADD_NODE_WPARENT(n, NODE_MATCH);
+		n->context.match.re_pattern = re;
+		n->context.match.re_rx = rx;
 		n->context.match.target = tgt;
 		n->context.match.source = dynstr_new($5.v);
 	}
@@ -469,6 +739,80 @@ match_block:
 	}
 	;
 
+switch_block:
+	TSWITCH TSTRING '{' {
+		/* the cases go in a block of their own, like block does */
+		curnode = calloc(1, sizeof(struct node));
+		curnode->parent = curblock;
+		curblock = curnode;
+	} switch_cases '}' {
+	/* switch <key (partial)> { case <label> {} ... default {} } */
+		LOG_INFO("Action: SWITCH <%s>", $2.v);
+
+		strpartial *key;
+		struct node *n, *c;
+		int ncases = 0;
+		bool has_default = false;
+
+		CHECK_PARTIAL(key, $2);
+		for (c = curblock->child; c; c = c->sibling) {
+			if (c->context.ncase.label)
+				c->context.ncase.index = ncases++;
+			else
+				has_default = true;
+		}
+		ADD_NODE_WPARENT(n, NODE_SWITCH);
+		n->context.nswitch.key = key;
+		n->context.nswitch.ncases = ncases;
+		n->context.nswitch.has_default = has_default;
+	}
+	;
+
+switch_cases:
+	| switch_cases switch_case
+	;
+
+switch_case:
+	TCASE TSTRING block {
+	/* case <label (static string)> */
+		strpartial *label;
+		dynstr *text;
+		struct node *n, *c;
+
+		CHECK_PARTIAL(label, $2);
+		if (!strpartial_isstatic(label, false)) {
+			yyerror("case label not static (%s)", $2.v);
+			strpartial_del(label);
+			YYABORT;
+		}
+		text = strpartial_resolve_ex(label);
+		strpartial_del(label);
+
+		for (c = curblock->parent->child; c; c = c->sibling) {
+			if (c->context.ncase.label &&
+				!strcmp(dynstr_ptr(c->context.ncase.label), dynstr_ptr(text))) {
+				yyerror("duplicate case (%s)", $2.v);
+				dynstr_free(text);
+				YYABORT;
+			}
+		}
+		ADD_NODE_WPARENT(n, NODE_CASE);
+		n->context.ncase.label = text;
+	}
+	|
+	TDEFAULT block {
+		struct node *n, *c;
+
+		for (c = curblock->parent->child; c; c = c->sibling) {
+			if (!c->context.ncase.label) {
+				yyerror("duplicate default");
+				YYABORT;
+			}
+		}
+		ADD_NODE_WPARENT(n, NODE_CASE);
+	}
+	;
+
 else_block:
 	TELSE block {
 		struct node* n;
@@ -504,6 +848,9 @@ static struct keyword
 	{ "logfile", TLOGFILE},
 	{ "datetimeformat", TDATETIMEFORMAT},
 	{ "timestampresolution", TTIMESTAMPRES},
+	{ "timestampclock", TTIMESTAMPCLOCK},
+	{ "threads", TTHREADS},
+	{ "workers", TWORKERS},
 	{ "source", TSOURCE},
 	{ "destination", TDESTINATION},
 	{ "tcp", TTCP},
@@ -512,14 +859,25 @@ static struct keyword
 	{ "maxsize", TMAXSIZE},
 	{ "rotlog", TROTLOG},
 	{ "as", TAS},
+	{ "terminator", TTERMINATOR},
+	{ "thread", TTHREAD},
+	{ "weight", TWEIGHT},
+	{ "priority", TPRIORITY},
+	{ "backpressure", TBACKPRESSURE},
+	{ "buffer", TBUFFER},
+	{ "spill", TSPILL},
 	/* runtime */
 	{ "rule", TRULE},
 	{ "match", TMATCH},
 	{ "matchall", TMATCHALL},
+	{ "rematch", TREMATCH},
 	{ "from", TFROM},
 	{ "else", TELSE},
 	{ "write", TWRITE},
 	{ "break", TBREAK},
+	{ "switch", TSWITCH},
+	{ "case", TCASE},
+	{ "default", TDEFAULT},
 };
 
 int
@@ -683,9 +1041,11 @@ parse_config(void)
 	int res;
 	//yydebug=1;
 
+	dlogenv->config_hash = 14695981039346656037ULL;
 	if ((yyfp = cfgfile_include(dlogenv->config.configfile))) {
 		if (0 == (res = yyparse())) {
 			dlogenv->root_node = rootnode;
+			node_tree_prepare(rootnode);
 		}
 		return res;
 	} else {
@@ -726,6 +1086,48 @@ tstring_is_symbol(const char* s)
 	return 0;
 }
 
+static int
+parse_line_term(const char* s)
+{
+	char* end;
+	long c;
+
+	if (!strcmp(s, "lf"))
+		return LTERM_LF;
+	if (!strcmp(s, "crlf"))
+		return LTERM_CRLF;
+	if (!strcmp(s, "nul"))
+		return LTERM_NUL;
+	if (s[0] && !s[1])
+		return s[0] == '\n' ? LTERM_LF : LTERM_BYTE(s[0]);
+	if (!strncmp(s, "0x", 2)) {
+		c = strtol(s+2, &end, 16);
+		if (s[2] && !*end && c >= 0 && c <= 0xff)
+			return c == 0 ? LTERM_NUL : (c == '\n' ? LTERM_LF : LTERM_BYTE(c));
+	}
+	return -1;
+}
+
+/* bytes, with an optional K, M or G suffix. -1 if invalid */
+static long long
+parse_size(const char* s)
+{
+	char* end;
+	long long n = strtoll(s, &end, 10);
+
+	if (end == s || n < 0)
+		return -1;
+
+	switch (*end) {
+		case '\0':						break;
+		case 'k': case 'K': n <<= 10;	end++; break;
+		case 'm': case 'M': n <<= 20;	end++; break;
+		case 'g': case 'G': n <<= 30;	end++; break;
+		default:						return -1;
+	}
+	return *end ? -1 : n;
+}
+
 static void
 add_origin(struct dorigin* or)
 {
@@ -739,7 +1141,6 @@ add_origin(struct dorigin* or)
 static dynstr
 *strpartial_resolve_ex(const strpartial* part)
 {
-	strpartial* s;
 	dynstr* str = dynstr_new(NULL);
 	while(part) {
 		switch (part->type) {
@@ -748,16 +1149,13 @@ static dynstr
 				break;
 
 			case STR_VAR:
-				if (NULL == (s = ht_find(dlogenv->vars_table, (uintptr_t)part->value.rawstr)))
-					goto fail;
-				else {
-					str = dynstr_cat(str, strpartial_resolve_ex(s));
-				}
+				str = dynstr_cat(str, dlogenv->vars.init[part->slot]);
 				break;
 
 			case STR_ENV:
-				str = dynstr_ccat(str,
-						getenv(dynstr_ptr(part->value.rawstr)));
+				if (getenv(dynstr_ptr(part->value.rawstr)))
+					str = dynstr_ccat(str,
+							getenv(dynstr_ptr(part->value.rawstr)));
 				break;
 
 			default:
@@ -767,35 +1165,98 @@ static dynstr
 		part = part->next;
 	}
 	return str;
-
-fail:
-	dynstr_free(str);
-	return NULL;
 }
 
 static bool strpartial_isstatic(const strpartial* part, bool allow_vars)
 {
-	while(part) {
+	if (!part)
+		return false;
+
+	for (; part; part = part->next) {
 		switch(part->type) {
-			case STR_VAR: {
+			/* declared values are static, but can be reassigned */
+			case STR_VAR:
 				if (!allow_vars)
 					return false;
-
-				strpartial* s;
-				if ((s = ht_find(dlogenv->vars_table,
-									(uintptr_t)part->value.rawstr)))
-					return false;
-				else {
-					return strpartial_isstatic(s, false);
-				}
-			}
-			break;
+				break;
 
 			case STR_VERBATIM:
 			case STR_ENV:
-			return true;
+				break;
+
+			default:
+				return false;
 		}
-		part = part->next;
 	}
-	return false;
+	return true;
+}
+
+static int
+var_slot(const char* sym)
+{
+	for (int i=0; i<dlogenv->vars.nb; i++) {
+		if (!strcmp(dlogenv->vars.names[i], sym))
+			return i;
+	}
+	return -1;
+}
+
+/* a declared var gets the next slot, declaring it again replaces its value */
+static void
+add_var(const char* sym, dynstr* val)
+{
+	int slot = var_slot(sym);
+
+	if (slot == -1) {
+		slot = dlogenv->vars.nb++;
+		dlogenv->vars.names = realloc(dlogenv->vars.names, dlogenv->vars.nb * sizeof(char*));
+		dlogenv->vars.init = realloc(dlogenv->vars.init, dlogenv->vars.nb * sizeof(dynstr*));
+		dlogenv->vars.names[slot] = strdup(sym);
+	} else {
+		dynstr_free(dlogenv->vars.init[slot]);
+	}
+	dlogenv->vars.init[slot] = val;
+}
+
+/* vars have to be declared before they are used */
+static bool
+bind_vars(strpartial* part)
+{
+	for (; part; part = part->next) {
+		if (part->type != STR_VAR)
+			continue;
+		if (-1 == (part->slot = var_slot(dynstr_ptr(part->value.rawstr)))) {
+			yyerror("Unknown var (%s)", dynstr_ptr(part->value.rawstr));
+			return false;
+		}
+	}
+	return true;
+}
+
+static struct str_pattern*
+compile_static_pattern(const strpartial* re)
+{
+	struct str_pattern* prog = NULL;
+	const char* err = NULL;
+	dynstr* text = strpartial_resolve_ex(re);
+
+	if (text && !(prog = str_pattern_compile(dynstr_ptr(text), &err))) {
+		yyerror("invalid pattern (%s): %s", dynstr_ptr(text), err ? err : "");
+	}
+	dynstr_free(text);
+	return prog;
+}
+
+static struct rx*
+compile_regex(const strpartial* re)
+{
+	struct rx* rx = NULL;
+	const char* err = NULL;
+	dynstr* text = strpartial_resolve_ex(re);
+
+	if (text && !(rx = rx_compile(dynstr_ptr(text), &err))) {
+		yyerror("invalid regex (%s): %s", dynstr_ptr(text), err);
+	}
+	dynstr_free(text);
+	return rx;
 }
@@ -46,7 +46,32 @@
 #define L_ESC		'%'
 #define SPECIALS	"^$*+?.([%-"
 
+/*
+ * Compiled pattern: the class items are parsed once, every offset in
+ * 'pat' where a single char class starts gets its end offset and a
+ * 256 bit membership set, so matching never re-parses the pattern.
+ */
+struct pattern_class {
+	unsigned short	 end;		/* offset of the class end */
+	unsigned char	 set[32];	/* one bit per char */
+};
+
+struct str_pattern {
+	char		*pat;		/* pattern text, without the anchor */
+	size_t		 len;
+	int		 anchor;
+	int		 plain;		/* no specials, plain substring search */
+	char		*prefix;	/* literal every match starts with */
+	size_t		 prefix_len;
+	char		*literal;	/* longest literal every match contains */
+	size_t		 literal_len;
+	int		 ncaptures;
+	struct pattern_class *cls;	/* indexed by offset into 'pat' */
+};
+
 struct match_state {
+	const struct str_pattern *prog;	/* NULL for plain text patterns */
+	const char *p_init;	/* init of pattern */
 	int matchdepth;		/* control for recursive depth (to avoid C
 				 * stack overflow) */
 	int repetitioncounter;	/* control the repetition items */
@@ -187,6 +212,17 @@ matchbracketclass(int c, const char *p, const char *ec)
 	return !sig;
 }
 
+#define PCLASS(ms, p)	(&(ms)->prog->cls[(p) - (ms)->p_init])
+#define PCLASS_ISSET(pc, c) ((pc)->set[(c) >> 3] & (1 << ((c) & 7)))
+
+static const char *
+patternclassend(struct match_state *ms, const char *p)
+{
+	if (ms->prog)
+		return ms->p_init + PCLASS(ms, p)->end;
+	return classend(ms, p);
+}
+
 static int
 singlematch(struct match_state *ms, const char *s, const char *p,
     const char *ep)
@@ -195,6 +231,8 @@ singlematch(struct match_state *ms, const char *s, const char *p,
 		return 0;
 	else {
 		int c = uchar(*s);
+		if (ms->prog)
+			return PCLASS_ISSET(PCLASS(ms, p), c) != 0;
 		switch (*p) {
 		case '.':
 			/* matches any char */
@@ -321,7 +359,7 @@ static const char *
 match(struct match_state *ms, const char *s, const char *p)
 {
 	const char *ep, *res;
-	char previous;
+	char previous, current;
 
 	if (ms->matchdepth-- == 0) {
 		match_error(ms, "pattern too complex");
@@ -375,15 +413,21 @@ match(struct match_state *ms, const char *s, const char *p)
 					break;
 				}
 				/* points to what is next */
-				ep = classend(ms, p);
+				ep = patternclassend(ms, p);
 				if (ms->error != NULL)
 					break;
 				previous =
 				    (s == ms->src_init) ? '\0' : *(s - 1);
-				if (!matchbracketclass(uchar(previous),
+				/* the subject may not be NUL terminated */
+				current =
+				    (s == ms->src_end) ? '\0' : *s;
+				if (ms->prog ?
+				    (!PCLASS_ISSET(PCLASS(ms, p), uchar(previous)) &&
+				    PCLASS_ISSET(PCLASS(ms, p), uchar(current))) :
+				    (!matchbracketclass(uchar(previous),
 				    p, ep - 1) &&
-				    matchbracketclass(uchar(*s),
-				    p, ep - 1)) {
+				    matchbracketclass(uchar(current),
+				    p, ep - 1))) {
 					p = ep;
 					/* return match(ms, s, ep); */
 					goto init;
@@ -418,7 +462,7 @@ match(struct match_state *ms, const char *s, const char *p)
 			/* pattern class plus optional suffix */
 	dflt:
 			/* points to optional suffix */
-			ep = classend(ms, p);
+			ep = patternclassend(ms, p);
 			if (ms->error != NULL)
 				break;
 
@@ -638,6 +682,323 @@ str_find_aux(struct match_state *ms, const char *pattern, const char *string,
 	return 0;
 }
 
+static int
+str_find_pattern_aux(struct match_state *ms, const struct str_pattern *prog,
+    const char *string, size_t ls, struct str_find *sm, size_t nsm)
+{
+	const char	*s = string;
+	const char	*s1 = s;
+	int		 i;
+
+	if (prog->plain) {
+		/* do a plain search */
+		s1 = lmemfind(s, ls, prog->pat, prog->len);
+		if (s1 != NULL) {
+			i = 0;
+			sm[i].sm_so = 0;
+			sm[i].sm_eo = ls;
+			if (nsm > 1) {
+				i++;
+				sm[i].sm_so = s1 - s;
+				sm[i].sm_eo = (s1 - s) + prog->len;
+			}
+			return (i + 1);
+		}
+		return (0);
+	}
+
+	ms->prog = prog;
+	ms->p_init = prog->pat;
+	ms->maxcaptures = (nsm > MAXCAPTURES ? MAXCAPTURES : nsm) - 1;
+	ms->matchdepth = MAXCCALLS;
+	ms->repetitioncounter = MAXREPETITION;
+	ms->src_init = s;
+	ms->src_end = s + ls;
+	ms->p_end = prog->pat + prog->len;
+	do {
+		const char *res;
+		if (prog->prefix_len && !prog->anchor) {
+			/* skip to the next place a match can start */
+			s1 = lmemfind(s1, ms->src_end - s1,
+			    prog->prefix, prog->prefix_len);
+			if (s1 == NULL)
+				break;
+		} else if (prog->prefix_len && ((size_t)(ms->src_end - s1) <
+		    prog->prefix_len || memcmp(s1, prog->prefix,
+		    prog->prefix_len) != 0))
+			break;
+		ms->level = 0;
+		if ((res = match(ms, s1, prog->pat)) != NULL) {
+			sm->sm_so = 0;
+			sm->sm_eo = ls;
+			return push_captures(ms, s1, res, sm + 1, nsm - 1) + 1;
+
+		} else if (ms->error != NULL) {
+			return 0;
+		}
+	} while (s1++ < ms->src_end && !prog->anchor);
+
+	return 0;
+}
+
+/* fill the membership set of the class starting at 'p' */
+static void
+pattern_class_set(struct match_state *ms, const char *p, const char *ep,
+    struct pattern_class *pc)
+{
+	int c, in;
+
+	pc->end = (unsigned short)(ep - ms->p_init);
+	for (c = 0; c < 256; c++) {
+		switch (*p) {
+		case '.':
+			in = 1;
+			break;
+		case L_ESC:
+			in = match_class(c, uchar(*(p + 1)));
+			break;
+		case '[':
+			in = matchbracketclass(c, p, ep - 1);
+			break;
+		default:
+			in = (uchar(*p) == c);
+		}
+		if (in)
+			pc->set[c >> 3] |= 1 << (c & 7);
+	}
+}
+
+/* literal chars every match has to start with */
+static void
+pattern_prefix(struct str_pattern *prog)
+{
+	const char	*p = prog->pat, *end = prog->pat + prog->len, *next;
+	char		 lit;
+
+	prog->prefix = calloc(1, prog->len + 1);
+	while (p < end) {
+		if (*p == L_ESC) {
+			if (p + 1 >= end || isalnum(uchar(*(p + 1))))
+				break;
+			lit = *(p + 1);
+			next = p + 2;
+		} else if (strchr(SPECIALS ")", *p)) {
+			break;
+		} else {
+			lit = *p;
+			next = p + 1;
+		}
+		if (next < end && strchr("*?-", *next))
+			break;
+		prog->prefix[prog->prefix_len++] = lit;
+		if (next < end && *next == '+')
+			break;
+		p = next;
+	}
+}
+
+/* close the current run of mandatory literal chars */
+static void
+pattern_literal_end(struct str_pattern *prog, const char *run, size_t *runlen)
+{
+	if (*runlen > prog->literal_len) {
+		memcpy(prog->literal, run, *runlen);
+		prog->literal_len = *runlen;
+	}
+	*runlen = 0;
+}
+
+struct str_pattern *
+str_pattern_compile(const char *pattern, const char **errstr)
+{
+	struct str_pattern	*prog;
+	struct match_state	 ms;
+	const char		*p, *ep, *end;
+	char			*run = NULL;
+	size_t			 runlen = 0;
+	int			 lit;
+
+	if ((prog = calloc(1, sizeof(*prog))) == NULL) {
+		*errstr = strerror(errno);
+		return (NULL);
+	}
+	prog->len = strlen(pattern);
+	prog->plain = nospecials(pattern, prog->len);
+	prog->anchor = (*pattern == '^');
+	if (prog->anchor) {
+		/* skip anchor character */
+		pattern++;
+		prog->len--;
+	}
+	prog->pat = strdup(pattern);
+	prog->cls = calloc(prog->len + 1, sizeof(struct pattern_class));
+	prog->literal = calloc(1, prog->len + 1);
+	run = calloc(1, prog->len + 1);
+	if (prog->pat == NULL || prog->cls == NULL || prog->literal == NULL ||
+	    run == NULL) {
+		*errstr = strerror(errno);
+		goto fail;
+	}
+
+	memset(&ms, 0, sizeof(ms));
+	ms.p_init = prog->pat;
+	ms.p_end = end = prog->pat + prog->len;
+
+	/* walk the pattern the same way match() does */
+	for (p = prog->pat; p < end && ms.error == NULL && !prog->plain; ) {
+		switch (*p) {
+		case '(':
+			prog->ncaptures++;
+			p += (*(p + 1) == ')') ? 2 : 1;
+			continue;
+		case ')':
+			p++;
+			continue;
+		case '$':
+			if (p + 1 == end) {
+				p++;
+				continue;
+			}
+			break;
+		case L_ESC:
+			switch (*(p + 1)) {
+			case 'b':
+				pattern_literal_end(prog, run, &runlen);
+				if (p + 2 >= end - 1)
+					match_error(&ms, "malformed pattern "
+					    "(missing arguments to '%b')");
+				p += 4;
+				continue;
+			case 'f':
+				pattern_literal_end(prog, run, &runlen);
+				p += 2;
+				if (*p != '[') {
+					match_error(&ms, "missing '['"
+					    " after '%f' in pattern");
+					continue;
+				}
+				ep = classend(&ms, p);
+				if (ms.error == NULL)
+					pattern_class_set(&ms, p, ep,
+					    &prog->cls[p - prog->pat]);
+				p = ep;
+				continue;
+			case '0': case '1': case '2': case '3': case '4':
+			case '5': case '6': case '7': case '8': case '9':
+				pattern_literal_end(prog, run, &runlen);
+				p += 2;
+				continue;
+			}
+			break;
+		}
+
+		/* single char class plus optional suffix */
+		ep = classend(&ms, p);
+		if (ms.error != NULL)
+			break;
+		pattern_class_set(&ms, p, ep, &prog->cls[p - prog->pat]);
+
+		/* without alternation, every non optional literal is required */
+		if (*p == L_ESC)
+			lit = isalnum(uchar(*(p + 1))) ? -1 : uchar(*(p + 1));
+		else
+			lit = strchr(".[", *p) ? -1 : uchar(*p);
+		if (lit < 0 || (ep < end && strchr("*?-", *ep))) {
+			pattern_literal_end(prog, run, &runlen);
+		} else {
+			run[runlen++] = (char)lit;
+			if (ep < end && *ep == '+')
+				pattern_literal_end(prog, run, &runlen);
+		}
+
+		p = (ep < end && strchr("*+?-", *ep)) ? ep + 1 : ep;
+	}
+	pattern_literal_end(prog, run, &runlen);
+	free(run);
+	run = NULL;
+
+	if (ms.error != NULL) {
+		*errstr = ms.error;
+		goto fail;
+	}
+	if (prog->ncaptures >= MAXCAPTURES) {
+		*errstr = "too many captures";
+		goto fail;
+	}
+	if (!prog->plain) {
+		pattern_prefix(prog);
+	} else {
+		memcpy(prog->literal, prog->pat, prog->len);
+		prog->literal_len = prog->len;
+	}
+
+	*errstr = NULL;
+	return (prog);
+
+fail:
+	free(run);
+	str_pattern_free(prog);
+	return (NULL);
+}
+
+void
+str_pattern_free(struct str_pattern *prog)
+{
+	if (prog == NULL)
+		return;
+	free(prog->pat);
+	free(prog->prefix);
+	free(prog->literal);
+	free(prog->cls);
+	free(prog);
+}
+
+int
+str_pattern_ncaptures(const struct str_pattern *prog)
+{
+	return (prog->ncaptures);
+}
+
+const char *
+str_pattern_literal(const struct str_pattern *prog, size_t *len)
+{
+	*len = prog->literal_len;
+	return (prog->literal);
+}
+
+/*
+ * Text of a pattern made only of literal characters (escaped or not),
+ * NULL if it has any other item. '*anchor' tells if it has to start
+ * the subject.
+ */
+const char *
+str_pattern_plain(const struct str_pattern *prog, size_t *len, int *anchor)
+{
+	size_t	 i, n = 0;
+
+	*anchor = prog->anchor;
+	if (prog->plain) {
+		*len = prog->len;
+		return (prog->pat);
+	}
+
+	for (i = 0; i < prog->len; i++, n++) {
+		if (prog->pat[i] == L_ESC) {
+			if (i + 1 == prog->len ||
+			    isalnum((unsigned char)prog->pat[i + 1]))
+				return (NULL);
+			i++;
+		} else if (strchr(SPECIALS, prog->pat[i]))
+			return (NULL);
+	}
+
+	/* the literal and prefix are unescaped already */
+	*len = n;
+	if (prog->anchor)
+		return (n == prog->prefix_len ? prog->prefix : NULL);
+	return (n == prog->literal_len ? prog->literal : NULL);
+}
+
 int
 str_find(const char *string, const char *pattern, struct str_find *sm,
     size_t nsm, const char **errstr)
@@ -659,56 +1020,68 @@ str_find(const char *string, const char *pattern, struct str_find *sm,
 	return (ret);
 }
 
-int
-str_match(const char *string, const char *pattern, struct str_match *m,
-    const char **errstr)
+/*
+ * Captures are returned as spans into 'string', which has to outlive
+ * the match result. Nothing is allocated.
+ */
+static int
+str_match_aux(const char *string, size_t len, const char *pattern,
+    const struct str_pattern *prog, struct str_match *m, const char **errstr)
 {
-	struct str_find		 sm[MAXCAPTURES];
 	struct match_state	 ms;
 	int			 ret, i;
-	size_t			 len, nsm;
 
-	nsm = MAXCAPTURES;
 	memset(&ms, 0, sizeof(ms));
-	memset(sm, 0, sizeof(sm));
-	memset(m, 0, sizeof(*m));
+	m->sm_str = string;
+	m->sm_nmatch = 0;
 
-	ret = str_find_aux(&ms, pattern, string, sm, nsm, 0);
+	if (prog)
+		ret = str_find_pattern_aux(&ms, prog, string, len, m->sm_find,
+		    MAXCAPTURES);
+	else
+		ret = str_find_aux(&ms, pattern, string, m->sm_find,
+		    MAXCAPTURES, 0);
 	if (ret <= 0 || ms.error != NULL) {
 		/* Return -1 on error and store the error string */
 		*errstr = ms.error;
 		return (-1);
 	}
 
-	if ((m->sm_match = calloc(ret, sizeof(char *))) == NULL) {
-		*errstr = strerror(errno);
-		return (-1);
-	}
-	m->sm_nmatch = ret;
-
 	for (i = 0; i < ret; i++) {
-		if (sm[i].sm_so > sm[i].sm_eo)
-			continue;
-		len = sm[i].sm_eo - sm[i].sm_so;
-		if ((m->sm_match[i] = strndup(string +
-		    sm[i].sm_so, len)) == NULL) {
-			*errstr = strerror(errno);
-			str_match_free(m);
-			return (-1);
-		}
+		if (m->sm_find[i].sm_so > m->sm_find[i].sm_eo)
+			m->sm_find[i].sm_eo = m->sm_find[i].sm_so;
 	}
+	m->sm_nmatch = ret;
 
 	*errstr = NULL;
 	return (0);
 }
 
+int
+str_match(const char *string, const char *pattern, struct str_match *m,
+    const char **errstr)
+{
+	return str_match_aux(string, 0, pattern, NULL, m, errstr);
+}
+
+int
+str_match_pattern(const char *string, const struct str_pattern *prog,
+    struct str_match *m, const char **errstr)
+{
+	return str_match_aux(string, strlen(string), NULL, prog, m, errstr);
+}
+
+/* 'string' is 'len' bytes, it doesn't need to be NUL terminated */
+int
+str_match_pattern_len(const char *string, size_t len,
+    const struct str_pattern *prog, struct str_match *m, const char **errstr)
+{
+	return str_match_aux(string, len, NULL, prog, m, errstr);
+}
+
 void
 str_match_free(struct str_match *m)
 {
-	unsigned int	 i = 0;
-	for (i = 0; i < m->sm_nmatch; i++)
-		free(m->sm_match[i]);
-	free(m->sm_match);
-	m->sm_match = NULL;
+	m->sm_str = NULL;
 	m->sm_nmatch = 0;
 }
@@ -31,16 +31,35 @@ struct str_find {
 };
 
 struct str_match {
-	char		**sm_match; /* allocated array of matched strings */
-	unsigned int	 sm_nmatch; /* number of elements in array */
+	const char	*sm_str;	/* matched string, spans point into it */
+	struct str_find	 sm_find[MAXCAPTURES]; /* whole string, then captures */
+	unsigned int	 sm_nmatch;	/* number of elements in sm_find */
 };
 
+#define STR_MATCH_PTR(m, i)	((m)->sm_str + (m)->sm_find[(i)].sm_so)
+#define STR_MATCH_LEN(m, i)	((int)((m)->sm_find[(i)].sm_eo - (m)->sm_find[(i)].sm_so))
+
+/* pattern compiled once, see str_pattern_compile() */
+struct str_pattern;
+
 __BEGIN_DECLS
 int	 str_find(const char *, const char *, struct str_find *, size_t,
 	    const char **);
 int	 str_match(const char *, const char *, struct str_match *,
 	    const char **);
 void	 str_match_free(struct str_match *);
+struct str_pattern *
+	 str_pattern_compile(const char *, const char **);
+void	 str_pattern_free(struct str_pattern *);
+int	 str_pattern_ncaptures(const struct str_pattern *);
+const char *
+	 str_pattern_literal(const struct str_pattern *, size_t *);
+const char *
+	 str_pattern_plain(const struct str_pattern *, size_t *, int *);
+int	 str_match_pattern(const char *, const struct str_pattern *,
+	    struct str_match *, const char **);
+int	 str_match_pattern_len(const char *, size_t,
+	    const struct str_pattern *, struct str_match *, const char **);
 __END_DECLS
 
 #endif /* PATTERNS_H */
@@ -0,0 +1,328 @@
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pool.h"
+#include "coredesc.h"
+#include "evt.h"
+#include "env.h"
+#include "log.h"
+
+struct pool_write
+{
+	struct dest_handle	*dest;
+	dynstr				*line;
+};
+
+/* a batch of lines from one descriptor, then what the rules wrote */
+struct job
+{
+	char				*buf;		/* text of the lines */
+	size_t				 buf_cap;
+	strview				*lines;
+	int					 nlines;
+	int					 lines_cap;
+	dynstr				*source;	/* copy, the descriptor may close meanwhile */
+	int					 source_id;
+
+	struct pool_write	*out;
+	int					 nout;
+	int					 out_cap;
+};
+
+/*
+ * jobs go round the ring: the event loop fills them up to 'head', the
+ * worker evaluates them up to 'done', and the event loop delivers the
+ * writes up to 'tail'. each index has a single writer
+ */
+struct worker
+{
+	pthread_t			 thread;
+	struct job			 ring[DLOG_POOL_QUEUE];
+	unsigned			 head;
+	unsigned			 done;
+	unsigned			 tail;
+
+	/* only to sleep while there's nothing to do */
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;
+	bool				 stop;
+};
+
+static struct worker	*_workers;
+static int				 _nworkers;
+static write_line_cb	 _wcb;
+
+/* workers -> event loop, a byte is written unless one is pending */
+static int				 _wake[2] = { -1, -1 };
+static int				 _wake_pending;
+static descriptor		*_wake_d;
+static struct dorigin	 _wake_or =
+{
+	.type = D_TYPEINVALID,
+	.symbol = "#POOL_WAKEUP",
+	.inherited.fd = -1,
+	.next = NULL
+};
+
+/* job the calling worker is evaluating */
+static __thread struct job* _cur;
+
+static void
+_collect(struct dest_handle* dest, dynstr* line)
+{
+	struct job* job = _cur;
+
+	if (job->nout == job->out_cap) {
+		job->out_cap = job->out_cap ? job->out_cap * 2 : 64;
+		job->out = realloc(job->out, job->out_cap * sizeof(struct pool_write));
+	}
+	job->out[job->nout].dest = dest;
+	job->out[job->nout++].line = line;
+}
+
+static void
+_wakeup(void)
+{
+	char c = 0;
+
+	if (!__atomic_exchange_n(&_wake_pending, 1, __ATOMIC_ACQ_REL))
+		UNUSED(write(_wake[1], &c, 1));
+}
+
+static void*
+_worker_main(void* arg)
+{
+	struct worker* w = arg;
+	/* dynstrs come from the heap here, the state is allocated by
+	 * the thread using it */
+	struct node_state* st = node_state_new();
+	unsigned done = w->done;
+	struct job* job;
+	bool stop;
+
+	while (1) {
+		if (done == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) {
+			pthread_mutex_lock(&w->lock);
+			while (done == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) && !w->stop)
+				pthread_cond_wait(&w->cond, &w->lock);
+			stop = w->stop;
+			pthread_mutex_unlock(&w->lock);
+
+			if (stop && done == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE))
+				break;
+			continue;
+		}
+
+		job = _cur = &w->ring[done % DLOG_POOL_QUEUE];
+		node_eval_batch(st, dlogenv->root_node, job->lines, job->nlines,
+						job->source, job->source_id, _collect);
+
+		__atomic_store_n(&w->done, ++done, __ATOMIC_RELEASE);
+		_wakeup();
+	}
+
+	node_state_free(st);
+	return NULL;
+}
+
+/* the same descriptor always goes to the same worker */
+static struct worker*
+_shard(const descriptor* d)
+{
+	uint64_t h = (uintptr_t)d * 0x9e3779b97f4a7c15ULL;
+
+	return &_workers[(h >> 32) % _nworkers];
+}
+
+int
+pool_start(int nthreads, write_line_cb wcb)
+{
+	sigset_t all, old;
+	int i;
+
+	if (-1 == pipe(_wake)) {
+		LOG_SYS_ERROR("Failed to create worker wakeup pipe");
+		return -1;
+	}
+	fcntl(_wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(_wake[1], F_SETFL, O_NONBLOCK);
+
+	_wake_d = calloc(1, sizeof(descriptor));
+	_wake_d->fd = _wake[0];
+	_wake_d->origin = &_wake_or;
+	_wake_d->state = DSTATE_ACTIVE;
+	if (-1 == evt_reg_read(_wake_d)) {
+		pool_stop();
+		return -1;
+	}
+
+	_wcb = wcb;
+	_workers = calloc(nthreads, sizeof(struct worker));
+
+	/* signals are for the event loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (i=0; i<nthreads; i++) {
+		struct worker* w = &_workers[i];
+
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		if (0 != pthread_create(&w->thread, NULL, _worker_main, w)) {
+			LOG_ERROR("Failed to start worker thread %d", i);
+			pthread_mutex_destroy(&w->lock);
+			pthread_cond_destroy(&w->cond);
+			break;
+		}
+		_nworkers++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (i < nthreads) {
+		pool_stop();
+		return -1;
+	}
+
+	LOG_INFO("Rules evaluated by %d worker threads", nthreads);
+	return 0;
+}
+
+void
+pool_stop(void)
+{
+	pool_flush();
+
+	for (int i=0; i<_nworkers; i++) {
+		struct worker* w = &_workers[i];
+
+		pthread_mutex_lock(&w->lock);
+		w->stop = true;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+
+		pthread_join(w->thread, NULL);
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->cond);
+
+		for (int j=0; j<DLOG_POOL_QUEUE; j++) {
+			free(w->ring[j].buf);
+			free(w->ring[j].lines);
+			free(w->ring[j].out);
+		}
+	}
+	free(_workers);
+	_workers = NULL;
+	_nworkers = 0;
+
+	/* closing removes it from the event system */
+	for (int i=0; i<2; i++) {
+		if (_wake[i] != -1)
+			close(_wake[i]);
+		_wake[i] = -1;
+	}
+	free(_wake_d);
+	_wake_d = NULL;
+}
+
+bool
+pool_active(void)
+{
+	return _nworkers > 0;
+}
+
+void
+pool_submit(descriptor* d, const strview* lines, int nlines)
+{
+	struct worker* w = _shard(d);
+	struct pollfd pfd = { .fd = _wake[0], .events = POLLIN };
+	struct job* job;
+	size_t size = 0;
+	char* p;
+
+	/* a wakeup is due once the worker is done with a job */
+	while (w->head - w->tail == DLOG_POOL_QUEUE) {
+		poll(&pfd, 1, DLOG_EVENTLOOP_TIMEOUT);
+		pool_deliver();
+	}
+
+	job = &w->ring[w->head % DLOG_POOL_QUEUE];
+
+	for (int i=0; i<nlines; i++)
+		size += lines[i].len;
+	if (size > job->buf_cap) {
+		job->buf_cap = size;
+		job->buf = realloc(job->buf, size);
+	}
+	if (nlines > job->lines_cap) {
+		job->lines_cap = nlines;
+		job->lines = realloc(job->lines, nlines * sizeof(strview));
+	}
+
+	/* the reader's buffer is compacted right after */
+	p = job->buf;
+	for (int i=0; i<nlines; i++) {
+		memcpy(p, lines[i].ptr, lines[i].len);
+		job->lines[i].ptr = p;
+		job->lines[i].len = lines[i].len;
+		p += lines[i].len;
+	}
+	job->nlines = nlines;
+	job->source = dynstr_copy(d->symbol);
+	job->source_id = d->source_id;
+
+	__atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+void
+pool_deliver(void)
+{
+	char buf[64];
+
+	/* cleared first, a job done from here on wakes the loop again */
+	__atomic_store_n(&_wake_pending, 0, __ATOMIC_RELEASE);
+	while (read(_wake[0], buf, sizeof(buf)) > 0);
+
+	for (int i=0; i<_nworkers; i++) {
+		struct worker* w = &_workers[i];
+		unsigned done = __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+
+		for (; w->tail != done; w->tail++) {
+			struct job* job = &w->ring[w->tail % DLOG_POOL_QUEUE];
+
+			for (int j=0; j<job->nout; j++)
+				_wcb(job->out[j].dest, job->out[j].line);
+			job->nout = 0;
+			dynstr_free(job->source);
+			job->source = NULL;
+		}
+	}
+}
+
+void
+pool_flush(void)
+{
+	struct pollfd pfd = { .fd = _wake[0], .events = POLLIN };
+
+	for (int i=0; i<_nworkers; i++) {
+		struct worker* w = &_workers[i];
+
+		while (w->tail != w->head) {
+			poll(&pfd, 1, DLOG_EVENTLOOP_TIMEOUT);
+			pool_deliver();
+		}
+	}
+}
+
+bool
+pool_is_wakeup(const descriptor* d)
+{
+	return d && d == _wake_d;
+}
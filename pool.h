@@ -0,0 +1,32 @@
+#ifndef DLOG_POOL_H__
+#define DLOG_POOL_H__
+#include "def.h"
+#include "dynstr.h"
+#include "node.h"
+
+struct descriptor;
+
+/*
+ * Rules evaluated on worker threads. The event loop hands batches of
+ * lines over, the lines of a descriptor always go to the same worker
+ * so their order is kept, and the writes come back to the event loop
+ * which passes them on to 'wcb'.
+ */
+int		pool_start(int nthreads, write_line_cb wcb);
+void	pool_stop(void);
+bool	pool_active(void);
+
+/* queue the lines for evaluation, they are copied. waits for the
+ * worker if its queue is full */
+void	pool_submit(struct descriptor* d, const strview* lines, int nlines);
+
+/* pass on the writes of the evaluated batches */
+void	pool_deliver(void);
+
+/* wait until everything submitted was delivered */
+void	pool_flush(void);
+
+/* the event loop is woken up through this descriptor */
+bool	pool_is_wakeup(const struct descriptor* d);
+
+#endif
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <string.h>
+#include "prefilter.h"
+#include "log.h"
+
+/*
+ * The automaton is built as a full DFA (failure links folded into the
+ * transitions) over a reduced alphabet: every byte used by a literal
+ * has its own class, all other bytes share class 0.
+ */
+struct prefilter
+{
+	char	**lits;
+	size_t	 *lens;
+	int		  nlits;
+
+	unsigned char cmap[256];
+	int		  ncls;
+	int		  nstates;
+	int		 *delta;	/* nstates * ncls */
+	int		 *out;		/* literal id ending in the state, or 0 */
+	int		 *dict;		/* next state on the suffix chain with output */
+};
+
+prefilter*
+prefilter_new(void)
+{
+	return calloc(1, sizeof(prefilter));
+}
+
+void
+prefilter_free(prefilter* pf)
+{
+	if (!pf)
+		return;
+	for (int i=0; i<pf->nlits; i++)
+		free(pf->lits[i]);
+	free(pf->lits);
+	free(pf->lens);
+	free(pf->delta);
+	free(pf->out);
+	free(pf->dict);
+	free(pf);
+}
+
+int
+prefilter_add(prefilter* pf, const char* lit, size_t len)
+{
+	for (int i=0; i<pf->nlits; i++) {
+		if (pf->lens[i] == len && !memcmp(pf->lits[i], lit, len))
+			return i+1;
+	}
+
+	pf->lits = realloc(pf->lits, (pf->nlits+1) * sizeof(char*));
+	pf->lens = realloc(pf->lens, (pf->nlits+1) * sizeof(size_t));
+	pf->lits[pf->nlits] = malloc(len);
+	memcpy(pf->lits[pf->nlits], lit, len);
+	pf->lens[pf->nlits] = len;
+	return ++pf->nlits;
+}
+
+int
+prefilter_count(const prefilter* pf)
+{
+	return pf->nlits;
+}
+
+int
+prefilter_build(prefilter* pf)
+{
+	int maxstates = 1, *queue, qh = 0, qt = 0;
+
+	/* alphabet */
+	memset(pf->cmap, 0, sizeof(pf->cmap));
+	pf->ncls = 1;
+	for (int i=0; i<pf->nlits; i++) {
+		for (size_t j=0; j<pf->lens[i]; j++) {
+			unsigned char c = (unsigned char)pf->lits[i][j];
+			if (!pf->cmap[c])
+				pf->cmap[c] = pf->ncls++;
+		}
+		maxstates += pf->lens[i];
+	}
+
+	pf->delta = malloc(maxstates * pf->ncls * sizeof(int));
+	pf->out = calloc(maxstates, sizeof(int));
+	pf->dict = calloc(maxstates, sizeof(int));
+	queue = malloc(maxstates * sizeof(int));
+	if (!pf->delta || !pf->out || !pf->dict || !queue) {
+		free(queue);
+		return -1;
+	}
+	memset(pf->delta, -1, maxstates * pf->ncls * sizeof(int));
+
+	/* trie */
+	pf->nstates = 1;
+	for (int i=0; i<pf->nlits; i++) {
+		int s = 0;
+		for (size_t j=0; j<pf->lens[i]; j++) {
+			int* t = &pf->delta[s * pf->ncls + pf->cmap[(unsigned char)pf->lits[i][j]]];
+			if (*t < 0)
+				*t = pf->nstates++;
+			s = *t;
+		}
+		pf->out[s] = i+1;
+	}
+
+	/* failure links, breadth first; 'fail' reuses the dict array */
+	int* fail = calloc(pf->nstates, sizeof(int));
+	for (int c=0; c<pf->ncls; c++) {
+		int t = pf->delta[c];
+		if (t < 0) {
+			pf->delta[c] = 0;
+		} else {
+			fail[t] = 0;
+			queue[qt++] = t;
+		}
+	}
+
+	while (qh < qt) {
+		int s = queue[qh++];
+
+		/* nearest proper suffix state that has an output */
+		pf->dict[s] = pf->out[fail[s]] ? fail[s] : pf->dict[fail[s]];
+
+		for (int c=0; c<pf->ncls; c++) {
+			int* t = &pf->delta[s * pf->ncls + c];
+			if (*t < 0) {
+				*t = pf->delta[fail[s] * pf->ncls + c];
+			} else {
+				fail[*t] = pf->delta[fail[s] * pf->ncls + c];
+				queue[qt++] = *t;
+			}
+		}
+	}
+
+	free(fail);
+	free(queue);
+	LOG_DEBUG("Prefilter built, %d literals, %d states, %d classes",
+			  pf->nlits, pf->nstates, pf->ncls);
+	return 0;
+}
+
+void
+prefilter_scan(const prefilter* pf, const char* s, size_t len, uint64_t* hits)
+{
+	const unsigned char* p = (const unsigned char*)s;
+	const unsigned char* end = p + len;
+	int st = 0, t;
+
+	memset(hits, 0, PREFILTER_WORDS(pf->nlits) * sizeof(uint64_t));
+
+	while (p < end) {
+		st = pf->delta[st * pf->ncls + pf->cmap[*p++]];
+
+		for (t = pf->out[st] ? st : pf->dict[st]; t; t = pf->dict[t])
+			hits[pf->out[t] >> 6] |= 1ULL << (pf->out[t] & 63);
+	}
+}
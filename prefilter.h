@@ -0,0 +1,25 @@
+#ifndef DLOG_PREFILTER_H__
+#define DLOG_PREFILTER_H__
+#include "def.h"
+
+/*
+ * Aho-Corasick automaton over a set of literals. A single pass over a
+ * line tells which of the literals occur in it.
+ */
+typedef struct prefilter prefilter;
+
+prefilter*	prefilter_new(void);
+void		prefilter_free(prefilter*);
+
+/* add a literal (deduplicated), returns its id, ids start at 1 */
+int			prefilter_add(prefilter*, const char* lit, size_t len);
+int			prefilter_count(const prefilter*);
+int			prefilter_build(prefilter*);
+
+/* 'hits' holds a bit per literal id, see PREFILTER_WORDS */
+void		prefilter_scan(const prefilter*, const char* s, size_t len, uint64_t* hits);
+
+#define PREFILTER_WORDS(n)			(((n) + 64) / 64)
+#define PREFILTER_HIT(hits, id)		((hits)[(id) >> 6] & (1ULL << ((id) & 63)))
+
+#endif
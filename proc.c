@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "log.h"
 #include "proc.h"
@@ -11,6 +12,10 @@
 
 static void _sig_handler(int signo, siginfo_t* si, void* uctx);
 
+/* of the workers forked, primary only */
+static pid_t _workers[DLOG_MAX_WORKERS];
+static int _nworkers;
+
 struct sig_s signals[] =
 {
 	{ dlog_signal(DLOG_SIG_RESTART),
@@ -25,6 +30,10 @@ struct sig_s signals[] =
 		"SIG" dlog_value(SIG_SHUTDOWN),
 		0,
 		_sig_handler },
+	{ dlog_signal(DLOG_SIG_STATUS),
+		"SIG" dlog_value(SIG_STATUS),
+		0,
+		_sig_handler },
 	{0, NULL, 0, NULL}
 };
 
@@ -286,3 +295,44 @@ proc_daemonize(void)
 	return 0;
 }
 
+int
+proc_workers_spawn(int n)
+{
+	for (int i=1; i<n; i++) {
+		pid_t pid = fork();
+
+		switch (pid) {
+		case -1:
+			LOG_SYS_ERROR("fork() failed for worker %d", i);
+			return 0;
+
+		case 0:		/* worker */
+			_nworkers = 0;
+			return i;
+
+		default:
+			_workers[_nworkers++] = pid;
+		}
+	}
+
+	LOG_INFO("Started %d worker processes", _nworkers);
+	return 0;
+}
+
+void
+proc_workers_signal(int sig)
+{
+	for (int i=0; i<_nworkers; i++) {
+		if (-1 == kill(_workers[i], sig))
+			LOG_SYS_ERROR("Failed to signal worker %d", _workers[i]);
+	}
+}
+
+void
+proc_workers_wait(void)
+{
+	for (int i=0; i<_nworkers; i++) {
+		while (-1 == waitpid(_workers[i], NULL, 0) && errno == EINTR);
+	}
+	_nworkers = 0;
+}
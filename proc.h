@@ -12,6 +12,7 @@
 #define DLOG_SIG_RESTART			HUP
 #define DLOG_SIG_ROTLOG_ROT			USR1
 #define DLOG_SIG_SHUTDOWN			QUIT
+#define DLOG_SIG_STATUS				USR2
 
 struct sig_s
 {
@@ -36,5 +37,10 @@ void	proc_addparam(const char* param);
 int		proc_daemonize(void);
 void	proc_restart_with_newbinary(void);
 
+/* forks the workers 1..n-1, returns the worker index of the caller */
+int		proc_workers_spawn(int n);
+void	proc_workers_signal(int sig);
+void	proc_workers_wait(void);
+
 #endif
 
@@ -3,11 +3,14 @@
 #include <stdio.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <unistd.h>
 #include "def.h"
 #include "log.h"
+#include "env.h"
 #include "coredesc.h"
 #include "rotlog.h"
+#include "writer.h"
 
 static int rotlog_on_activate(struct descriptor* d);
 static int rotlog_post_line_write(struct descriptor* d, ssize_t nbytes, int err);
@@ -18,6 +21,7 @@ rotlog_vfn =
 	.on_activate = &rotlog_on_activate,
 	.on_deactivate = NULL,
 	.pre_read = NULL,
+	.pre_write = NULL,
 	.post_line_write = rotlog_post_line_write,
 	.state = NULL
 };
@@ -50,7 +54,11 @@ rotlog_post_line_write(struct descriptor* d, ssize_t nbytes, int err)
 {
 	int *cur_file_size = (int *)d->vfn.state;
 
-	*cur_file_size += nbytes;
+	/* the other workers append to the file too */
+	if (dlogenv->config.workers > 1)
+		*cur_file_size = lseek(d->fd, 0, SEEK_CUR);
+	else
+		*cur_file_size += nbytes;
 	if (*cur_file_size < d->origin->file.size) {
 		return 0;
 	}
@@ -60,30 +68,62 @@ rotlog_post_line_write(struct descriptor* d, ssize_t nbytes, int err)
 	return 0;
 }
 
-void
-rotlog_rotate(descriptor* d)
+int
+rotlog_rename(int fd, const char* path)
 {
 	struct tm tme;
 	struct timespec ts;
+	struct stat fst, pst;
 	char *fbuf;
 	char tbuf[16];
-	int r;
-
+	int r = 0;
+
+	/* workers share the file, the first one to get here renames it
+	   and the others only reopen. the path may be gone for a while,
+	   renamed by one that didn't reopen yet */
+	flock(fd, LOCK_EX);
+	if (-1 == stat(path, &pst)) {
+		if (errno != ENOENT)
+			r = -1;
+		goto out;
+	}
+	if (0 == fstat(fd, &fst) && fst.st_ino != pst.st_ino)
+		goto out;
 
 	clock_gettime(CLOCK_REALTIME, &ts);
 	localtime_r(&ts.tv_sec, &tme);
 	strftime(tbuf, sizeof(tbuf), DLOG_ROTLOG_TIMESTAMPEXT, &tme);
 
-	asprintf(&fbuf, "%s.%s", d->origin->file.path, tbuf);
-	close(d->fd);
-	if ((r = rename(d->origin->file.path, fbuf)) == -1) {
+	/* rotated more than once within the second */
+	asprintf(&fbuf, "%s.%s", path, tbuf);
+	for (int i=1; 0 == access(fbuf, F_OK); i++) {
+		free(fbuf);
+		asprintf(&fbuf, "%s.%s.%d", path, tbuf, i);
+	}
+	r = rename(path, fbuf);
+	free(fbuf);
+out:
+	flock(fd, LOCK_UN);
+	return r;
+}
+
+void
+rotlog_rotate(descriptor* d)
+{
+	/* the writer thread owns the file */
+	if (d->writer) {
+		writer_rotate(d->writer);
+		return;
+	}
+
+	if (rotlog_rename(d->fd, d->origin->file.path) == -1) {
 		LOG_SYS_ERROR("Rotation log failed to rename file. Will"
 					  " continue to write into the same file.");
 	} else {
-		open_descriptor(d->origin, d, &rotlog_vfn, DOPEN_NOFLAGS);
+		/* off the active list, reopening puts it back */
+		reset_descriptor(d);
+		open_descriptor(d->origin, d, &rotlog_vfn, DOPEN_KEEP_BUFFERS);
 	}
-
-	free(fbuf);
 }
 
 #if 0
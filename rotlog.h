@@ -4,4 +4,8 @@
 descriptor* open_rotlog(dorigin* );
 void		rotlog_rotate(descriptor* );
 
+/* renames the file open as 'fd' aside with a timestamp, unless another
+   worker did already. -1 on failure */
+int			rotlog_rename(int fd, const char* path);
+
 #endif
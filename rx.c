@@ -0,0 +1,1042 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "rx.h"
+
+#define RX_MAX_INSNS	20000	/* compiled program size */
+#define RX_MAX_REPEAT	1000	/* {n,m} bounds */
+#define RX_MAX_DEPTH	200		/* nested groups */
+
+enum
+{
+	I_CHAR,		/* x: byte */
+	I_SET,		/* x: set index */
+	I_SPLIT,	/* x: preferred, y: other */
+	I_JMP,		/* x: target */
+	I_SAVE,		/* x: capture slot */
+	I_BOL,
+	I_EOL,
+	I_MATCH
+};
+
+struct rx_insn
+{
+	int op;
+	int x;
+	int y;
+};
+
+typedef struct
+{
+	uint64_t w[4];
+} rx_set;
+
+#define SET_HAS(s, c)	((s)->w[(c) >> 6] & (1ULL << ((c) & 63)))
+#define SET_ADD(s, c)	((s)->w[(c) >> 6] |= (1ULL << ((c) & 63)))
+
+/* parse tree, only lives while compiling */
+enum
+{
+	N_EMPTY,
+	N_CHAR,
+	N_SET,
+	N_BOL,
+	N_EOL,
+	N_CAT,
+	N_ALT,
+	N_REP,
+	N_GROUP
+};
+
+struct rx_node
+{
+	int type;
+	int c;				/* byte or set index */
+	int min, max;		/* N_REP, max -1 if unbounded */
+	bool greedy;
+	int group;			/* N_GROUP, 0 if not capturing */
+	struct rx_node *l, *r;
+	struct rx_node *all;
+};
+
+struct rx_parse
+{
+	const char		*p;
+	const char		*err;
+	rx				*r;
+	struct rx_node	*nodes;
+	int				 depth;
+	int				 dotset;
+};
+
+/* addthread work, either a pc to follow or a capture to restore */
+struct rx_job
+{
+	int pc;
+	int slot;
+	int val;
+};
+
+struct rx_list
+{
+	int n;
+	int *pc;
+	int *caps;		/* nslots per thread */
+};
+
+struct dfa_state
+{
+	int			*pcs;		/* sorted, consuming insns and pending '$' */
+	int			 npcs;
+	unsigned	 hash;
+	bool		 match;
+	bool		 eol;
+	int			*next;		/* by byte class, -1 if not built yet */
+};
+
+struct rx
+{
+	struct rx_insn	*code;
+	int				 ncode;
+	rx_set			*sets;
+	int				 nsets;
+	int				 ngroups;
+	int				 nslots;
+	bool			 anchored;
+
+	/* lazy DFA, states are built on first use */
+	unsigned char		 cmap[256];
+	int					 ncls;
+	struct dfa_state	*states;
+	int					 nstates;
+	int					*htab;		/* state index + 1 */
+	int					 start;		/* -1 if not built */
+
+	/* scratch */
+	unsigned		*mark;
+	unsigned		 gen;
+	struct rx_job	*stack;
+	struct rx_list	 list[2];
+	int				*tmp;
+	int				*out;
+	int				*buf;
+};
+
+#define HTAB_SIZE	(2 * DLOG_RX_DFA_STATES)
+
+/*
+ * parser
+ */
+
+static struct rx_node* _parse_alt(struct rx_parse* ps);
+static void _alloc_scratch(rx* r);
+
+static struct rx_node*
+_node(struct rx_parse* ps, int type, struct rx_node* l, struct rx_node* r)
+{
+	struct rx_node* n = calloc(1, sizeof(*n));
+
+	n->type = type;
+	n->l = l;
+	n->r = r;
+	n->all = ps->nodes;
+	ps->nodes = n;
+	return n;
+}
+
+static int
+_set_add(rx* r, const rx_set* s)
+{
+	r->sets = realloc(r->sets, (r->nsets + 1) * sizeof(rx_set));
+	r->sets[r->nsets] = *s;
+	return r->nsets++;
+}
+
+static void
+_set_class(rx_set* s, int cls)
+{
+	for (int c=0; c<256; c++) {
+		bool in;
+
+		switch (tolower(cls)) {
+			case 'd': in = isdigit(c); break;
+			case 'w': in = isalnum(c) || c == '_'; break;
+			default: in = isspace(c); break;
+		}
+		if (isupper(cls))
+			in = !in;
+		if (in)
+			SET_ADD(s, c);
+	}
+}
+
+static int
+_hexval(int c)
+{
+	if (isdigit(c))
+		return c - '0';
+	if (isxdigit(c))
+		return tolower(c) - 'a' + 10;
+	return -1;
+}
+
+/* after a backslash, returns 1 for a byte in 'ch', 2 for a class in 's' */
+static int
+_parse_escape(struct rx_parse* ps, int* ch, rx_set* s)
+{
+	int c = (unsigned char)*ps->p;
+
+	if (!c) {
+		ps->err = "trailing backslash";
+		return 0;
+	}
+	ps->p++;
+
+	switch (c) {
+		case 'd': case 'D': case 'w': case 'W': case 's': case 'S':
+			_set_class(s, c);
+			return 2;
+		case 'n': *ch = '\n'; return 1;
+		case 't': *ch = '\t'; return 1;
+		case 'r': *ch = '\r'; return 1;
+		case 'f': *ch = '\f'; return 1;
+		case 'v': *ch = '\v'; return 1;
+		case 'x':
+			if (_hexval(ps->p[0]) < 0 || _hexval(ps->p[1]) < 0) {
+				ps->err = "invalid \\x escape";
+				return 0;
+			}
+			*ch = _hexval(ps->p[0]) * 16 + _hexval(ps->p[1]);
+			ps->p += 2;
+			return 1;
+	}
+
+	if (isalnum(c)) {
+		ps->err = "unknown escape";
+		return 0;
+	}
+	*ch = c;
+	return 1;
+}
+
+static struct rx_node*
+_parse_class(struct rx_parse* ps)
+{
+	rx_set s = {{0}};
+	bool neg = false, first = true;
+	int lo, hi;
+
+	if (*++ps->p == '^') {
+		neg = true;
+		ps->p++;
+	}
+
+	/* a ']' right after the opening bracket is a literal */
+	while (*ps->p && (*ps->p != ']' || first)) {
+		first = false;
+
+		if (*ps->p == '\\') {
+			ps->p++;
+			switch (_parse_escape(ps, &lo, &s)) {
+				case 0: return NULL;
+				case 2: continue;
+			}
+		} else {
+			lo = (unsigned char)*ps->p++;
+		}
+
+		if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+			ps->p++;
+			if (*ps->p == '\\') {
+				ps->p++;
+				if (_parse_escape(ps, &hi, &s) != 1) {
+					if (!ps->err)
+						ps->err = "invalid range in class";
+					return NULL;
+				}
+			} else {
+				hi = (unsigned char)*ps->p++;
+			}
+			if (hi < lo) {
+				ps->err = "invalid range in class";
+				return NULL;
+			}
+			for (int c=lo; c<=hi; c++)
+				SET_ADD(&s, c);
+		} else {
+			SET_ADD(&s, lo);
+		}
+	}
+
+	if (*ps->p != ']') {
+		ps->err = "missing ']'";
+		return NULL;
+	}
+	ps->p++;
+
+	if (neg) {
+		for (int i=0; i<4; i++)
+			s.w[i] = ~s.w[i];
+	}
+
+	struct rx_node* n = _node(ps, N_SET, NULL, NULL);
+	n->c = _set_add(ps->r, &s);
+	return n;
+}
+
+static struct rx_node*
+_parse_atom(struct rx_parse* ps)
+{
+	struct rx_node* n;
+	rx_set s = {{0}};
+	int c, group = 0;
+
+	switch (*ps->p) {
+		case '(':
+			ps->p++;
+			if (ps->p[0] == '?' && ps->p[1] == ':')
+				ps->p += 2;
+			else
+				group = ++ps->r->ngroups;
+
+			if (++ps->depth > RX_MAX_DEPTH) {
+				ps->err = "groups nested too deep";
+				return NULL;
+			}
+			n = _parse_alt(ps);
+			ps->depth--;
+			if (ps->err)
+				return NULL;
+			if (*ps->p != ')') {
+				ps->err = "missing ')'";
+				return NULL;
+			}
+			ps->p++;
+			n = _node(ps, N_GROUP, n, NULL);
+			n->group = group;
+			return n;
+
+		case '[':
+			return _parse_class(ps);
+
+		case '.':
+			ps->p++;
+			if (ps->dotset < 0) {
+				memset(&s, 0xff, sizeof(s));
+				s.w['\n' >> 6] &= ~(1ULL << ('\n' & 63));
+				ps->dotset = _set_add(ps->r, &s);
+			}
+			n = _node(ps, N_SET, NULL, NULL);
+			n->c = ps->dotset;
+			return n;
+
+		case '^':
+			ps->p++;
+			return _node(ps, N_BOL, NULL, NULL);
+
+		case '$':
+			ps->p++;
+			return _node(ps, N_EOL, NULL, NULL);
+
+		case '*': case '+': case '?':
+			ps->err = "nothing to repeat";
+			return NULL;
+
+		case '\\':
+			ps->p++;
+			switch (_parse_escape(ps, &c, &s)) {
+				case 0:
+					return NULL;
+				case 2:
+					n = _node(ps, N_SET, NULL, NULL);
+					n->c = _set_add(ps->r, &s);
+					return n;
+			}
+			n = _node(ps, N_CHAR, NULL, NULL);
+			n->c = c;
+			return n;
+	}
+
+	n = _node(ps, N_CHAR, NULL, NULL);
+	n->c = (unsigned char)*ps->p++;
+	return n;
+}
+
+static int
+_parse_int(const char** p)
+{
+	int v = 0;
+
+	if (!isdigit(**p))
+		return -1;
+	while (isdigit(**p)) {
+		v = v * 10 + (**p - '0');
+		if (v > RX_MAX_REPEAT)
+			v = RX_MAX_REPEAT + 1;
+		(*p)++;
+	}
+	return v;
+}
+
+/* {n} {n,} {n,m}, anything else is a literal '{' */
+static bool
+_parse_braces(struct rx_parse* ps, int* min, int* max)
+{
+	const char* p = ps->p + 1;
+
+	if ((*min = _parse_int(&p)) < 0)
+		return false;
+
+	*max = *min;
+	if (*p == ',') {
+		p++;
+		*max = *p == '}' ? -1 : _parse_int(&p);
+	}
+	if (*p != '}' || (*max != -1 && *max < 0))
+		return false;
+
+	ps->p = p + 1;
+	return true;
+}
+
+static struct rx_node*
+_parse_repeat(struct rx_parse* ps)
+{
+	struct rx_node* n = _parse_atom(ps);
+	int min, max;
+
+	while (n && !ps->err) {
+		switch (*ps->p) {
+			case '*': min = 0; max = -1; ps->p++; break;
+			case '+': min = 1; max = -1; ps->p++; break;
+			case '?': min = 0; max = 1; ps->p++; break;
+			case '{':
+				if (_parse_braces(ps, &min, &max))
+					break;
+				/* fallthrough */
+			default:
+				return n;
+		}
+
+		if (min > RX_MAX_REPEAT || max > RX_MAX_REPEAT ||
+			(max != -1 && max < min)) {
+			ps->err = "invalid repetition count";
+			return NULL;
+		}
+
+		n = _node(ps, N_REP, n, NULL);
+		n->min = min;
+		n->max = max;
+		n->greedy = true;
+		if (*ps->p == '?') {
+			n->greedy = false;
+			ps->p++;
+		}
+	}
+	return n;
+}
+
+static struct rx_node*
+_parse_concat(struct rx_parse* ps)
+{
+	struct rx_node* n = _node(ps, N_EMPTY, NULL, NULL);
+
+	while (!ps->err && *ps->p && *ps->p != '|' && *ps->p != ')')
+		n = _node(ps, N_CAT, n, _parse_repeat(ps));
+	return n;
+}
+
+static struct rx_node*
+_parse_alt(struct rx_parse* ps)
+{
+	struct rx_node* n = _parse_concat(ps);
+
+	while (!ps->err && *ps->p == '|') {
+		ps->p++;
+		n = _node(ps, N_ALT, n, _parse_concat(ps));
+	}
+	return n;
+}
+
+/*
+ * code generation
+ */
+
+static int
+_emit(struct rx_parse* ps, int op, int x, int y)
+{
+	rx* r = ps->r;
+
+	if (r->ncode == RX_MAX_INSNS) {
+		ps->err = "pattern too large";
+		return 0;
+	}
+	if (!(r->ncode & (r->ncode + 1)))
+		r->code = realloc(r->code, 2 * (r->ncode + 1) * sizeof(struct rx_insn));
+	r->code[r->ncode].op = op;
+	r->code[r->ncode].x = x;
+	r->code[r->ncode].y = y;
+	return r->ncode++;
+}
+
+static void
+_compile(struct rx_parse* ps, struct rx_node* n)
+{
+	rx* r = ps->r;
+	int split, jmp, loop;
+
+	if (ps->err)
+		return;
+
+	switch (n->type) {
+		case N_EMPTY:
+			break;
+
+		case N_CHAR:
+			_emit(ps, I_CHAR, n->c, 0);
+			break;
+
+		case N_SET:
+			_emit(ps, I_SET, n->c, 0);
+			break;
+
+		case N_BOL:
+			_emit(ps, I_BOL, 0, 0);
+			break;
+
+		case N_EOL:
+			_emit(ps, I_EOL, 0, 0);
+			break;
+
+		case N_CAT:
+			_compile(ps, n->l);
+			_compile(ps, n->r);
+			break;
+
+		case N_ALT:
+			split = _emit(ps, I_SPLIT, 0, 0);
+			r->code[split].x = r->ncode;
+			_compile(ps, n->l);
+			jmp = _emit(ps, I_JMP, 0, 0);
+			r->code[split].y = r->ncode;
+			_compile(ps, n->r);
+			r->code[jmp].x = r->ncode;
+			break;
+
+		case N_GROUP:
+			if (n->group)
+				_emit(ps, I_SAVE, 2 * n->group, 0);
+			_compile(ps, n->l);
+			if (n->group)
+				_emit(ps, I_SAVE, 2 * n->group + 1, 0);
+			break;
+
+		case N_REP:
+			for (int i=0; i<n->min; i++)
+				_compile(ps, n->l);
+
+			if (n->max == -1) {
+				/* loop: split body, out; body; jmp loop */
+				loop = split = _emit(ps, I_SPLIT, 0, 0);
+				_compile(ps, n->l);
+				_emit(ps, I_JMP, loop, 0);
+				r->code[split].x = n->greedy ? split + 1 : r->ncode;
+				r->code[split].y = n->greedy ? r->ncode : split + 1;
+				break;
+			}
+
+			/* optional copies, skipping one skips the rest */
+			int first = r->ncode;
+			for (int i=n->min; i<n->max && !ps->err; i++) {
+				split = _emit(ps, I_SPLIT, 0, 0);
+				_compile(ps, n->l);
+				r->code[split].x = split + 1;
+			}
+			for (int pc=first; pc<r->ncode && !ps->err; pc++) {
+				if (r->code[pc].op == I_SPLIT && r->code[pc].x == pc + 1 &&
+					r->code[pc].y == 0) {
+					r->code[pc].y = r->ncode;
+					if (!n->greedy) {
+						r->code[pc].y = pc + 1;
+						r->code[pc].x = r->ncode;
+					}
+				}
+			}
+			break;
+	}
+}
+
+/* bytes no instruction tells apart share a class */
+static void
+_build_classes(rx* r)
+{
+	unsigned char map[256], remap[2][256];
+	int n = 1;
+
+	memset(r->cmap, 0, sizeof(r->cmap));
+	for (int pc=0; pc<r->ncode; pc++) {
+		const struct rx_insn* in = &r->code[pc];
+
+		if (in->op != I_CHAR && in->op != I_SET)
+			continue;
+
+		memset(remap, 0xff, sizeof(remap));
+		int nn = 0;
+		for (int c=0; c<256; c++) {
+			int k = in->op == I_CHAR ? c == in->x : !!SET_HAS(&r->sets[in->x], c);
+			if (remap[k][r->cmap[c]] == 0xff)
+				remap[k][r->cmap[c]] = nn++;
+			map[c] = remap[k][r->cmap[c]];
+		}
+		memcpy(r->cmap, map, sizeof(map));
+		n = nn;
+	}
+	r->ncls = n;
+}
+
+rx*
+rx_compile(const char* pattern, const char** err)
+{
+	struct rx_parse ps = { .p = pattern, .dotset = -1 };
+	struct rx_node* tree;
+	rx* r = calloc(1, sizeof(rx));
+
+	ps.r = r;
+	tree = _parse_alt(&ps);
+	if (!ps.err && *ps.p)
+		ps.err = "unmatched ')'";
+	if (!ps.err && r->ngroups >= MAXCAPTURES)
+		ps.err = "too many captures";
+
+	/* group 0 is the whole match */
+	_emit(&ps, I_SAVE, 0, 0);
+	_compile(&ps, tree);
+	_emit(&ps, I_SAVE, 1, 0);
+	_emit(&ps, I_MATCH, 0, 0);
+
+	while (ps.nodes) {
+		struct rx_node* n = ps.nodes;
+		ps.nodes = n->all;
+		free(n);
+	}
+
+	if (ps.err) {
+		*err = ps.err;
+		rx_free(r);
+		return NULL;
+	}
+
+	r->nslots = 2 * (r->ngroups + 1);
+	r->anchored = r->code[1].op == I_BOL;
+	_build_classes(r);
+	_alloc_scratch(r);
+
+	*err = NULL;
+	return r;
+}
+
+rx*
+rx_clone(const rx* src)
+{
+	rx* r = malloc(sizeof(rx));
+
+	memcpy(r, src, sizeof(rx));
+	r->code = malloc(r->ncode * sizeof(struct rx_insn));
+	memcpy(r->code, src->code, r->ncode * sizeof(struct rx_insn));
+	r->sets = malloc((r->nsets ? r->nsets : 1) * sizeof(rx_set));
+	memcpy(r->sets, src->sets, r->nsets * sizeof(rx_set));
+	r->nstates = 0;
+	_alloc_scratch(r);
+	return r;
+}
+
+static void
+_alloc_scratch(rx* r)
+{
+	r->states = calloc(DLOG_RX_DFA_STATES, sizeof(struct dfa_state));
+	r->htab = calloc(HTAB_SIZE, sizeof(int));
+	r->start = -1;
+
+	r->mark = calloc(r->ncode, sizeof(unsigned));
+	r->stack = malloc((2 * r->ncode + 2) * sizeof(struct rx_job));
+	for (int i=0; i<2; i++) {
+		r->list[i].pc = malloc(r->ncode * sizeof(int));
+		r->list[i].caps = malloc(r->ncode * r->nslots * sizeof(int));
+	}
+	r->tmp = malloc(r->nslots * sizeof(int));
+	r->out = malloc(r->nslots * sizeof(int));
+	r->buf = malloc(r->ncode * sizeof(int));
+	r->gen = 0;
+}
+
+static void
+_dfa_reset(rx* r)
+{
+	for (int i=0; i<r->nstates; i++) {
+		free(r->states[i].pcs);
+		free(r->states[i].next);
+	}
+	r->nstates = 0;
+	r->start = -1;
+	if (r->htab)
+		memset(r->htab, 0, HTAB_SIZE * sizeof(int));
+}
+
+void
+rx_free(rx* r)
+{
+	if (!r)
+		return;
+	_dfa_reset(r);
+	free(r->states);
+	free(r->htab);
+	free(r->code);
+	free(r->sets);
+	free(r->mark);
+	free(r->stack);
+	for (int i=0; i<2; i++) {
+		free(r->list[i].pc);
+		free(r->list[i].caps);
+	}
+	free(r->tmp);
+	free(r->out);
+	free(r->buf);
+	free(r);
+}
+
+int
+rx_ngroups(const rx* r)
+{
+	return r->ngroups;
+}
+
+/*
+ * matching
+ */
+
+static inline bool
+_at_eol(const char* s, size_t len, size_t pos)
+{
+	return pos == len || (pos + 1 == len && s[pos] == '\n');
+}
+
+static inline bool
+_consumes(const rx* r, const struct rx_insn* in, unsigned char c)
+{
+	return in->op == I_CHAR ? in->x == c : SET_HAS(&r->sets[in->x], c);
+}
+
+/* start a new round of visited marks, clear them all when the
+ * generation wraps so a stale mark can't pass for a current one */
+static inline void
+_next_gen(rx* r)
+{
+	if (++r->gen == 0) {
+		memset(r->mark, 0, r->ncode * sizeof(unsigned));
+		r->gen = 1;
+	}
+}
+
+/* follow empty transitions from 'pc' for the Pike VM, threads are
+ * added in priority order, each with its own copy of the captures */
+static void
+_addthread(rx* r, struct rx_list* l, int pc0, int* caps,
+		   const char* s, size_t len, size_t pos)
+{
+	struct rx_job* st = r->stack;
+	int sp = 0;
+
+	st[sp].pc = pc0;
+	st[sp++].slot = -1;
+
+	while (sp) {
+		struct rx_job j = st[--sp];
+		int pc = j.pc;
+
+		if (j.slot >= 0) {
+			caps[j.slot] = j.val;
+			continue;
+		}
+
+		while (r->mark[pc] != r->gen) {
+			const struct rx_insn* in = &r->code[pc];
+
+			r->mark[pc] = r->gen;
+
+			if (in->op == I_JMP) {
+				pc = in->x;
+			} else if (in->op == I_SPLIT) {
+				st[sp].pc = in->y;
+				st[sp++].slot = -1;
+				pc = in->x;
+			} else if (in->op == I_SAVE) {
+				st[sp].slot = in->x;
+				st[sp++].val = caps[in->x];
+				caps[in->x] = pos;
+				pc++;
+			} else if (in->op == I_BOL) {
+				if (pos != 0)
+					break;
+				pc++;
+			} else if (in->op == I_EOL) {
+				if (!_at_eol(s, len, pos))
+					break;
+				pc++;
+			} else {
+				l->pc[l->n] = pc;
+				memcpy(l->caps + l->n * r->nslots, caps, r->nslots * sizeof(int));
+				l->n++;
+				break;
+			}
+		}
+	}
+}
+
+/* leftmost match, earlier alternatives and greedy loops first */
+static bool
+_pike(rx* r, const char* s, size_t len)
+{
+	struct rx_list *cl = &r->list[0], *nl = &r->list[1], *t;
+	bool matched = false;
+
+	cl->n = 0;
+	_next_gen(r);
+
+	for (size_t pos=0; ; pos++) {
+		/* a new thread at each position, lowest priority */
+		if (!matched && (pos == 0 || !r->anchored)) {
+			for (int i=0; i<r->nslots; i++)
+				r->tmp[i] = -1;
+			_addthread(r, cl, 0, r->tmp, s, len, pos);
+		}
+		if (!cl->n && (matched || r->anchored))
+			break;
+
+		_next_gen(r);
+		nl->n = 0;
+		for (int i=0; i<cl->n; i++) {
+			const struct rx_insn* in = &r->code[cl->pc[i]];
+			int* caps = cl->caps + i * r->nslots;
+
+			if (in->op == I_MATCH) {
+				memcpy(r->out, caps, r->nslots * sizeof(int));
+				matched = true;
+				/* lower priority threads can't win */
+				break;
+			}
+			if (pos < len && _consumes(r, in, (unsigned char)s[pos])) {
+				memcpy(r->tmp, caps, r->nslots * sizeof(int));
+				_addthread(r, nl, cl->pc[i] + 1, r->tmp, s, len, pos + 1);
+			}
+		}
+
+		if (pos == len)
+			break;
+		t = cl; cl = nl; nl = t;
+	}
+	return matched;
+}
+
+/* follow empty transitions for the DFA, '$' stays pending unless 'eol' */
+static void
+_dfa_closure(rx* r, int pc0, bool bol, bool eol, int* set, int* n)
+{
+	struct rx_job* st = r->stack;
+	int sp = 0;
+
+	st[sp++].pc = pc0;
+	while (sp) {
+		int pc = st[--sp].pc;
+
+		while (r->mark[pc] != r->gen) {
+			const struct rx_insn* in = &r->code[pc];
+
+			r->mark[pc] = r->gen;
+
+			if (in->op == I_JMP) {
+				pc = in->x;
+			} else if (in->op == I_SPLIT) {
+				st[sp++].pc = in->y;
+				pc = in->x;
+			} else if (in->op == I_SAVE) {
+				pc++;
+			} else if (in->op == I_BOL) {
+				if (!bol)
+					break;
+				pc++;
+			} else if (in->op == I_EOL && eol) {
+				pc++;
+			} else {
+				set[(*n)++] = pc;
+				break;
+			}
+		}
+	}
+}
+
+static int
+_cmp_int(const void* a, const void* b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+/* the state for a set of pcs, -1 if the cache is full */
+static int
+_dfa_state(rx* r, int* pcs, int n)
+{
+	unsigned h = 2166136261u;
+	struct dfa_state* st;
+	int slot;
+
+	qsort(pcs, n, sizeof(int), _cmp_int);
+	for (int i=0; i<n; i++)
+		h = (h ^ pcs[i]) * 16777619u;
+
+	for (slot = h % HTAB_SIZE; r->htab[slot]; slot = (slot + 1) % HTAB_SIZE) {
+		st = &r->states[r->htab[slot] - 1];
+		if (st->hash == h && st->npcs == n &&
+			!memcmp(st->pcs, pcs, n * sizeof(int)))
+			return r->htab[slot] - 1;
+	}
+
+	if (r->nstates == DLOG_RX_DFA_STATES)
+		return -1;
+
+	st = &r->states[r->nstates];
+	st->pcs = malloc((n ? n : 1) * sizeof(int));
+	memcpy(st->pcs, pcs, n * sizeof(int));
+	st->npcs = n;
+	st->hash = h;
+	st->match = st->eol = false;
+	for (int i=0; i<n; i++) {
+		st->match |= r->code[pcs[i]].op == I_MATCH;
+		st->eol |= r->code[pcs[i]].op == I_EOL;
+	}
+	st->next = malloc(r->ncls * sizeof(int));
+	for (int i=0; i<r->ncls; i++)
+		st->next[i] = -1;
+
+	r->htab[slot] = ++r->nstates;
+	return r->nstates - 1;
+}
+
+static int
+_dfa_next(rx* r, int from, unsigned char c)
+{
+	struct dfa_state* st = &r->states[from];
+	int n = 0, to;
+
+	if (st->next[r->cmap[c]] != -1)
+		return st->next[r->cmap[c]];
+
+	_next_gen(r);
+	for (int i=0; i<st->npcs; i++) {
+		const struct rx_insn* in = &r->code[st->pcs[i]];
+
+		if ((in->op == I_CHAR || in->op == I_SET) && _consumes(r, in, c))
+			_dfa_closure(r, st->pcs[i] + 1, false, false, r->buf, &n);
+	}
+	if (!r->anchored)
+		_dfa_closure(r, 0, false, false, r->buf, &n);
+
+	if ((to = _dfa_state(r, r->buf, n)) != -1)
+		r->states[from].next[r->cmap[c]] = to;
+	return to;
+}
+
+/* whether a pending '$' leads to a match here. before a final newline
+ * what follows the '$' can still take that newline */
+static bool
+_dfa_eol_match(rx* r, const struct dfa_state* st, const char* s, size_t len, size_t pos)
+{
+	int* next = r->list[0].pc;	/* the Pike VM's, free here */
+	int n = 0, m = 0;
+
+	_next_gen(r);
+	for (int i=0; i<st->npcs; i++) {
+		if (r->code[st->pcs[i]].op == I_EOL)
+			_dfa_closure(r, st->pcs[i] + 1, pos == 0, true, r->buf, &n);
+	}
+	for (int i=0; i<n; i++) {
+		if (r->code[r->buf[i]].op == I_MATCH)
+			return true;
+	}
+	if (pos == len)
+		return false;
+
+	_next_gen(r);
+	for (int i=0; i<n; i++) {
+		const struct rx_insn* in = &r->code[r->buf[i]];
+
+		if ((in->op == I_CHAR || in->op == I_SET) && _consumes(r, in, (unsigned char)s[pos]))
+			_dfa_closure(r, r->buf[i] + 1, false, true, next, &m);
+	}
+	for (int i=0; i<m; i++) {
+		if (r->code[next[i]].op == I_MATCH)
+			return true;
+	}
+	return false;
+}
+
+/* 1 on a match, 0 if none, -1 if the cache filled up */
+static int
+_dfa_search(rx* r, const char* s, size_t len)
+{
+	const struct dfa_state* st;
+	int cur, n = 0;
+
+	if (r->start == -1) {
+		_next_gen(r);
+		_dfa_closure(r, 0, true, false, r->buf, &n);
+		if ((r->start = _dfa_state(r, r->buf, n)) == -1)
+			return -1;
+	}
+
+	cur = r->start;
+	for (size_t pos=0; ; pos++) {
+		st = &r->states[cur];
+		if (st->match)
+			return 1;
+		if (st->eol && _at_eol(s, len, pos) && _dfa_eol_match(r, st, s, len, pos))
+			return 1;
+		if (pos == len || !st->npcs)
+			return 0;
+		if ((cur = _dfa_next(r, cur, (unsigned char)s[pos])) == -1)
+			return -1;
+	}
+}
+
+int
+rx_match(rx* r, const char* s, size_t len, struct str_match* m)
+{
+	int ret;
+
+	m->sm_str = s;
+	m->sm_nmatch = 0;
+
+	/* most lines don't match, the DFA rejects them without captures */
+	if (!(ret = _dfa_search(r, s, len)))
+		return 0;
+	if (ret == -1)
+		_dfa_reset(r);
+
+	if (!_pike(r, s, len))
+		return 0;
+
+	m->sm_find[0].sm_so = 0;
+	m->sm_find[0].sm_eo = len;
+	if (!r->ngroups) {
+		m->sm_find[1].sm_so = r->out[0];
+		m->sm_find[1].sm_eo = r->out[1];
+		m->sm_nmatch = 2;
+		return 1;
+	}
+
+	for (int g=1; g<=r->ngroups; g++) {
+		/* groups that took no part are empty */
+		m->sm_find[g].sm_so = r->out[2*g] < 0 ? 0 : r->out[2*g];
+		m->sm_find[g].sm_eo = r->out[2*g+1] < 0 ? 0 : r->out[2*g+1];
+	}
+	m->sm_nmatch = r->ngroups + 1;
+	return 1;
+}
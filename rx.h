@@ -0,0 +1,32 @@
+#ifndef DLOG_RX_H__
+#define DLOG_RX_H__
+#include "def.h"
+#include "patterns.h"
+
+/*
+ * Regular expressions matched in time linear in the subject length.
+ * A lazily built DFA tells whether a line matches, captures are then
+ * taken by a Pike VM (Thompson NFA tracking submatches).
+ *
+ * Syntax: literals, '.', [] classes, \d \w \s (and negations), ^ $,
+ * ( ) groups, (?: ) non capturing groups, |, * + ? {n} {n,} {n,m},
+ * and their lazy variants ending in '?'. '.' doesn't match a newline,
+ * '$' matches at the end or before a final newline.
+ *
+ * A compiled expression keeps its DFA cache and scratch space, it
+ * must not be used by two matches at the same time. A clone shares
+ * nothing with the original and can be used by another thread.
+ */
+typedef struct rx rx;
+
+rx*			rx_compile(const char* pattern, const char** err);
+rx*			rx_clone(const rx*);
+void		rx_free(rx*);
+int			rx_ngroups(const rx*);
+
+/* captures are filled like str_match_pattern() does: 0 is the whole
+ * subject, then the groups (or the whole match if there are none).
+ * returns 1 on a match, 0 otherwise */
+int			rx_match(rx*, const char* s, size_t len, struct str_match* m);
+
+#endif
@@ -0,0 +1,109 @@
+#include <string.h>
+#include <stdint.h>
+#include "def.h"
+#include "scan.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef int (*scan_fn)(const char*, int, char, int, int*, int);
+
+static int	_scan_resolve(const char*, int, char, int, int*, int);
+static scan_fn _scan = _scan_resolve;
+static const char* _scan_name = "none";
+
+static int
+_scan_scalar(const char* buf, int len, char ch, int base, int* offs, int max)
+{
+	const char *p = buf, *end = buf + len;
+	int n = 0;
+
+	while (n < max && p < end && (p = memchr(p, ch, end - p))) {
+		offs[n++] = base + (int)(p - buf);
+		p++;
+	}
+	return n;
+}
+
+#ifdef SCAN_X86
+
+/* emit one offset per set bit of a compare mask */
+#define SCAN_EMIT(mask, pos) \
+	do { while ((mask) && n < max) {\
+		offs[n++] = base + (pos) + __builtin_ctz(mask);\
+		(mask) &= (mask) - 1;\
+	} } while(0)
+
+static int
+_scan_sse2(const char* buf, int len, char ch, int base, int* offs, int max)
+{
+	const __m128i needle = _mm_set1_epi8(ch);
+	int i = 0, n = 0;
+
+	for (; i + 16 <= len && n < max; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+		SCAN_EMIT(mask, i);
+	}
+
+	if (n < max && i < len)
+		n += _scan_scalar(buf + i, len - i, ch, base + i, offs + n, max - n);
+	return n;
+}
+
+__attribute__((target("avx2")))
+static int
+_scan_avx2(const char* buf, int len, char ch, int base, int* offs, int max)
+{
+	const __m256i needle = _mm256_set1_epi8(ch);
+	int i = 0, n = 0;
+
+	for (; i + 32 <= len && n < max; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+		unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+		SCAN_EMIT(mask, i);
+	}
+
+	if (n < max && i < len)
+		n += _scan_sse2(buf + i, len - i, ch, base + i, offs + n, max - n);
+	return n;
+}
+#endif
+
+/* first call picks the implementation */
+static int
+_scan_resolve(const char* buf, int len, char ch, int base, int* offs, int max)
+{
+	(void) scan_impl_name();
+	return _scan(buf, len, ch, base, offs, max);
+}
+
+int
+scan_bytes(const char* buf, int len, char ch, int base, int* offs, int max)
+{
+	if (len <= 0 || max <= 0)
+		return 0;
+	return _scan(buf, len, ch, base, offs, max);
+}
+
+const char*
+scan_impl_name(void)
+{
+	if (_scan == _scan_resolve) {
+		_scan = _scan_scalar;
+		_scan_name = "scalar";
+#ifdef SCAN_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			_scan = _scan_avx2;
+			_scan_name = "avx2";
+		} else {
+			_scan = _scan_sse2;
+			_scan_name = "sse2";
+		}
+#endif
+	}
+	return _scan_name;
+}
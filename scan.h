@@ -0,0 +1,12 @@
+#ifndef DLOG_SCAN_H__
+#define DLOG_SCAN_H__
+
+/*
+ * Find every occurrence of 'ch' in buf[0, len) and store its offset
+ * (plus 'base') into 'offs'. Returns the number of offsets found, stops
+ * early when 'max' is reached. Vectorised where the cpu allows it.
+ */
+int		scan_bytes(const char* buf, int len, char ch, int base, int* offs, int max);
+const char* scan_impl_name(void);
+
+#endif
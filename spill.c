@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "spill.h"
+#include "log.h"
+
+/*
+ * segments 'first' to 'last' hold what is left, 'first' is read from its
+ * mapping and 'last' is appended to. the ones in between are never
+ * written again
+ */
+struct spill
+{
+	char		*dir;
+	char		*name;
+	size_t		 max_bytes;
+	size_t		 bytes;		/* not written yet */
+	bool		 full;		/* an append failed */
+
+	unsigned	 last;
+	int			 fd;		/* of 'last', -1 until the next append */
+	size_t		 size;		/* of 'last' */
+
+	unsigned	 first;
+	char		*map;		/* of 'first', NULL until the next read */
+	size_t		 map_len;
+	size_t		 off;		/* written of the mapping */
+};
+
+#define SPILL_FILE_MODE (S_IRUSR | S_IWUSR)
+
+static void
+_path(const spill* sp, unsigned seq, char* path)
+{
+	snprintf(path, DLOG_PATH_MAX, "%s/%s.%08u", sp->dir, sp->name, seq);
+}
+
+/* appends go to a new segment, this one can be read */
+static void
+_seal(spill* sp)
+{
+	close(sp->fd);
+	sp->fd = -1;
+	sp->size = 0;
+	sp->last++;
+}
+
+/* done with the segment read */
+static void
+_next(spill* sp)
+{
+	char path[DLOG_PATH_MAX];
+
+	if (sp->map)
+		munmap(sp->map, sp->map_len);
+	sp->map = NULL;
+	sp->map_len = 0;
+	sp->off = 0;
+
+	_path(sp, sp->first++, path);
+	unlink(path);
+}
+
+spill*
+spill_open(const char* dir, const char* name, size_t max_bytes)
+{
+	char path[DLOG_PATH_MAX];
+	size_t len = strlen(name);
+	struct dirent* e;
+	struct stat st;
+	bool found = false;
+	spill* sp;
+	DIR* dp;
+
+	if (-1 == mkdir(dir, S_IRWXU) && errno != EEXIST) {
+		LOG_SYS_ERROR("Failed to create spill directory %s", dir);
+		return NULL;
+	}
+	if (!(dp = opendir(dir))) {
+		LOG_SYS_ERROR("Failed to open spill directory %s", dir);
+		return NULL;
+	}
+
+	sp = calloc(1, sizeof(spill));
+	sp->dir = strdup(dir);
+	sp->name = strdup(name);
+	sp->max_bytes = max_bytes;
+	sp->fd = -1;
+
+	/* left by the previous run, appends go after them */
+	while ((e = readdir(dp))) {
+		const char* seq = e->d_name + len;
+		unsigned n;
+
+		if (strncmp(e->d_name, name, len) || *seq++ != '.' ||
+			strlen(seq) != 8 || strspn(seq, "0123456789") != 8)
+			continue;
+
+		n = strtoul(seq, NULL, 10);
+		if (!found || n < sp->first)
+			sp->first = n;
+		if (!found || n >= sp->last)
+			sp->last = n + 1;
+		found = true;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		if (0 == stat(path, &st))
+			sp->bytes += st.st_size;
+	}
+	closedir(dp);
+
+	if (sp->bytes)
+		LOG_INFO("Spill %s: %zu bytes left by the previous run", name, sp->bytes);
+	return sp;
+}
+
+void
+spill_close(spill* sp, const char* head, size_t head_len)
+{
+	char path[DLOG_PATH_MAX], tmp[DLOG_PATH_MAX + 8];
+	const char* rest = NULL;
+	ssize_t len = 0;
+	int fd;
+
+	if (!sp)
+		return;
+
+	/* the line cut short is sent whole by the next run */
+	spill_rewind(sp);
+	if (head_len || (sp->map && sp->off)) {
+		/* maps the oldest segment, if any is left */
+		len = spill_peek(sp, &rest);
+
+		_path(sp, sp->first, path);
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+		if (-1 == (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, SPILL_FILE_MODE)) ||
+			(head_len && write(fd, head, head_len) != (ssize_t)head_len) ||
+			(len && write(fd, rest, len) != len) || -1 == rename(tmp, path)) {
+			LOG_SYS_ERROR("Failed to rewrite spill segment %s", path);
+			unlink(tmp);
+		} else {
+			sp->bytes += head_len;
+		}
+		if (fd != -1)
+			close(fd);
+	}
+
+	if (sp->map)
+		munmap(sp->map, sp->map_len);
+	if (sp->fd != -1)
+		close(sp->fd);
+
+	if (sp->bytes)
+		LOG_INFO("Spill %s: %zu bytes left for the next run", sp->name, sp->bytes);
+
+	free(sp->dir);
+	free(sp->name);
+	free(sp);
+}
+
+ssize_t
+spill_writev(spill* sp, const struct iovec* iov, int n)
+{
+	char path[DLOG_PATH_MAX];
+	size_t len = 0;
+	ssize_t r;
+
+	for (int i=0; i<n; i++)
+		len += iov[i].iov_len;
+
+	if (sp->bytes + len > sp->max_bytes) {
+		if (!sp->full)
+			LOG_ERROR("Spill %s full (%zu bytes)", sp->name, sp->max_bytes);
+		sp->full = true;
+		return -1;
+	}
+
+	if (sp->fd != -1 && sp->size >= DLOG_SPILL_SEGMENT)
+		_seal(sp);
+
+	if (sp->fd == -1) {
+		_path(sp, sp->last, path);
+		sp->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+					  SPILL_FILE_MODE);
+		if (sp->fd == -1) {
+			if (!sp->full)
+				LOG_SYS_ERROR("Failed to create spill segment %s", path);
+			sp->full = true;
+			return -1;
+		}
+	}
+
+	/* a regular file takes all of it, unless out of space */
+	if ((r = writev(sp->fd, iov, n)) != (ssize_t)len) {
+		if (r != -1)
+			errno = ENOSPC;
+		if (!sp->full)
+			LOG_SYS_ERROR("Failed to spill %s", sp->name);
+		ftruncate(sp->fd, sp->size);
+		sp->full = true;
+		return -1;
+	}
+
+	sp->size += len;
+	sp->bytes += len;
+	return len;
+}
+
+size_t
+spill_peek(spill* sp, const char** p)
+{
+	char path[DLOG_PATH_MAX];
+	struct stat st;
+	int fd;
+
+	while (!sp->map) {
+		if (sp->first == sp->last) {
+			if (sp->fd == -1 || !sp->size) {
+				sp->bytes = 0;
+				return 0;
+			}
+			_seal(sp);
+		}
+
+		_path(sp, sp->first, path);
+		if (-1 == (fd = open(path, O_RDONLY | O_CLOEXEC))) {
+			LOG_SYS_ERROR("Failed to open spill segment %s, skipped", path);
+			sp->first++;
+			continue;
+		}
+
+		if (0 == fstat(fd, &st) && st.st_size > 0) {
+			sp->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (sp->map == MAP_FAILED) {
+				LOG_SYS_ERROR("Failed to map spill segment %s, skipped", path);
+				sp->map = NULL;
+				sp->bytes -= dlog_min((size_t)st.st_size, sp->bytes);
+			} else {
+				sp->map_len = st.st_size;
+				madvise(sp->map, sp->map_len, MADV_SEQUENTIAL);
+			}
+		}
+		close(fd);
+
+		if (!sp->map)
+			_next(sp);
+	}
+
+	*p = sp->map + sp->off;
+	return sp->map_len - sp->off;
+}
+
+void
+spill_consume(spill* sp, size_t nbytes)
+{
+	sp->off += nbytes;
+	sp->bytes -= dlog_min(nbytes, sp->bytes);
+
+	if (sp->map && sp->off >= sp->map_len)
+		_next(sp);
+	if (sp->full && sp->bytes <= sp->max_bytes / 2)
+		sp->full = false;
+}
+
+void
+spill_rewind(spill* sp)
+{
+	size_t off = sp->off;
+
+	while (off && sp->map[off - 1] != '\n')
+		off--;
+	sp->bytes += sp->off - off;
+	sp->off = off;
+}
+
+size_t
+spill_bytes(const spill* sp)
+{
+	return sp->bytes;
+}
+
+bool
+spill_full(const spill* sp)
+{
+	return sp->full;
+}
@@ -0,0 +1,37 @@
+#ifndef DLOG_SPILL_H__
+#define DLOG_SPILL_H__
+#include <sys/uio.h>
+#include "def.h"
+
+/*
+ * What a destination can't take for now, on disk. Written to append-only
+ * segment files of DLOG_SPILL_SEGMENT bytes named <dir>/<name>.<seq>, and
+ * read back in order from a mapping of the oldest one, which is unlinked
+ * once written. The segments left at exit are picked up by the next run.
+ */
+typedef struct spill spill;
+
+/* the segments found in 'dir' come first, NULL on failure */
+spill*	spill_open(const char* dir, const char* name, size_t max_bytes);
+
+/* the segment being read is cut down to what wasn't written yet, after
+   'head' (older than the spill, or NULL) */
+void	spill_close(spill*, const char* head, size_t head_len);
+
+/* appends all of it or nothing, -1 if over max_bytes or failed */
+ssize_t	spill_writev(spill*, const struct iovec* iov, int n);
+
+/* the data to write next, 0 if there's nothing left. then take out
+   what was written */
+size_t	spill_peek(spill*, const char** p);
+void	spill_consume(spill*, size_t nbytes);
+
+/* back to the start of the line being written, for a new connection */
+void	spill_rewind(spill*);
+
+size_t	spill_bytes(const spill*);
+
+/* an append failed, until down to half of max_bytes */
+bool	spill_full(const spill*);
+
+#endif
@@ -24,6 +24,7 @@ typedef struct strpartial
 		dynstr* rawstr;
 		int number;
 	} value;
+	int slot;		/* STR_VAR, given by the parser */
 
 	struct strpartial* next;
 } strpartial;
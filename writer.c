@@ -0,0 +1,310 @@
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "writer.h"
+#include "coredesc.h"
+#include "rotlog.h"
+#include "env.h"
+#include "log.h"
+
+/*
+ * lines go round the ring: the event loop pushes them up to 'head',
+ * the thread writes them up to 'done', and the event loop frees them
+ * up to 'tail' as they come from its arena. each index has a single
+ * writer
+ */
+struct writer
+{
+	pthread_t		 thread;
+	descriptor		*d;			/* only its origin is read */
+	int				 fd;
+	off_t			 size;		/* rotlog, of the current file */
+	bool			 shared;	/* appended to by other workers too */
+
+	dynstr			*ring[DLOG_WRITER_QUEUE];
+	unsigned		 head;
+	unsigned		 done;
+	unsigned		 tail;
+	size_t			 bytes;		/* from 'tail' to 'head' */
+	size_t			 max_bytes;
+	unsigned long	 dropped;
+	bool			 full;		/* dropping since the last report */
+
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 work;		/* to the thread */
+	pthread_cond_t	 drained;	/* from the thread, nothing left to write */
+	bool			 rotate;
+	bool			 stop;
+};
+
+static void
+_rotate(writer* w)
+{
+	const char* path = w->d->origin->file.path;
+	int fd;
+
+	if (-1 == rotlog_rename(w->fd, path)) {
+		LOG_SYS_ERROR("Rotation log failed to rename file. Will"
+					  " continue to write into the same file.");
+		return;
+	}
+
+	if (-1 == (fd = open(path, D_FILEW_FLAGS, D_FILEW_MODE))) {
+		LOG_SYS_ERROR("Failed to reopen rotated file %s", path);
+		return;
+	}
+	close(w->fd);
+	w->fd = fd;
+	w->size = 0;
+}
+
+/* all of it, a failed write drops the lines */
+static void
+_writev_all(writer* w, struct iovec* iov, int n)
+{
+	ssize_t r;
+
+	while (n) {
+		if (-1 == (r = writev(w->fd, iov, dlog_min(n, IOV_MAX)))) {
+			if (errno == EINTR)
+				continue;
+			LOG_SYS_ERROR("writev() failed on %s", w->d->origin->symbol);
+			return;
+		}
+
+		/* as rotlog_post_line_write(), the workers share the file */
+		if (w->shared)
+			w->size = lseek(w->fd, 0, SEEK_CUR);
+		else
+			w->size += r;
+		while (n && (size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+}
+
+static void*
+_writer_main(void* arg)
+{
+	writer* w = arg;
+	struct iovec iov[DLOG_WRITER_QUEUE];
+	unsigned done = w->done, head;
+	bool rotate, stop;
+	int n;
+
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		while (done == (head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) &&
+			   !w->rotate && !w->stop) {
+			pthread_cond_broadcast(&w->drained);
+			pthread_cond_wait(&w->work, &w->lock);
+		}
+		rotate = w->rotate;
+		stop = w->stop;
+		w->rotate = false;
+		pthread_mutex_unlock(&w->lock);
+
+		if (rotate)
+			_rotate(w);
+
+		if (done == head) {
+			if (stop)
+				break;
+			continue;
+		}
+
+		for (n=0; done + n != head; n++) {
+			dynstr* line = w->ring[(done + n) % DLOG_WRITER_QUEUE];
+
+			iov[n].iov_base = (void *)dynstr_ptr(line);
+			iov[n].iov_len = dynstr_len(line);
+		}
+		_writev_all(w, iov, n);
+
+		/* same as rotlog_post_line_write() */
+		if (w->d->type == D_ROTLOG && w->size >= w->d->origin->file.size)
+			_rotate(w);
+
+		__atomic_store_n(&w->done, done += n, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* lines written are freed by the event loop */
+static void
+_reclaim(writer* w)
+{
+	unsigned done = __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+
+	for (; w->tail != done; w->tail++) {
+		dynstr* line = w->ring[w->tail % DLOG_WRITER_QUEUE];
+
+		w->bytes -= dynstr_len(line);
+		dynstr_free(line);
+	}
+}
+
+writer*
+writer_start(descriptor* d)
+{
+	writer* w;
+	sigset_t all, old;
+	struct stat st = { 0 };
+	int r;
+
+	/* a file path can name a fifo too, see the fifo destination */
+	if (0 == fstat(d->fd, &st) && S_ISFIFO(st.st_mode)) {
+		LOG_WARNING("%s is a FIFO, writing it from the event loop", d->origin->symbol);
+		return NULL;
+	}
+
+	w = calloc(1, sizeof(writer));
+	w->d = d;
+	w->fd = d->fd;
+	w->shared = dlogenv->config.workers > 1;
+	w->max_bytes = d->origin->write_buffer;
+	w->size = st.st_size;
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work, NULL);
+	pthread_cond_init(&w->drained, NULL);
+
+	/* signals are for the event loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	r = pthread_create(&w->thread, NULL, _writer_main, w);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (r != 0) {
+		LOG_ERROR("Failed to start writer thread for %s, writing from the event loop",
+				  d->origin->symbol);
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->work);
+		pthread_cond_destroy(&w->drained);
+		free(w);
+		return NULL;
+	}
+
+	LOG_DEBUG("Writer thread started for %s", d->origin->symbol);
+	return w;
+}
+
+void
+writer_stop(writer* w)
+{
+	if (!w)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = true;
+	pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	_reclaim(w);
+	if (w->dropped)
+		LOG_WARNING("Destination %s: %lu lines dropped, writer queue full",
+					w->d->origin->symbol, w->dropped);
+
+	w->d->fd = w->fd;
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->work);
+	pthread_cond_destroy(&w->drained);
+	free(w);
+}
+
+/* a line always fits an empty ring */
+static bool
+_room(const writer* w, size_t len)
+{
+	return w->head == w->tail ||
+		(w->head - w->tail < DLOG_WRITER_QUEUE && w->bytes + len <= w->max_bytes);
+}
+
+int
+writer_push(writer* w, dynstr* line)
+{
+	if (!_room(w, dynstr_len(line))) {
+		_reclaim(w);
+		if (!_room(w, dynstr_len(line))) {
+			writer_kick(w);
+			if (!w->full)
+				LOG_ERROR("Writer queue of %s full, dropping lines", w->d->origin->symbol);
+			w->full = true;
+			w->dropped++;
+			return -1;
+		}
+	}
+
+	w->full = false;
+	w->ring[w->head % DLOG_WRITER_QUEUE] = line;
+	w->bytes += dynstr_len(line);
+	__atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void
+writer_kick(writer* w)
+{
+	_reclaim(w);
+
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+}
+
+void
+writer_flush(writer* w)
+{
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->work);
+	while (__atomic_load_n(&w->done, __ATOMIC_ACQUIRE) != w->head)
+		pthread_cond_wait(&w->drained, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+
+	_reclaim(w);
+}
+
+void
+writer_rotate(writer* w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->rotate = true;
+	pthread_cond_signal(&w->work);
+	pthread_mutex_unlock(&w->lock);
+}
+
+int
+writer_depth(const writer* w)
+{
+	return w->head - __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+}
+
+bool
+writer_high(const writer* w)
+{
+	return w->head - w->tail >= DLOG_WRITER_QUEUE / 2 || w->bytes >= w->max_bytes / 2;
+}
+
+bool
+writer_low(const writer* w)
+{
+	return w->head - w->tail <= DLOG_WRITER_QUEUE / 8 && w->bytes <= w->max_bytes / 8;
+}
+
+unsigned long
+writer_dropped(const writer* w)
+{
+	return w->dropped;
+}
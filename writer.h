@@ -0,0 +1,43 @@
+#ifndef DLOG_WRITER_H__
+#define DLOG_WRITER_H__
+#include "def.h"
+#include "dynstr.h"
+
+struct descriptor;
+
+/*
+ * A file destination written by a thread of its own, so a slow disk
+ * doesn't hold up the event loop. Lines are passed over a bounded
+ * single producer/single consumer ring, the thread owns the fd of the
+ * descriptor until stopped. All calls are made from the event loop.
+ */
+typedef struct writer writer;
+
+writer*	writer_start(struct descriptor* d);
+
+/* writes what is queued, the fd goes back to the descriptor */
+void	writer_stop(writer*);
+
+/* queue the line, -1 if the ring is full or over the write_buffer of
+   the destination (the line is not taken) */
+int		writer_push(writer*, dynstr* line);
+
+/* let the thread write what was pushed */
+void	writer_kick(writer*);
+
+/* wait until everything pushed was written */
+void	writer_flush(writer*);
+
+/* rotlog, rotate before the next write */
+void	writer_rotate(writer*);
+
+/* lines not written yet, and dropped as the ring was full */
+int				writer_depth(const writer*);
+unsigned long	writer_dropped(const writer*);
+
+/* backpressure, half of the ring or budget, and an eighth of both. the
+   lines written are only counted out by the other calls */
+bool	writer_high(const writer*);
+bool	writer_low(const writer*);
+
+#endif